@@ -1,24 +1,123 @@
 #include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <cutils/properties.h>
 #include <cutils/log.h>
 
 #define LOG_TAG "bdaddr"
 #define SAMSUNG_BDADDR_PATH "/efs/imei/bt.txt"
 #define BDADDR_PATH "/data/bdaddr"
+#define BDADDR_CACHE_PATH "/data/bdaddr.cache"
+#define BDADDR_CACHE_TMP_PATH "/data/bdaddr.cache.tmp"
+#define BDADDR_CACHE_MAGIC 0x42444331 /* BDC1 */
+#define AID_BLUETOOTH 1002
 
 /* Read bluetooth MAC from SAMSUNG_BDADDR_PATH (different format),
  * write it to BDADDR_PATH, and set ro.bt.bdaddr_path to BDADDR_PATH
  *
+ * The address is remembered in BDADDR_CACHE_PATH along with the size and
+ * mtime of SAMSUNG_BDADDR_PATH it came from, so later boots only have to
+ * stat the factory file and check BDADDR_PATH.
+ *
  * Adapted from bdaddr_read.c of thunderg
  */
 
-int main() {
+struct bdaddr_cache {
+    uint32_t magic;
+    uint32_t src_size;
+    uint32_t src_mtime;
+    char bdaddr[18];
+    uint32_t checksum;
+};
+
+/* FNV-1a over everything but the checksum itself */
+static uint32_t cache_checksum(const struct bdaddr_cache *cache) {
+    const unsigned char *p = (const unsigned char *) cache;
+    size_t len = offsetof(struct bdaddr_cache, checksum);
+    uint32_t hash = 2166136261u;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void cache_init(struct bdaddr_cache *cache, const struct stat *src) {
+    memset(cache, 0, sizeof(*cache));
+    cache->magic = BDADDR_CACHE_MAGIC;
+    cache->src_size = src->st_size;
+    cache->src_mtime = src->st_mtime;
+}
+
+/* The cache is good if it describes the factory file as it is now and
+ * BDADDR_PATH still holds the cached address */
+static int cache_valid(const struct stat *src) {
+    struct bdaddr_cache cache, expected;
+    char bdaddr[sizeof(cache.bdaddr)];
+    int fd, count;
+
+    fd = open(BDADDR_CACHE_PATH, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    count = read(fd, &cache, sizeof(cache));
+    close(fd);
+    if (count != sizeof(cache) || cache.checksum != cache_checksum(&cache))
+        return 0;
+
+    cache_init(&expected, src);
+    if (cache.magic != expected.magic || cache.src_size != expected.src_size ||
+            cache.src_mtime != expected.src_mtime)
+        return 0;
+
+    fd = open(BDADDR_PATH, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    count = read(fd, bdaddr, sizeof(bdaddr));
+    close(fd);
+    return count == sizeof(bdaddr) && !memcmp(bdaddr, cache.bdaddr, sizeof(bdaddr));
+}
+
+static void cache_write(const struct stat *src, const char bdaddr[18]) {
+    struct bdaddr_cache cache;
+    int fd, count;
+
+    cache_init(&cache, src);
+    memcpy(cache.bdaddr, bdaddr, sizeof(cache.bdaddr));
+    cache.checksum = cache_checksum(&cache);
+
+    fd = open(BDADDR_CACHE_TMP_PATH, O_WRONLY|O_CREAT|O_TRUNC, 00640);
+    if (fd < 0) {
+        ALOGW("Can't open %s\n", BDADDR_CACHE_TMP_PATH);
+        return;
+    }
+    // readable by the bluetooth stack, whatever the umask of the caller
+    fchown(fd, -1, AID_BLUETOOTH);
+    fchmod(fd, 00640);
+    count = write(fd, &cache, sizeof(cache));
+    close(fd);
+    if (count != sizeof(cache) || rename(BDADDR_CACHE_TMP_PATH, BDADDR_CACHE_PATH) < 0) {
+        ALOGW("Can't write %s\n", BDADDR_CACHE_PATH);
+        unlink(BDADDR_CACHE_TMP_PATH);
+    }
+}
+
+/* Returns 0 on success, -1 if the factory data can't be read and -2 if
+ * BDADDR_PATH can't be written */
+static int bdaddr_read(void) {
     char tmpbdaddr[23]; // bt_macaddr:xxxxxxxxxxxx
     char bdaddr[18];
+    struct stat src;
     int count;
     int fd;
 
+    if (stat(SAMSUNG_BDADDR_PATH, &src) == 0 && cache_valid(&src))
+        return 0;
+
     fd = open(SAMSUNG_BDADDR_PATH, O_RDONLY);
     if(fd < 0) {
         fprintf(stderr, "open(%s) failed\n", SAMSUNG_BDADDR_PATH);
@@ -30,13 +129,18 @@ int main() {
     if (count < 0) {
         fprintf(stderr, "read(%s) failed\n", SAMSUNG_BDADDR_PATH);
         ALOGE("Can't read %s\n", SAMSUNG_BDADDR_PATH);
+        close(fd);
         return -1;
     }
     else if (count != sizeof(tmpbdaddr)) {
         fprintf(stderr, "read(%s) unexpected size %d\n", SAMSUNG_BDADDR_PATH, count);
         ALOGE("Error reading %s (unexpected size %d)\n", SAMSUNG_BDADDR_PATH, count);
+        close(fd);
         return -1;
     }
+    // stat the file we read, the one above may have raced with an update
+    fstat(fd, &src);
+    close(fd);
 
     count = sprintf(bdaddr, "%2.2s:%2.2s:%2.2s:%2.2s:%2.2s:%2.2s\0",
             tmpbdaddr+11,tmpbdaddr+13,tmpbdaddr+15,tmpbdaddr+17,tmpbdaddr+19,tmpbdaddr+21);
@@ -47,12 +151,21 @@ int main() {
         ALOGE("Can't open %s\n", BDADDR_PATH);
         return -2;
     }
-    write(fd, bdaddr, 18);
+    count = write(fd, bdaddr, 18);
 
     // Set bluetooth owner
-    fchown(fd, 1002, 1002);
+    fchown(fd, AID_BLUETOOTH, AID_BLUETOOTH);
 
     close(fd);
-    property_set("ro.bt.bdaddr_path", BDADDR_PATH);
+    if (count == 18)
+        cache_write(&src, bdaddr);
     return 0;
 }
+
+int main() {
+    int ret = bdaddr_read();
+
+    if (ret == 0)
+        property_set("ro.bt.bdaddr_path", BDADDR_PATH);
+    return ret;
+}
@@ -22,7 +22,12 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -50,7 +55,37 @@
 
 static int rfkill_id = -1;
 static char *rfkill_state_path = NULL;
+/* rfkill state attribute, kept open once found */
+static int rfkill_fd = -1;
+
+/* Raw HCI socket bound to HCI_DEV_NONE: used for the device ioctls and
+ * receives the stack internal events (device registered, up, down) */
+static int hci_ctl_sock = -1;
+/* Raw HCI socket bound to HCI_DEV_ID, opened once the device is up and kept
+ * until bluetoothd has set the adapter up: receives the Command Complete
+ * events of the commands it sends */
+static int hci_dev_sock = -1;
+
+/* progress of bt_enable, for the logs and bt_enable_async */
+enum bt_state {
+    BT_STATE_OFF,
+    BT_STATE_POWER_ON,      /* rfkill on, hciattach loading the firmware */
+    BT_STATE_HCI_WAIT,      /* waiting for the HCI device to come up */
+    BT_STATE_BTD_WAIT,      /* waiting for bluetoothd to talk to the adapter */
+    BT_STATE_ON,
+};
+static volatile enum bt_state bt_state = BT_STATE_OFF;
+
+static void set_bt_state(enum bt_state state) {
+    LOGV("%s: %d -> %d", __FUNCTION__, bt_state, state);
+    bt_state = state;
+}
 
+static int64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
 static int init_rfkill() {
     char path[64];
@@ -74,12 +109,19 @@ static int init_rfkill() {
     }
 
     asprintf(&rfkill_state_path, "/sys/class/rfkill/rfkill%d/state", rfkill_id);
+
+    rfkill_fd = open(rfkill_state_path, O_RDWR);
+    if (rfkill_fd < 0) {
+        LOGE("open(%s) failed: %s (%d)", rfkill_state_path, strerror(errno),
+             errno);
+        rfkill_id = -1;
+        return -1;
+    }
     return 0;
 }
 
 static int check_bluetooth_power() {
     int sz;
-    int fd = -1;
     int ret = -1;
     char buffer;
 
@@ -87,13 +129,7 @@ static int check_bluetooth_power() {
         if (init_rfkill()) goto out;
     }
 
-    fd = open(rfkill_state_path, O_RDONLY);
-    if (fd < 0) {
-        LOGE("open(%s) failed: %s (%d)", rfkill_state_path, strerror(errno),
-             errno);
-        goto out;
-    }
-    sz = read(fd, &buffer, 1);
+    sz = pread(rfkill_fd, &buffer, 1, 0);
     if (sz != 1) {
         LOGE("read(%s) failed: %s (%d)", rfkill_state_path, strerror(errno),
              errno);
@@ -110,13 +146,11 @@ static int check_bluetooth_power() {
     }
 
 out:
-    if (fd >= 0) close(fd);
     return ret;
 }
 
 static int set_bluetooth_power(int on) {
     int sz;
-    int fd = -1;
     int ret = -1;
     const char buffer = (on ? '1' : '0');
 
@@ -124,13 +158,7 @@ static int set_bluetooth_power(int on) {
         if (init_rfkill()) goto out;
     }
 
-    fd = open(rfkill_state_path, O_WRONLY);
-    if (fd < 0) {
-        LOGE("open(%s) for write failed: %s (%d)", rfkill_state_path,
-             strerror(errno), errno);
-        goto out;
-    }
-    sz = write(fd, &buffer, 1);
+    sz = pwrite(rfkill_fd, &buffer, 1, 0);
     if (sz < 0) {
         LOGE("write(%s) failed: %s (%d)", rfkill_state_path, strerror(errno),
              errno);
@@ -139,7 +167,6 @@ static int set_bluetooth_power(int on) {
     ret = 0;
 
 out:
-    if (fd >= 0) close(fd);
     return ret;
 }
 
@@ -152,6 +179,114 @@ static inline int create_hci_sock() {
     return sk;
 }
 
+/* Opens a raw HCI socket bound to dev that only receives the given event
+ * (or all of them if event is -1). Fails with ENODEV while dev is not
+ * registered. */
+static int create_hci_event_sock(int dev, int event) {
+    struct sockaddr_hci addr;
+    struct hci_filter flt;
+    int sk = create_hci_sock();
+
+    if (sk < 0)
+        return -1;
+
+    hci_filter_clear(&flt);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+    if (event < 0)
+        hci_filter_all_events(&flt);
+    else
+        hci_filter_set_event(event, &flt);
+    if (setsockopt(sk, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0) {
+        LOGE("Failed to set hci socket filter: %s (%d)", strerror(errno), errno);
+        goto fail;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.hci_family = AF_BLUETOOTH;
+    addr.hci_dev = dev;
+    if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        goto fail;
+
+    return sk;
+
+fail:
+    close(sk);
+    return -1;
+}
+
+/* Waits up to timeout_ms for sk to become readable and discards what is
+ * there. Returns 1 if something was read, 0 on timeout. */
+static int wait_hci_event(int sk, int timeout_ms) {
+    struct pollfd pfd;
+    unsigned char buf[HCI_MAX_EVENT_SIZE];
+    int ret;
+
+    pfd.fd = sk;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0)
+        return 0;
+
+    while (recv(sk, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+    return 1;
+}
+
+/* Waits up to timeout_ms for the Command Complete event of one of the adapter
+ * setup commands only bluetoothd sends: the kernel init sequence run by
+ * HCIDEVUP reads the local name and class but never writes them. sk must
+ * only receive EVT_CMD_COMPLETE. Returns 1 once seen, 0 on timeout. */
+static int wait_btd_command(int sk, int timeout_ms) {
+    unsigned char buf[HCI_MAX_EVENT_SIZE];
+    int64_t deadline = now_ms() + timeout_ms;
+
+    for (;;) {
+        struct pollfd pfd;
+        int64_t left = deadline - now_ms();
+        int ret;
+
+        if (left <= 0)
+            return 0;
+        pfd.fd = sk;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        ret = poll(&pfd, 1, left);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return 0;
+
+        while ((ret = recv(sk, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            evt_cmd_complete *cc;
+            uint16_t opcode;
+
+            // packet type, event header, then the event parameters
+            if (ret < 1 + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE)
+                continue;
+            cc = (evt_cmd_complete *) (buf + 1 + HCI_EVENT_HDR_SIZE);
+            opcode = btohs(cc->opcode);
+            if (opcode == cmd_opcode_pack(OGF_HOST_CTL, OCF_WRITE_LOCAL_NAME) ||
+                    opcode == cmd_opcode_pack(OGF_HOST_CTL, OCF_WRITE_CLASS_OF_DEV))
+                return 1;
+        }
+    }
+}
+
+static int open_hci_ctl_sock() {
+    if (hci_ctl_sock < 0)
+        hci_ctl_sock = create_hci_event_sock(HCI_DEV_NONE, EVT_STACK_INTERNAL);
+    return hci_ctl_sock;
+}
+
+static void close_hci_dev_sock() {
+    if (hci_dev_sock >= 0) {
+        close(hci_dev_sock);
+        hci_dev_sock = -1;
+    }
+}
 
 static int ll_chip_enable(int reenable) {
     LOGV(__FUNCTION__);
@@ -186,61 +321,106 @@ out:
     return ret;
 }
 
-static int do_chip_enable()
+/* Powers the chip and starts hciattach, which loads the firmware and then
+ * registers the HCI device; chip_wait_up waits for that. */
+static int chip_power_on()
 {
     LOGV(__FUNCTION__);
 
-    int ret = -1;
-    int hci_sock = -1;
-    int attempt;
+    // Listen for the device registration before it can happen
+    if (open_hci_ctl_sock() < 0)
+        return -1;
 
-    if (ll_chip_enable(0) < 0)
-        goto out;
+    set_bt_state(BT_STATE_POWER_ON);
+    return ll_chip_enable(0);
+}
+
+static int chip_wait_up()
+{
+    LOGV(__FUNCTION__);
+
+    int64_t start = now_ms();
+    int64_t deadline = start + HCIA_START_ATTEMPTS * 100;
+    int reenabled = 0;
+
+    set_bt_state(BT_STATE_HCI_WAIT);
 
-    // Wait for the HCI socket to be up; this can only succeed once hciattach
-    // has sent the FW and then turned on hci device via HCIUARTSETPROTO ioctl
-    for (attempt = HCIA_START_ATTEMPTS; attempt > 0;  attempt--) {
-        hci_sock = create_hci_sock();
-        if (hci_sock < 0) goto out;
+    // The HCI device can only come up once hciattach has sent the FW and
+    // registered it via HCIUARTSETPROTO (ENODEV until then): retry on each
+    // device event, with a slow poll as a safety net in case one was missed
+    for (;;) {
+        int64_t now;
 
-        if (!ioctl(hci_sock, HCIDEVUP, HCI_DEV_ID)) {
+        if (!ioctl(hci_ctl_sock, HCIDEVUP, HCI_DEV_ID) || errno == EALREADY) {
+            LOGI("HCI device up after %lld ms", (long long) (now_ms() - start));
+            return 0;
+        }
+
+        now = now_ms();
+        if (now >= deadline) {
+            LOGE("%s: Timeout waiting for HCI device to come up", __FUNCTION__);
             break;
         }
-        close(hci_sock);
-        usleep(100000);  // 100 ms retry delay
-        if (!((attempt-1) % (HCIA_START_ATTEMPTS / 2)))
+        if (!reenabled && now - start >= HCIA_START_ATTEMPTS * 100 / 2) {
+            reenabled = 1;
             if (ll_chip_enable(1) < 0)
-                goto out;
-    }
-    if (attempt == 0) {
-        LOGE("%s: Timeout waiting for HCI device to come up", __FUNCTION__);
-        goto out;
+                break;
+        }
+        wait_hci_event(hci_ctl_sock, MIN(deadline - now, 1000));
     }
 
-    ret = 0;
+    return -1;
+}
 
-out:
-    if (hci_sock >= 0) close(hci_sock);
-    return ret;
+static int do_chip_enable()
+{
+    LOGV(__FUNCTION__);
+
+    if (chip_power_on() < 0)
+        return -1;
+    return chip_wait_up();
 }
 
-static int do_btd_enable()
+/* Starts bluetoothd once the device is up. The event socket is opened
+ * first so that none of its setup commands is missed, and after HCIDEVUP
+ * returned so that the kernel init commands are not mistaken for them. */
+static int btd_start()
 {
     LOGV(__FUNCTION__);
 
-    int ret = -1;
+    close_hci_dev_sock();
+    hci_dev_sock = create_hci_event_sock(HCI_DEV_ID, EVT_CMD_COMPLETE);
+    if (hci_dev_sock < 0)
+        LOGW("Failed to listen to the adapter: %s (%d)", strerror(errno), errno);
 
     LOGI("Starting bluetoothd deamon");
     if (property_set("ctl.start", "bluetoothd") < 0) {
         LOGE("Failed to start bluetoothd");
-        goto out;
+        return -1;
     }
-    sleep(HCID_START_DELAY_SEC);
+    return 0;
+}
 
-    ret = 0;
+/* bluetoothd writes the local name and class of the adapter once it has
+ * set it up: stop waiting there instead of sleeping HCID_START_DELAY_SEC
+ * regardless, which stays the upper bound. */
+static void btd_wait_ready()
+{
+    LOGV(__FUNCTION__);
 
-out:
-    return ret;
+    int64_t start = now_ms();
+
+    set_bt_state(BT_STATE_BTD_WAIT);
+    if (hci_dev_sock < 0) {
+        sleep(HCID_START_DELAY_SEC);
+    } else if (!wait_btd_command(hci_dev_sock, HCID_START_DELAY_SEC * 1000)) {
+        LOGW("No adapter setup from bluetoothd after %d s", HCID_START_DELAY_SEC);
+    } else {
+        LOGI("bluetoothd ready after %lld ms", (long long) (now_ms() - start));
+    }
+
+    // Only needed until then: don't keep a copy of every adapter event
+    close_hci_dev_sock();
 }
 
 static int do_chip_disable()
@@ -248,12 +428,11 @@ static int do_chip_disable()
     LOGV(__FUNCTION__);
 
     int ret = -1;
-    int hci_sock = -1;
 
     LOGI("Stopping hciattach deamon");
-    hci_sock = create_hci_sock();
-    if (hci_sock < 0) goto out;
-    ioctl(hci_sock, HCIDEVDOWN, HCI_DEV_ID);
+    close_hci_dev_sock();
+    if (open_hci_ctl_sock() < 0) goto out;
+    ioctl(hci_ctl_sock, HCIDEVDOWN, HCI_DEV_ID);
 
     LOGI("Stopping hciattach deamon");
     if (property_set("ctl.stop", "hciattach") < 0) {
@@ -268,7 +447,6 @@ static int do_chip_disable()
     ret = 0;
 
 out:
-    if (hci_sock >= 0) close(hci_sock);
     return ret;
 }
 
@@ -333,16 +511,66 @@ int bt_enable() {
 
     int ret = bt_chip_enable();
 
-    if (ret)
+    if (ret) {
+        set_bt_state(BT_STATE_OFF);
         goto out;
+    }
 
-    if ((ret = do_btd_enable()) != 0)
+    if ((ret = btd_start()) != 0) {
+        close_hci_dev_sock();
         bt_chip_disable();
+        set_bt_state(BT_STATE_OFF);
+        goto out;
+    }
+    btd_wait_ready();
+    set_bt_state(BT_STATE_ON);
 
 out:
     return ret;
 }
 
+struct bt_enable_request {
+    void (*callback)(int ret, void *data);
+    void *data;
+};
+
+static void *bt_enable_thread(void *arg) {
+    struct bt_enable_request *req = arg;
+    int ret = bt_enable();
+
+    if (req->callback)
+        req->callback(ret, req->data);
+    free(req);
+    return NULL;
+}
+
+/* Runs bt_enable on a thread of its own and reports its result through
+ * callback from that thread. Returns -1 if the thread cannot be started. */
+int bt_enable_async(void (*callback)(int ret, void *data), void *data) {
+    LOGV(__FUNCTION__);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    struct bt_enable_request *req = malloc(sizeof(*req));
+    int ret;
+
+    if (req == NULL)
+        return -1;
+    req->callback = callback;
+    req->data = data;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, bt_enable_thread, req);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        LOGE("Failed to start bt_enable thread: %s (%d)", strerror(ret), ret);
+        free(req);
+        return -1;
+    }
+    return 0;
+}
+
 int bt_disable() {
     LOGV(__FUNCTION__);
 
@@ -352,6 +580,7 @@ int bt_disable() {
 
     /* even if do_btd_disable fails, we'll try to disable the chip anyway */
     ret = bt_chip_disable();
+    set_bt_state(BT_STATE_OFF);
 out:
     return ret;
 }
@@ -359,7 +588,6 @@ out:
 int bt_is_enabled() {
     LOGV(__FUNCTION__);
 
-    int hci_sock = -1;
     int ret = -1;
     struct hci_dev_info dev_info;
 
@@ -371,11 +599,10 @@ int bt_is_enabled() {
     ret = -1;
 
     // Power is on, now check if the HCI interface is up
-    hci_sock = create_hci_sock();
-    if (hci_sock < 0) goto out;
+    if (open_hci_ctl_sock() < 0) goto out;
 
     dev_info.dev_id = HCI_DEV_ID;
-    if (ioctl(hci_sock, HCIGETDEVINFO, (void *)&dev_info) < 0) {
+    if (ioctl(hci_ctl_sock, HCIGETDEVINFO, (void *)&dev_info) < 0) {
         ret = 0;
         goto out;
     }
@@ -383,7 +610,6 @@ int bt_is_enabled() {
     ret = hci_test_bit(HCI_UP, &dev_info.flags);
 
 out:
-    if (hci_sock >= 0) close(hci_sock);
     return ret;
 }
 
@@ -2,15 +2,19 @@ ifneq ($(TARGET_PROVIDES_LIBAUDIO),true)
 
 LOCAL_PATH:= $(call my-dir)
 
+audio_hw_src_files := \
+	AudioHardware.cpp \
+	PolyphaseResampler.cpp
+
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES:= \
-	AudioHardware.cpp
+LOCAL_SRC_FILES:= $(audio_hw_src_files)
 
 LOCAL_MODULE := audio.primary.$(TARGET_BOOTLOADER_BOARD_NAME)
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 LOCAL_STATIC_LIBRARIES:= libmedia_helper
 LOCAL_SHARED_LIBRARIES:= \
 	libutils \
+	libcutils \
 	libhardware_legacy \
 	libtinyalsa \
 	libaudioutils
@@ -30,6 +34,40 @@ endif
 
 include $(BUILD_SHARED_LIBRARY)
 
+# audio_hal_bench: the HAL linked with SyntheticPcm.cpp in place of libtinyalsa,
+# see audio_hal_bench.cpp. The allocations of the HAL objects go through the
+# wrappers of the benchmark.
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= \
+	$(audio_hw_src_files) \
+	SyntheticPcm.cpp \
+	audio_hal_bench.cpp
+
+LOCAL_MODULE := audio_hal_bench
+LOCAL_STATIC_LIBRARIES:= libmedia_helper
+LOCAL_SHARED_LIBRARIES:= \
+	libutils \
+	libcutils \
+	libhardware_legacy \
+	libaudioutils \
+	libeffects \
+	libdl
+
+LOCAL_WHOLE_STATIC_LIBRARIES := libaudiohw_legacy
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_LDFLAGS := -Wl,--wrap=malloc -Wl,--wrap=calloc -Wl,--wrap=realloc
+LOCAL_C_INCLUDES += \
+	external/tinyalsa/include \
+	$(call include-path-for, audio-effects) \
+	$(call include-path-for, audio-utils)
+
+ifeq ($(BOARD_USES_FROYO_RILCLIENT),true)
+  LOCAL_CFLAGS += -DUSES_FROYO_RILCLIENT
+endif
+
+include $(BUILD_EXECUTABLE)
+
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := AudioPolicyManager.cpp
@@ -18,9 +18,12 @@
 
 #define LOG_NDEBUG 0
 #define LOG_TAG "AudioHardware"
+#define ATRACE_TAG ATRACE_TAG_AUDIO
 
 #include <utils/Log.h>
 #include <utils/String8.h>
+#include <utils/Trace.h>
+#include <cutils/properties.h>
 
 #include <stdio.h>
 #include <unistd.h>
@@ -32,13 +35,24 @@
 #include <fcntl.h>
 
 #include "AudioHardware.h"
+#include "PolyphaseResampler.h"
 #include <audio_effects/effect_aec.h>
 #include <hardware_legacy/power.h>
+#include <cutils/atomic.h>
+#include <private/android_filesystem_config.h>
 
 extern "C" {
 #include <tinyalsa/asoundlib.h>
 }
 
+#define STANDBY_HYSTERESIS_PROPERTY "hw.audio.standby_hysteresis_ms"
+#define DEEP_BUFFER_WRITE_PROPERTY "hw.audio.deep_buffer_write_ms"
+#define OUTPUT_PROFILE_PROPERTY "hw.audio.output_profile"
+
+// "1" while in call, for the in-call policy of the sensors HAL: system_server
+// is in the audio group, mediaserver cannot set hw.* properties
+#define CALL_STATE_FILE "/data/misc/audio/call_state"
+
 #define Si4709_IOC_MAGIC  0xFA
 #define Si4709_IOC_VOLUME_SET                       _IOW(Si4709_IOC_MAGIC, 15, __u8)
 
@@ -53,10 +67,45 @@ const uint32_t AudioHardware::inputConfigTable[][AudioHardware::INPUT_CONFIG_CNT
         {44100, 1}
 };
 
-//  trace driver operations for dump
+const uint32_t AudioHardware::outputConfigTable[][AudioHardware::OUTPUT_CONFIG_CNT] = {
+        {AUDIO_HW_OUT_PERIOD_SZ, AUDIO_HW_OUT_PERIOD_CNT, 0},
+        {AUDIO_HW_OUT_FAST_PERIOD_SZ, AUDIO_HW_OUT_FAST_PERIOD_CNT, 1},
+        {AUDIO_HW_OUT_DEEP_PERIOD_SZ, AUDIO_HW_OUT_DEEP_PERIOD_CNT, 0}
+};
+
+static const char *outputProfileName[AudioHardware::OUTPUT_PROFILE_CNT] = {
+        "primary",
+        "fast",
+        "deep_buffer"
+};
+
+// systrace counters of the stream standby state: 1 in standby, 0 running
+static const char *outputStandbyTrace[AudioHardware::OUTPUT_PROFILE_CNT] = {
+        "out standby primary",
+        "out standby fast",
+        "out standby deep_buffer"
+};
+static const char *inputStandbyTrace = "in standby";
+
+const char *AudioHardware::mixerCtlName[AudioHardware::MIXER_CTL_CNT] = {
+        "Playback Path",
+        "Voice Call Path",
+        "FM Radio Path",
+        "Capture MIC Path",
+        "Input Source",
+        "Codec Status"
+};
+
+//  trace driver operations for dump, and as systrace sections when the "audio"
+//  atrace category is enabled (debug.atrace.tags.enableflags), through the
+//  Tracer of the JB 4.1 utils/Trace.h
 //
 #define DRIVER_TRACE
 
+#define TRACE_BEGIN(name) android::Tracer::traceBegin(ATRACE_TAG, name)
+#define TRACE_END() android::Tracer::traceEnd(ATRACE_TAG)
+#define TRACE_ENABLED() android::Tracer::isTagEnabled(ATRACE_TAG)
+
 enum {
     DRV_NONE,
     DRV_PCM_OPEN,
@@ -66,12 +115,26 @@ enum {
     DRV_MIXER_OPEN,
     DRV_MIXER_CLOSE,
     DRV_MIXER_GET,
-    DRV_MIXER_SEL
+    DRV_MIXER_SEL,
+    DRV_PCM_STOP
 };
 
 #ifdef DRIVER_TRACE
-#define TRACE_DRIVER_IN(op) mDriverOp = op;
-#define TRACE_DRIVER_OUT mDriverOp = DRV_NONE;
+static const char *driverOpName[] = {
+        "none",
+        "pcm_open",
+        "pcm_close",
+        "pcm_write",
+        "pcm_read",
+        "mixer_open",
+        "mixer_close",
+        "mixer_get",
+        "mixer_sel",
+        "pcm_stop"
+};
+
+#define TRACE_DRIVER_IN(op) mDriverOp = op; TRACE_BEGIN(driverOpName[op]);
+#define TRACE_DRIVER_OUT mDriverOp = DRV_NONE; TRACE_END();
 #else
 #define TRACE_DRIVER_IN(op)
 #define TRACE_DRIVER_OUT
@@ -88,6 +151,8 @@ AudioHardware::AudioHardware() :
     mInit(false),
     mMicMute(false),
     mPcm(NULL),
+    mPcmProfile(OUTPUT_PROFILE_PRIMARY),
+    mPcmMmap(false),
     mMixer(NULL),
     mPcmOpenCnt(0),
     mMixerOpenCnt(0),
@@ -99,18 +164,53 @@ AudioHardware::AudioHardware() :
     mSecRilLibHandle(NULL),
     mRilClient(0),
     mActivatedCP(false),
+    mRilClockPending(false),
+    mRilPathPending(false),
+    mRilVolumePending(false),
+    mRilQueued(0),
+    mRilSent(0),
     mEchoReference(NULL),
+    mStandbyTime(0),
+    mPcmIn(NULL),
+    mPcmInChannels(0),
+    mPcmInOpen(false),
+    mPendingRoute(NULL),
     mFmFd(-1),
     mFmVolume(1),
     mFmResumeAfterCall(false),
     mDriverOp(DRV_NONE)
 {
+    char value[PROPERTY_VALUE_MAX];
+
+    resetMixerCtls_l();
+
+    property_get(STANDBY_HYSTERESIS_PROPERTY, value, "");
+    mStandbyDelay = milliseconds(value[0] ? atoi(value) : AUDIO_HW_STANDBY_HYSTERESIS_MS);
+
     loadRILD();
+    if (mSecRilLibHandle) {
+        mRilThread = new RilThread(this);
+        mRilThread->run("AudioHwRil", ANDROID_PRIORITY_AUDIO);
+    }
+
+    mStandbyThread = new StandbyThread(this);
+    mStandbyThread->run("AudioHwStandby", ANDROID_PRIORITY_AUDIO);
+
+    publishCallState(false);
+
     mInit = true;
 }
 
 AudioHardware::~AudioHardware()
 {
+    mStandbyThread->requestExit();
+    {
+        AutoMutex lock(mLock);
+        mStandbyCond.signal();
+    }
+    mStandbyThread->requestExitAndWait();
+    mStandbyThread.clear();
+
     for (size_t index = 0; index < mInputs.size(); index++) {
         closeInputStream(mInputs[index].get());
     }
@@ -127,6 +227,21 @@ AudioHardware::~AudioHardware()
         pcm_close(mPcm);
         TRACE_DRIVER_OUT
     }
+    if (mPcmIn) {
+        TRACE_DRIVER_IN(DRV_PCM_CLOSE)
+        pcm_close(mPcmIn);
+        TRACE_DRIVER_OUT
+    }
+
+    if (mRilThread != 0) {
+        mRilThread->requestExit();
+        {
+            AutoMutex lock(mRilLock);
+            mRilCond.signal();
+        }
+        mRilThread->requestExitAndWait();
+        mRilThread.clear();
+    }
 
     if (mSecRilLibHandle) {
         if (disconnectRILD(mRilClient) != RIL_CLIENT_ERR_SUCCESS)
@@ -194,6 +309,7 @@ void AudioHardware::loadRILD(void)
     }
 }
 
+// Only called by the RIL thread
 status_t AudioHardware::connectRILDIfRequired(void)
 {
     if (!mSecRilLibHandle) {
@@ -213,17 +329,134 @@ status_t AudioHardware::connectRILDIfRequired(void)
     return OK;
 }
 
+// RIL requests are only queued by the audio paths, with or without mLock held, and
+// sent by the RIL thread. A request replaces a pending one of the same kind so that
+// a burst of volume steps results in a single IPC with the last value.
+void AudioHardware::queueCallClockSync(SoundClockCondition condition)
+{
+    AutoMutex lock(mRilLock);
+    mRilClock = condition;
+    mRilClockPending = true;
+    mRilQueued++;
+    mRilCond.signal();
+}
+
+void AudioHardware::queueCallAudioPath(AudioPath path)
+{
+    AutoMutex lock(mRilLock);
+    mRilPath = path;
+    mRilPathPending = true;
+    mRilQueued++;
+    mRilCond.signal();
+}
+
+void AudioHardware::queueCallVolume(SoundType type, int volume)
+{
+    AutoMutex lock(mRilLock);
+    mRilVolumeType = type;
+    mRilVolume = volume;
+    mRilVolumePending = true;
+    mRilQueued++;
+    mRilCond.signal();
+}
+
+bool AudioHardware::rilLoop()
+{
+    bool clockPending, pathPending, volumePending;
+    SoundClockCondition clock;
+    AudioPath path;
+    SoundType volumeType;
+    int volume;
+
+    {
+        AutoMutex lock(mRilLock);
+
+        while (!mRilClockPending && !mRilPathPending && !mRilVolumePending) {
+            if (mRilThread->exitPending()) {
+                return false;
+            }
+            mRilCond.wait(mRilLock);
+        }
+        if (mRilThread->exitPending()) {
+            return false;
+        }
+        clockPending = mRilClockPending;
+        clock = mRilClock;
+        pathPending = mRilPathPending;
+        path = mRilPath;
+        volumePending = mRilVolumePending;
+        volumeType = mRilVolumeType;
+        volume = mRilVolume;
+        mRilClockPending = mRilPathPending = mRilVolumePending = false;
+    }
+
+    if (connectRILDIfRequired() != OK) {
+        return true;
+    }
+
+    // same order as the calls were done in line: clock, then path, then the
+    // volume which depends on the path
+    if (clockPending) {
+        setCallClockSync(mRilClient, clock);
+        android_atomic_inc(&mRilSent);
+    }
+    if (pathPending) {
+        setCallAudioPath(mRilClient, path);
+        android_atomic_inc(&mRilSent);
+    }
+    if (volumePending) {
+        setCallVolume(mRilClient, volumeType, volume);
+        android_atomic_inc(&mRilSent);
+    }
+    return true;
+}
+
+bool AudioHardware::RilThread::threadLoop()
+{
+    return mHardware->rilLoop();
+}
+
 AudioStreamOut* AudioHardware::openOutputStream(
     uint32_t devices, int *format, uint32_t *channels,
     uint32_t *sampleRate, status_t *status)
+{
+    // the JB 4.1 legacy wrapper drops the output flags of the policy and only
+    // opens the primary output here: its profile comes from a property.
+    // "deep_buffer" lets the AP sleep between long writes, for devices mostly
+    // playing music with the screen off, at the cost of the UI sound latency.
+    audio_output_flags_t flags = (audio_output_flags_t)0;
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get(OUTPUT_PROFILE_PROPERTY, value, "") > 0) {
+        if (!strcmp(value, outputProfileName[OUTPUT_PROFILE_FAST])) {
+            flags = AUDIO_OUTPUT_FLAG_FAST;
+        } else if (!strcmp(value, outputProfileName[OUTPUT_PROFILE_DEEP_BUFFER])) {
+            flags = AUDIO_OUTPUT_FLAG_DEEP_BUFFER;
+        }
+    }
+    return openOutputStreamWithFlags(devices, flags,
+                                     format, channels, sampleRate, status);
+}
+
+AudioStreamOut* AudioHardware::openOutputStreamWithFlags(
+    uint32_t devices, audio_output_flags_t flags, int *format,
+    uint32_t *channels, uint32_t *sampleRate, status_t *status)
 {
     sp <AudioStreamOutALSA> out;
     status_t rc;
+    int profile = OUTPUT_PROFILE_PRIMARY;
+
+    if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+        profile = OUTPUT_PROFILE_DEEP_BUFFER;
+    } else if (flags & AUDIO_OUTPUT_FLAG_FAST) {
+        profile = OUTPUT_PROFILE_FAST;
+    }
+    ALOGV("openOutputStreamWithFlags() flags %x profile %s", flags, outputProfileName[profile]);
 
     { // scope for the lock
         Mutex::Autolock lock(mLock);
 
-        // only one output stream allowed
+        // only one output stream allowed: there is a single playback pcm,
+        // opened with the periods of the profile of that stream
         if (mOutput != 0) {
             if (status) {
                 *status = INVALID_OPERATION;
@@ -233,7 +466,7 @@ AudioStreamOut* AudioHardware::openOutputStream(
 
         out = new AudioStreamOutALSA();
 
-        rc = out->set(this, devices, format, channels, sampleRate);
+        rc = out->set(this, devices, format, channels, sampleRate, profile);
         if (rc == NO_ERROR) {
             mOutput = out;
         }
@@ -385,8 +618,8 @@ status_t AudioHardware::setMode(int mode)
         // activate call clock in radio when entering in call mode
         if (mMode == AudioSystem::MODE_IN_CALL)
         {
-            if ((!mActivatedCP) && (mSecRilLibHandle) && (connectRILDIfRequired() == OK)) {
-                setCallClockSync(mRilClient, SOUND_CLOCK_START);
+            if ((!mActivatedCP) && (mSecRilLibHandle)) {
+                queueCallClockSync(SOUND_CLOCK_START);
                 mActivatedCP = true;
             }
         }
@@ -410,17 +643,8 @@ status_t AudioHardware::setMode(int mode)
         }
         if (mMode == AudioSystem::MODE_NORMAL && mInCallAudioMode) {
             setInputSource_l(mInputSource);
-            if (mMixer != NULL) {
-                TRACE_DRIVER_IN(DRV_MIXER_GET)
-                struct mixer_ctl *ctl= mixer_get_ctl_by_name(mMixer, "Playback Path");
-                TRACE_DRIVER_OUT
-                if (ctl != NULL) {
-                    ALOGV("setMode() reset Playback Path to RCV");
-                    TRACE_DRIVER_IN(DRV_MIXER_SEL)
-                    mixer_ctl_set_enum_by_string(ctl, "RCV");
-                    TRACE_DRIVER_OUT
-                }
-            }
+            ALOGV("setMode() reset Playback Path to RCV");
+            setMixerCtl_l(MIXER_CTL_PLAYBACK_PATH, "RCV");
             ALOGV("setMode() closePcmOut_l()");
             closeMixer_l();
             closePcmOut_l();
@@ -441,6 +665,9 @@ status_t AudioHardware::setMode(int mode)
             if(mActivatedCP)
                 mActivatedCP = false;
         }
+        if ((mMode == AudioSystem::MODE_IN_CALL) != (prevMode == AudioSystem::MODE_IN_CALL)) {
+            publishCallState(mMode == AudioSystem::MODE_IN_CALL);
+        }
     }
 
     if (spIn != 0) {
@@ -459,6 +686,21 @@ status_t AudioHardware::setMode(int mode)
     return status;
 }
 
+void AudioHardware::publishCallState(bool inCall)
+{
+    int fd = open(CALL_STATE_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+    if (fd < 0) {
+        ALOGW("publishCallState() cannot open %s: %s", CALL_STATE_FILE, strerror(errno));
+        return;
+    }
+    // created with the media group otherwise
+    fchown(fd, -1, AID_AUDIO);
+    if (write(fd, inCall ? "1\n" : "0\n", 2) != 2) {
+        ALOGW("publishCallState() cannot write %s: %s", CALL_STATE_FILE, strerror(errno));
+    }
+    close(fd);
+}
+
 status_t AudioHardware::setMicMute(bool state)
 {
     ALOGV("setMicMute(%d) mMicMute %d", state, mMicMute);
@@ -576,9 +818,25 @@ String8 AudioHardware::getParameters(const String8& keys)
 {
     AudioParameter request = AudioParameter(keys);
     AudioParameter reply = AudioParameter();
+    String8 value;
+    String8 key = String8(PerfStats::keyPerfStats);
 
     ALOGV("getParameters() %s", keys.string());
 
+    if (request.get(key, value) == NO_ERROR) {
+        // stats are sampled without the stream locks, only the stream list is protected
+        AutoMutex lock(mLock);
+        String8 stats;
+        if (mOutput != 0) {
+            stats.appendFormat("%s[%s]", outputProfileName[mOutput->profile()],
+                               mOutput->perfStats().toString().string());
+        }
+        for (size_t i = 0; i < mInputs.size(); i++) {
+            stats.appendFormat(" input%d[%s]", i, mInputs[i]->perfStats().toString().string());
+        }
+        reply.add(key, stats);
+    }
+
     return reply.toString();
 }
 
@@ -616,8 +874,7 @@ void AudioHardware::setVoiceVolume_l(float volume)
 
     mVoiceVol = volume;
 
-    if ( (AudioSystem::MODE_IN_CALL == mMode) && (mSecRilLibHandle) &&
-         (connectRILDIfRequired() == OK) ) {
+    if ( (AudioSystem::MODE_IN_CALL == mMode) && (mSecRilLibHandle) ) {
 
         uint32_t device = AudioSystem::DEVICE_OUT_EARPIECE;
         if (mOutput != 0) {
@@ -656,7 +913,7 @@ void AudioHardware::setVoiceVolume_l(float volume)
                 type = SOUND_TYPE_VOICE;
                 break;
         }
-        setCallVolume(mRilClient, type, int_volume);
+        queueCallVolume(type, int_volume);
     }
 
 }
@@ -723,10 +980,23 @@ status_t AudioHardware::dump(int fd, const Vector<String16>& args)
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmPcmOpenCnt: %d\n", mPcmOpenCnt);
     result.append(buffer);
+    snprintf(buffer, SIZE, "\tmPcmProfile: %s%s\n", outputProfileName[mPcmProfile],
+             mPcmMmap ? " (mmap)" : "");
+    result.append(buffer);
     snprintf(buffer, SIZE, "\tmMixer: %p\n", mMixer);
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmMixerOpenCnt: %d\n", mMixerOpenCnt);
     result.append(buffer);
+    for (int i = 0; i < MIXER_CTL_CNT; i++) {
+        snprintf(buffer, SIZE, "\t  %s: %s\n", mixerCtlName[i],
+                 mMixerValue[i] != NULL ? mMixerValue[i] : "-");
+        result.append(buffer);
+    }
+    snprintf(buffer, SIZE, "\tmPcmIn: %p%s\n", mPcmIn, mPcmInOpen ? "" : " (idle)");
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tStandby hysteresis %lld ms, %s\n", ns2ms(mStandbyDelay),
+             mStandbyTime ? "pending" : "idle");
+    result.append(buffer);
     snprintf(buffer, SIZE, "\tIn Call Audio Mode %s\n",
              (mInCallAudioMode) ? "ON" : "OFF");
     result.append(buffer);
@@ -736,6 +1006,8 @@ status_t AudioHardware::dump(int fd, const Vector<String16>& args)
     result.append(buffer);
     snprintf(buffer, SIZE, "\tmRilClient: %p\n", mRilClient);
     result.append(buffer);
+    snprintf(buffer, SIZE, "\tRIL requests queued %d, sent %d\n", mRilQueued, mRilSent);
+    result.append(buffer);
     snprintf(buffer, SIZE, "\tCP %s\n",
              (mActivatedCP) ? "Activated" : "Deactivated");
     result.append(buffer);
@@ -765,8 +1037,7 @@ status_t AudioHardware::setIncallPath_l(uint32_t device)
     ALOGV("setIncallPath_l: device %x", device);
 
     // Setup sound path for CP clocking
-    if ((mSecRilLibHandle) &&
-        (connectRILDIfRequired() == OK)) {
+    if (mSecRilLibHandle) {
 
         if (mMode == AudioSystem::MODE_IN_CALL) {
             ALOGD("### incall mode route (%d)", device);
@@ -807,19 +1078,12 @@ status_t AudioHardware::setIncallPath_l(uint32_t device)
                     break;
             }
 
-            setCallAudioPath(mRilClient, path);
-
-            if (mMixer != NULL) {
-                TRACE_DRIVER_IN(DRV_MIXER_GET)
-                struct mixer_ctl *ctl= mixer_get_ctl_by_name(mMixer, "Voice Call Path");
-                TRACE_DRIVER_OUT
-                ALOGE_IF(ctl == NULL, "setIncallPath_l() could not get mixer ctl");
-                if (ctl != NULL) {
-                    ALOGV("setIncallPath_l() Voice Call Path, (%x)", device);
-                    TRACE_DRIVER_IN(DRV_MIXER_SEL)
-                    mixer_ctl_set_enum_by_string(ctl, getVoiceRouteFromDevice(device));
-                    TRACE_DRIVER_OUT
-                }
+            queueCallAudioPath(path);
+
+            ALOGV("setIncallPath_l() Voice Call Path, (%x)", device);
+            if (setMixerCtl_l(MIXER_CTL_VOICE_CALL_PATH, getVoiceRouteFromDevice(device))) {
+                // the codec driver reroutes playback along with the voice path
+                mMixerValue[MIXER_CTL_PLAYBACK_PATH] = NULL;
             }
         }
     }
@@ -858,15 +1122,10 @@ void AudioHardware::disableFMRadio() {
         // Disable FM radio flag to allow the codec to be turned off
         // (the flag is automatically set by the kernel driver when FM is enabled)
         // No need to turn off the FM Radio path as the kernel driver will handle that
-        TRACE_DRIVER_IN(DRV_MIXER_GET)
-        struct mixer_ctl *ctl = mixer_get_ctl_by_name(mMixer, "Codec Status");
-        TRACE_DRIVER_OUT
-
-        if (ctl != NULL) {
-            TRACE_DRIVER_IN(DRV_MIXER_SEL)
-            mixer_ctl_set_enum_by_string(ctl, "FMR_FLAG_CLEAR");
-            TRACE_DRIVER_OUT
-        }
+        setMixerCtl_l(MIXER_CTL_CODEC_STATUS, "FMR_FLAG_CLEAR", true);
+        // the driver drops the FM route, playback included
+        mMixerValue[MIXER_CTL_FM_RADIO_PATH] = NULL;
+        mMixerValue[MIXER_CTL_PLAYBACK_PATH] = NULL;
 
         closeMixer_l();
         closePcmOut_l();
@@ -918,34 +1177,14 @@ status_t AudioHardware::setFMRadioPath_l(uint32_t device)
     }
 
     if (mMixer != NULL) {
-        ALOGV("setFMRadioPath_l() mixer is open");
-        TRACE_DRIVER_IN(DRV_MIXER_GET)
-        struct mixer_ctl *ctl= mixer_get_ctl_by_name(mMixer, "FM Radio Path");
-        TRACE_DRIVER_OUT
-
-        if (ctl != NULL) {
-            ALOGV("setFMRadioPath_l() FM Radio Path, (%s)", fmpath);
-            TRACE_DRIVER_IN(DRV_MIXER_SEL)
-            mixer_ctl_set_enum_by_string(ctl, fmpath);
-            TRACE_DRIVER_OUT
-        } else {
-            ALOGE("setFMRadioPath_l() could not get FM Radio Path mixer ctl");
-        }
-
-        TRACE_DRIVER_IN(DRV_MIXER_GET)
-        ctl = mixer_get_ctl_by_name(mMixer, "Playback Path");
-        TRACE_DRIVER_OUT
+        ALOGV("setFMRadioPath_l() FM Radio Path, (%s)", fmpath);
+        setMixerCtl_l(MIXER_CTL_FM_RADIO_PATH, fmpath);
 
+        // the codec driver reroutes playback along with the FM path: always
+        // write the playback path after it
         const char *route = getOutputRouteFromDevice(device);
-        ALOGV("setFMRadioPath_l() Playpack Path, (%s)", route);
-        if (ctl) {
-            TRACE_DRIVER_IN(DRV_MIXER_SEL)
-            mixer_ctl_set_enum_by_string(ctl, route);
-            TRACE_DRIVER_OUT
-        }
-        else {
-            ALOGE("setFMRadioPath_l() could not get Playback Path mixer ctl");
-        }
+        ALOGV("setFMRadioPath_l() Playback Path, (%s)", route);
+        setMixerCtl_l(MIXER_CTL_PLAYBACK_PATH, route, true);
     } else {
         ALOGE("setFMRadioPath_l() mixer is not open");
     }
@@ -953,22 +1192,28 @@ status_t AudioHardware::setFMRadioPath_l(uint32_t device)
     return NO_ERROR;
 }
 
-struct pcm *AudioHardware::openPcmOut_l()
+struct pcm *AudioHardware::openPcmOut_l(int profile)
 {
-    ALOGD("openPcmOut_l() mPcmOpenCnt: %d", mPcmOpenCnt);
+    ALOGD("openPcmOut_l() mPcmOpenCnt: %d profile %s", mPcmOpenCnt, outputProfileName[profile]);
     if (mPcmOpenCnt++ == 0) {
         if (mPcm != NULL) {
-            ALOGE("openPcmOut_l() mPcmOpenCnt == 0 and mPcm == %p\n", mPcm);
-            mPcmOpenCnt--;
-            return NULL;
+            // left open by closePcmOut_l(), reuse it if its setup matches
+            if (mPcmProfile == profile) {
+                ALOGV("openPcmOut_l() reusing idle pcm");
+                return mPcm;
+            }
+            TRACE_DRIVER_IN(DRV_PCM_CLOSE)
+            pcm_close(mPcm);
+            TRACE_DRIVER_OUT
+            mPcm = NULL;
         }
         unsigned flags = PCM_OUT;
 
         struct pcm_config config = {
             channels : 2,
             rate : AUDIO_HW_OUT_SAMPLERATE,
-            period_size : AUDIO_HW_OUT_PERIOD_SZ,
-            period_count : AUDIO_HW_OUT_PERIOD_CNT,
+            period_size : outputConfigTable[profile][OUTPUT_CONFIG_PERIOD_SZ],
+            period_count : outputConfigTable[profile][OUTPUT_CONFIG_PERIOD_CNT],
             format : PCM_FORMAT_S16_LE,
             start_threshold : 0,
             stop_threshold : 0,
@@ -976,9 +1221,30 @@ struct pcm *AudioHardware::openPcmOut_l()
 	    avail_min : 0,
         };
 
+        if (outputConfigTable[profile][OUTPUT_CONFIG_MMAP]) {
+            // mmap transfers are started explicitly once half of the buffer
+            // is filled, see AudioStreamOutALSA::writeMmap_l()
+            flags |= PCM_MMAP;
+            config.start_threshold = (config.period_size * config.period_count) / 2;
+            config.avail_min = config.period_size;
+        }
+
         TRACE_DRIVER_IN(DRV_PCM_OPEN)
         mPcm = pcm_open(0, 0, flags, &config);
         TRACE_DRIVER_OUT
+        if (!pcm_is_ready(mPcm) && (flags & PCM_MMAP)) {
+            ALOGW("openPcmOut_l() cannot mmap pcm_out driver: %s, using read/write transfers",
+                  pcm_get_error(mPcm));
+            TRACE_DRIVER_IN(DRV_PCM_CLOSE)
+            pcm_close(mPcm);
+            TRACE_DRIVER_OUT
+            flags &= ~PCM_MMAP;
+            config.start_threshold = 0;
+            config.avail_min = 0;
+            TRACE_DRIVER_IN(DRV_PCM_OPEN)
+            mPcm = pcm_open(0, 0, flags, &config);
+            TRACE_DRIVER_OUT
+        }
         if (!pcm_is_ready(mPcm)) {
             ALOGE("openPcmOut_l() cannot open pcm_out driver: %s\n", pcm_get_error(mPcm));
             TRACE_DRIVER_IN(DRV_PCM_CLOSE)
@@ -986,7 +1252,13 @@ struct pcm *AudioHardware::openPcmOut_l()
             TRACE_DRIVER_OUT
             mPcmOpenCnt--;
             mPcm = NULL;
+        } else {
+            mPcmProfile = profile;
+            mPcmMmap = (flags & PCM_MMAP) != 0;
         }
+    } else {
+        ALOGW_IF(profile != mPcmProfile, "openPcmOut_l() pcm already open as %s",
+                 outputProfileName[mPcmProfile]);
     }
     return mPcm;
 }
@@ -1000,10 +1272,94 @@ void AudioHardware::closePcmOut_l()
     }
 
     if (--mPcmOpenCnt == 0) {
+        // only read/write pcms are kept warm: tinyalsa keeps its own copy of
+        // the appl_ptr of an mmap pcm, pushed back stale over the one reset
+        // by the PREPARE of the next pcm_start()
+        if (mStandbyDelay > 0 && !mPcmMmap) {
+            // stop the DMA now, the pcm is closed by the standby thread
+            TRACE_DRIVER_IN(DRV_PCM_STOP)
+            pcm_stop(mPcm);
+            TRACE_DRIVER_OUT
+            scheduleStandby_l();
+        } else {
+            TRACE_DRIVER_IN(DRV_PCM_CLOSE)
+            pcm_close(mPcm);
+            TRACE_DRIVER_OUT
+            mPcm = NULL;
+        }
+    }
+}
+
+struct pcm *AudioHardware::openPcmIn_l(uint32_t channelCount)
+{
+    ALOGD("openPcmIn_l() channels %d", channelCount);
+    if (mPcmIn != NULL) {
+        if (mPcmInOpen) {
+            ALOGE("openPcmIn_l() pcm_in already in use");
+            return NULL;
+        }
+        // left open by closePcmIn_l(), reuse it if its setup matches
+        mPcmInOpen = true;
+        if (mPcmInChannels == channelCount) {
+            ALOGV("openPcmIn_l() reusing idle pcm");
+            return mPcmIn;
+        }
         TRACE_DRIVER_IN(DRV_PCM_CLOSE)
-        pcm_close(mPcm);
+        pcm_close(mPcmIn);
         TRACE_DRIVER_OUT
-        mPcm = NULL;
+        mPcmIn = NULL;
+    }
+
+    unsigned flags = PCM_IN;
+
+    struct pcm_config config = {
+        channels : channelCount,
+        rate : AUDIO_HW_IN_SAMPLERATE,
+        period_size : AUDIO_HW_IN_PERIOD_SZ,
+        period_count : AUDIO_HW_IN_PERIOD_CNT,
+        format : PCM_FORMAT_S16_LE,
+        start_threshold : 0,
+        stop_threshold : 0,
+        silence_threshold : 0,
+	avail_min : 0,
+    };
+
+    TRACE_DRIVER_IN(DRV_PCM_OPEN)
+    mPcmIn = pcm_open(0, 0, flags, &config);
+    TRACE_DRIVER_OUT
+    if (!pcm_is_ready(mPcmIn)) {
+        ALOGE("cannot open pcm_in driver: %s\n", pcm_get_error(mPcmIn));
+        TRACE_DRIVER_IN(DRV_PCM_CLOSE)
+        pcm_close(mPcmIn);
+        TRACE_DRIVER_OUT
+        mPcmIn = NULL;
+        mPcmInOpen = false;
+        return NULL;
+    }
+    mPcmInChannels = channelCount;
+    mPcmInOpen = true;
+    return mPcmIn;
+}
+
+void AudioHardware::closePcmIn_l(struct pcm *pcm)
+{
+    ALOGD("closePcmIn_l()");
+    if (pcm == NULL || pcm != mPcmIn || !mPcmInOpen) {
+        ALOGE("closePcmIn_l() pcm %p is not open", pcm);
+        return;
+    }
+
+    mPcmInOpen = false;
+    if (mStandbyDelay > 0) {
+        TRACE_DRIVER_IN(DRV_PCM_STOP)
+        pcm_stop(mPcmIn);
+        TRACE_DRIVER_OUT
+        scheduleStandby_l();
+    } else {
+        TRACE_DRIVER_IN(DRV_PCM_CLOSE)
+        pcm_close(mPcmIn);
+        TRACE_DRIVER_OUT
+        mPcmIn = NULL;
     }
 }
 
@@ -1012,9 +1368,8 @@ struct mixer *AudioHardware::openMixer_l()
     ALOGV("openMixer_l() mMixerOpenCnt: %d", mMixerOpenCnt);
     if (mMixerOpenCnt++ == 0) {
         if (mMixer != NULL) {
-            ALOGE("openMixer_l() mMixerOpenCnt == 0 and mMixer == %p\n", mMixer);
-            mMixerOpenCnt--;
-            return NULL;
+            // left open by closeMixer_l()
+            return mMixer;
         }
         TRACE_DRIVER_IN(DRV_MIXER_OPEN)
         mMixer = mixer_open(0);
@@ -1024,6 +1379,7 @@ struct mixer *AudioHardware::openMixer_l()
             mMixerOpenCnt--;
             return NULL;
         }
+        resolveMixerCtls_l();
     }
     return mMixer;
 }
@@ -1037,11 +1393,147 @@ void AudioHardware::closeMixer_l()
     }
 
     if (--mMixerOpenCnt == 0) {
+        if (mStandbyDelay > 0) {
+            scheduleStandby_l();
+        } else {
+            TRACE_DRIVER_IN(DRV_MIXER_CLOSE)
+            mixer_close(mMixer);
+            TRACE_DRIVER_OUT
+            mMixer = NULL;
+            resetMixerCtls_l();
+        }
+    }
+}
+
+// Looks the mixer controls up once per mixer open: their handles stay valid until
+// mixer_close()
+void AudioHardware::resolveMixerCtls_l()
+{
+    for (int i = 0; i < MIXER_CTL_CNT; i++) {
+        TRACE_DRIVER_IN(DRV_MIXER_GET)
+        mMixerCtl[i] = mixer_get_ctl_by_name(mMixer, mixerCtlName[i]);
+        TRACE_DRIVER_OUT
+        ALOGE_IF(mMixerCtl[i] == NULL, "resolveMixerCtls_l() could not get %s mixer ctl",
+                 mixerCtlName[i]);
+        mMixerValue[i] = NULL;
+    }
+}
+
+void AudioHardware::resetMixerCtls_l()
+{
+    for (int i = 0; i < MIXER_CTL_CNT; i++) {
+        mMixerCtl[i] = NULL;
+        mMixerValue[i] = NULL;
+    }
+}
+
+// Selects value on a codec enum control. The write is skipped when the value is
+// already selected unless force is set (e.g. for flag controls). Returns true if the
+// control was written.
+bool AudioHardware::setMixerCtl_l(int ctl, const char *value, bool force)
+{
+    if (mMixer == NULL || value == NULL) {
+        return false;
+    }
+    if (mMixerCtl[ctl] == NULL) {
+        ALOGE("setMixerCtl_l() no %s mixer ctl", mixerCtlName[ctl]);
+        return false;
+    }
+    if (!force && mMixerValue[ctl] != NULL &&
+            (mMixerValue[ctl] == value || strcmp(mMixerValue[ctl], value) == 0)) {
+        return false;
+    }
+    ALOGV("setMixerCtl_l() %s, (%s)", mixerCtlName[ctl], value);
+    // the route value names the section: a route change stands out in the trace
+    const bool traced = TRACE_ENABLED();
+    if (traced) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s %s", mixerCtlName[ctl], value);
+        TRACE_BEGIN(name);
+    }
+    TRACE_DRIVER_IN(DRV_MIXER_SEL)
+    mixer_ctl_set_enum_by_string(mMixerCtl[ctl], value);
+    TRACE_DRIVER_OUT
+    if (traced) {
+        TRACE_END();
+    }
+    mMixerValue[ctl] = value;
+    return true;
+}
+
+// Switches the codec playback path from the standby thread, so that the
+// route change is done by the time the output leaves standby
+void AudioHardware::postOutputRoute_l(const char *route)
+{
+    mPendingRoute = route;
+    mStandbyCond.signal();
+}
+
+void AudioHardware::scheduleStandby_l()
+{
+    mStandbyTime = systemTime() + mStandbyDelay;
+    mStandbyCond.signal();
+}
+
+// Closes the pcm and mixer left open by their last user
+void AudioHardware::closeIdle_l()
+{
+    if (mPcmOpenCnt == 0 && mPcm != NULL) {
+        ALOGV("closeIdle_l() closing pcm_out");
+        TRACE_DRIVER_IN(DRV_PCM_CLOSE)
+        pcm_close(mPcm);
+        TRACE_DRIVER_OUT
+        mPcm = NULL;
+    }
+    if (!mPcmInOpen && mPcmIn != NULL) {
+        ALOGV("closeIdle_l() closing pcm_in");
+        TRACE_DRIVER_IN(DRV_PCM_CLOSE)
+        pcm_close(mPcmIn);
+        TRACE_DRIVER_OUT
+        mPcmIn = NULL;
+    }
+    if (mMixerOpenCnt == 0 && mMixer != NULL) {
+        ALOGV("closeIdle_l() closing mixer");
         TRACE_DRIVER_IN(DRV_MIXER_CLOSE)
         mixer_close(mMixer);
         TRACE_DRIVER_OUT
         mMixer = NULL;
+        resetMixerCtls_l();
+    }
+}
+
+bool AudioHardware::standbyLoop()
+{
+    AutoMutex lock(mLock);
+
+    if (mStandbyThread->exitPending()) {
+        return false;
     }
+
+    if (mPendingRoute != NULL) {
+        if (mMode != AudioSystem::MODE_IN_CALL) {
+            setMixerCtl_l(MIXER_CTL_PLAYBACK_PATH, mPendingRoute);
+        }
+        mPendingRoute = NULL;
+    }
+
+    if (mStandbyTime == 0) {
+        mStandbyCond.wait(mLock);
+        return true;
+    }
+    nsecs_t now = systemTime();
+    if (now < mStandbyTime) {
+        mStandbyCond.waitRelative(mLock, mStandbyTime - now);
+        return true;
+    }
+    mStandbyTime = 0;
+    closeIdle_l();
+    return true;
+}
+
+bool AudioHardware::StandbyThread::threadLoop()
+{
+    return mHardware->standbyLoop();
 }
 
 const char *AudioHardware::getOutputRouteFromDevice(uint32_t device)
@@ -1164,10 +1656,7 @@ status_t AudioHardware::setInputSource_l(audio_source source)
      if (source != mInputSource) {
          if ((source == AUDIO_SOURCE_DEFAULT) || (mMode != AudioSystem::MODE_IN_CALL)) {
              if (mMixer) {
-                 TRACE_DRIVER_IN(DRV_MIXER_GET)
-                 struct mixer_ctl *ctl= mixer_get_ctl_by_name(mMixer, "Input Source");
-                 TRACE_DRIVER_OUT
-                 if (ctl == NULL) {
+                 if (mMixerCtl[MIXER_CTL_INPUT_SOURCE] == NULL) {
                      return NO_INIT;
                  }
                  const char* sourceName;
@@ -1191,10 +1680,7 @@ status_t AudioHardware::setInputSource_l(audio_source source)
                      default:
                          return NO_INIT;
                  }
-                 ALOGV("mixer_ctl_set_enum_by_string, Input Source, (%s)", sourceName);
-                 TRACE_DRIVER_IN(DRV_MIXER_SEL)
-                 mixer_ctl_set_enum_by_string(ctl, sourceName);
-                 TRACE_DRIVER_OUT
+                 setMixerCtl_l(MIXER_CTL_INPUT_SOURCE, sourceName);
              }
          }
          mInputSource = source;
@@ -1239,22 +1725,23 @@ void AudioHardware::releaseEchoReference(struct echo_reference_itfe *reference)
     }
 }
 
-
 //------------------------------------------------------------------------------
 //  AudioStreamOutALSA
 //------------------------------------------------------------------------------
 
 AudioHardware::AudioStreamOutALSA::AudioStreamOutALSA() :
-    mHardware(0), mPcm(0), mMixer(0), mRouteCtl(0),
+    mHardware(0), mPcm(0), mMixer(0),
     mStandby(true), mDevices(0), mChannels(AUDIO_HW_OUT_CHANNELS),
     mSampleRate(AUDIO_HW_OUT_SAMPLERATE), mBufferSize(AUDIO_HW_OUT_PERIOD_BYTES),
+    mProfile(OUTPUT_PROFILE_PRIMARY), mMmap(false), mMmapRunning(false),
+    mFramesWritten(0),
     mDriverOp(DRV_NONE), mStandbyCnt(0), mSleepReq(false), mEchoReference(NULL)
 {
 }
 
 status_t AudioHardware::AudioStreamOutALSA::set(
     AudioHardware* hw, uint32_t devices, int *pFormat,
-    uint32_t *pChannels, uint32_t *pRate)
+    uint32_t *pChannels, uint32_t *pRate, int profile)
 {
     int lFormat = pFormat ? *pFormat : 0;
     uint32_t lChannels = pChannels ? *pChannels : 0;
@@ -1284,7 +1771,21 @@ status_t AudioHardware::AudioStreamOutALSA::set(
 
     mChannels = lChannels;
     mSampleRate = lRate;
-    mBufferSize = AUDIO_HW_OUT_PERIOD_BYTES;
+    mProfile = profile;
+    size_t periodSize = outputConfigTable[profile][OUTPUT_CONFIG_PERIOD_SZ];
+    mBufferSize = periodSize * 2 * sizeof(int16_t);
+    if (mProfile == OUTPUT_PROFILE_DEEP_BUFFER) {
+        // large writes block in pcm_write until their last period fits in the kernel
+        // buffer: the framework only wakes up once per write
+        char value[PROPERTY_VALUE_MAX];
+        property_get(DEEP_BUFFER_WRITE_PROPERTY, value, "");
+        int writeMs = value[0] ? atoi(value) : AUDIO_HW_OUT_DEEP_WRITE_MS;
+        size_t periods = ((size_t)writeMs * mSampleRate / 1000 + periodSize - 1) / periodSize;
+        if (periods > 1) {
+            mBufferSize *= periods;
+        }
+        ALOGV("set() deep buffer writes of %u frames", mBufferSize / frameSize());
+    }
 
     return NO_ERROR;
 }
@@ -1294,12 +1795,29 @@ AudioHardware::AudioStreamOutALSA::~AudioStreamOutALSA()
     standby();
 }
 
+// Called with mLock held and the pcm open: returns the frames written to the kernel
+// buffer and not rendered yet, along with the time the hardware pointer was sampled.
+int AudioHardware::AudioStreamOutALSA::getKernelPending_l(size_t *pending,
+                                                          struct timespec *timestamp)
+{
+    size_t avail;
+
+    int rc = pcm_get_htimestamp(mPcm, &avail, timestamp);
+    if (rc < 0) {
+        return rc;
+    }
+    size_t bufferFrames = pcm_get_buffer_size(mPcm);
+    // more room than the kernel buffer means the pcm underran: nothing is pending
+    *pending = (avail < bufferFrames) ? bufferFrames - avail : 0;
+    return 0;
+}
+
 int AudioHardware::AudioStreamOutALSA::getPlaybackDelay(size_t frames,
                                                         struct echo_reference_buffer *buffer)
 {
     size_t kernelFr;
 
-    int rc = pcm_get_htimestamp(mPcm, &kernelFr, &buffer->time_stamp);
+    int rc = getKernelPending_l(&kernelFr, &buffer->time_stamp);
     if (rc < 0) {
         buffer->time_stamp.tv_sec  = 0;
         buffer->time_stamp.tv_nsec = 0;
@@ -1308,8 +1826,6 @@ int AudioHardware::AudioStreamOutALSA::getPlaybackDelay(size_t frames,
         return rc;
     }
 
-    kernelFr = pcm_get_buffer_size(mPcm) - kernelFr;
-
     // adjust render time stamp with delay added by current driver buffer.
     // Add the duration of current frame as we want the render time of the last
     // sample being written.
@@ -1334,6 +1850,10 @@ ssize_t AudioHardware::AudioStreamOutALSA::write(const void* buffer, size_t byte
 
     if (mHardware == NULL) return NO_INIT;
 
+    nsecs_t start = systemTime();
+    nsecs_t waitNs;
+    nsecs_t budgetNs = (nsecs_t)latency() * 1000000;
+
     if (mSleepReq) {
         // 10ms are always shorter than the time to reconfigure the audio path
         // which is the only condition when mSleepReq would be true.
@@ -1343,9 +1863,13 @@ ssize_t AudioHardware::AudioStreamOutALSA::write(const void* buffer, size_t byte
     { // scope for the lock
 
         AutoMutex lock(mLock);
+        waitNs = systemTime() - start;
 
         if (mStandby) {
+            nsecs_t hwStart = systemTime();
             AutoMutex hwLock(mHardware->lock());
+            nsecs_t wakeStart = systemTime();
+            waitNs += wakeStart - hwStart;
 
             ALOGD("AudioHardware pcm playback is exiting standby.");
             acquire_wake_lock(PARTIAL_WAKE_LOCK, "AudioOutLock");
@@ -1385,11 +1909,24 @@ ssize_t AudioHardware::AudioStreamOutALSA::write(const void* buffer, size_t byte
                 goto Error;
             }
             mStandby = false;
+            mPerfStats.recordWakeup(systemTime() - wakeStart);
+            ATRACE_INT(outputStandbyTrace[mProfile], 0);
+        }
+
+        if (mMmap) {
+            status = writeMmap_l(buffer, bytes);
+            if (status == NO_ERROR) {
+                mFramesWritten += bytes / frameSize();
+                mPerfStats.recordCall(start, waitNs, budgetNs);
+                return bytes;
+            }
+            ALOGW("mmap write error: %d", status);
+            goto Error;
         }
 
         if (mEchoReference != NULL) {
             struct echo_reference_buffer b;
-            b.raw = (void *)buffer;
+            b.raw = (void *)p;
             b.frame_count = bytes / frameSize();
 
             getPlaybackDelay(bytes / frameSize(), &b);
@@ -1402,12 +1939,20 @@ ssize_t AudioHardware::AudioStreamOutALSA::write(const void* buffer, size_t byte
 
         if (ret == 0) {
             //ALOGV("-----AudioStreamInALSA::write(%p, %d) END", buffer, (int)bytes);
+            mFramesWritten += bytes / frameSize();
+            mPerfStats.recordCall(start, waitNs, budgetNs);
             return bytes;
         }
         ALOGW("write error: %d", errno);
         status = -errno;
     }
 Error:
+    if (status == -EPIPE) {
+        // underrun reported by writeMmap_l()
+        mPerfStats.recordXrun();
+    } else {
+        mPerfStats.recordError();
+    }
     standby();
 
     // Simulate audio output timing in case of error
@@ -1416,6 +1961,73 @@ Error:
     return status;
 }
 
+// Called with mLock held. Frames are copied straight into the pcm DMA buffer, and the echo reference is fed from
+// the mapped area, so each frame is copied once.
+status_t AudioHardware::AudioStreamOutALSA::writeMmap_l(const void* buffer, size_t bytes)
+{
+    const int16_t *src = (const int16_t *)buffer;
+    size_t count = bytes / frameSize();
+    unsigned int bufferFrames = pcm_get_buffer_size(mPcm);
+    // wait at most twice the kernel buffer duration for room in it
+    int timeoutMs = (bufferFrames * 2000) / sampleRate() + 1;
+
+    while (count) {
+        int avail = pcm_avail_update(mPcm);
+        if (avail < 0) {
+            return -errno;
+        }
+        if ((unsigned int)avail > bufferFrames) {
+            // underrun: let the pcm be reopened on the next write, counted
+            // as an xrun by write()
+            ALOGW("writeMmap_l() underrun, avail %d", avail);
+            mMmapRunning = false;
+            return -EPIPE;
+        }
+        if (avail == 0) {
+            int rc = pcm_wait(mPcm, timeoutMs);
+            if (rc <= 0) {
+                mMmapRunning = false;
+                return rc == 0 ? TIMED_OUT : rc;
+            }
+            continue;
+        }
+
+        void *area;
+        unsigned int offset;
+        unsigned int frames = count;
+        pcm_mmap_begin(mPcm, &area, &offset, &frames);
+        int16_t *dst = (int16_t *)area + offset * 2;
+
+        memcpy(dst, src, frames * frameSize());
+
+        if (mEchoReference != NULL) {
+            struct echo_reference_buffer b;
+            b.raw = (void *)dst;
+            b.frame_count = frames;
+
+            getPlaybackDelay(frames, &b);
+            mEchoReference->write(mEchoReference, &b);
+        }
+
+        TRACE_DRIVER_IN(DRV_PCM_WRITE)
+        int rc = pcm_mmap_commit(mPcm, offset, frames);
+        TRACE_DRIVER_OUT
+        if (rc < 0) {
+            return -errno;
+        }
+        src += frames * 2;
+        count -= frames;
+
+        if (!mMmapRunning && (bufferFrames - avail + frames) >= bufferFrames / 2) {
+            if (pcm_start(mPcm) < 0) {
+                return -errno;
+            }
+            mMmapRunning = true;
+        }
+    }
+    return NO_ERROR;
+}
+
 status_t AudioHardware::AudioStreamOutALSA::standby()
 {
     if (mHardware == NULL) return NO_INIT;
@@ -1441,6 +2053,8 @@ void AudioHardware::AudioStreamOutALSA::doStandby_l()
 
     if (!mStandby) {
         ALOGD("AudioHardware pcm playback is going to standby.");
+        mPerfStats.recordStandby();
+        ATRACE_INT(outputStandbyTrace[mProfile], 1);
         // stop echo reference capture
         if (mEchoReference != NULL) {
             mEchoReference->write(mEchoReference, NULL);
@@ -1449,6 +2063,15 @@ void AudioHardware::AudioStreamOutALSA::doStandby_l()
         mStandby = true;
     }
 
+    // frames still in the kernel buffer are dropped when the pcm stops: keep the
+    // presentation position on what was actually rendered
+    if (mPcm != NULL) {
+        size_t pending;
+        struct timespec ts;
+        if (getKernelPending_l(&pending, &ts) == 0) {
+            mFramesWritten -= (pending < mFramesWritten) ? pending : mFramesWritten;
+        }
+    }
     close_l();
 }
 
@@ -1457,37 +2080,30 @@ void AudioHardware::AudioStreamOutALSA::close_l()
     if (mMixer) {
         mHardware->closeMixer_l();
         mMixer = NULL;
-        mRouteCtl = NULL;
     }
     if (mPcm) {
         mHardware->closePcmOut_l();
         mPcm = NULL;
     }
+    mMmap = false;
+    mMmapRunning = false;
 }
 
 status_t AudioHardware::AudioStreamOutALSA::open_l()
 {
     ALOGV("open pcm_out driver");
-    mPcm = mHardware->openPcmOut_l();
+    mPcm = mHardware->openPcmOut_l(mProfile);
     if (mPcm == NULL) {
         return NO_INIT;
     }
+    // the pcm may already be open with another transfer mode, e.g. for FM radio
+    mMmap = mHardware->pcmMmap_l();
 
     mMixer = mHardware->openMixer_l();
-    if (mMixer) {
-        ALOGV("open playback normal");
-        TRACE_DRIVER_IN(DRV_MIXER_GET)
-        mRouteCtl = mixer_get_ctl_by_name(mMixer, "Playback Path");
-        TRACE_DRIVER_OUT
-    }
     if (mHardware->mode() != AudioSystem::MODE_IN_CALL) {
         const char *route = mHardware->getOutputRouteFromDevice(mDevices);
         ALOGV("write() wakeup setting route %s", route);
-        if (mRouteCtl) {
-            TRACE_DRIVER_IN(DRV_MIXER_SEL)
-            mixer_ctl_set_enum_by_string(mRouteCtl, route);
-            TRACE_DRIVER_OUT
-        }
+        mHardware->setMixerCtl_l(MIXER_CTL_PLAYBACK_PATH, route);
     }
     return NO_ERROR;
 }
@@ -1511,8 +2127,6 @@ status_t AudioHardware::AudioStreamOutALSA::dump(int fd, const Vector<String16>&
     result.append(buffer);
     snprintf(buffer, SIZE, "\t\tmMixer: %p\n", mMixer);
     result.append(buffer);
-    snprintf(buffer, SIZE, "\t\tmRouteCtl: %p\n", mRouteCtl);
-    result.append(buffer);
     snprintf(buffer, SIZE, "\t\tStandby %s\n", (mStandby) ? "ON" : "OFF");
     result.append(buffer);
     snprintf(buffer, SIZE, "\t\tmDevices: 0x%08x\n", mDevices);
@@ -1523,8 +2137,13 @@ status_t AudioHardware::AudioStreamOutALSA::dump(int fd, const Vector<String16>&
     result.append(buffer);
     snprintf(buffer, SIZE, "\t\tmBufferSize: %d\n", mBufferSize);
     result.append(buffer);
+    snprintf(buffer, SIZE, "\t\tmProfile: %s\n", outputProfileName[mProfile]);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\t\tmFramesWritten: %llu\n", mFramesWritten);
+    result.append(buffer);
     snprintf(buffer, SIZE, "\t\tmDriverOp: %d\n", mDriverOp);
     result.append(buffer);
+    mPerfStats.dump(result);
 
     ::write(fd, result.string(), result.size());
 
@@ -1558,6 +2177,8 @@ status_t AudioHardware::AudioStreamOutALSA::setParameters(const String8& keyValu
                     mDevices = (uint32_t)device;
                     if (mHardware->mode() != AudioSystem::MODE_IN_CALL) {
                         doStandby_l();
+                        mHardware->postOutputRoute_l(
+                                mHardware->getOutputRouteFromDevice(mDevices));
                     }
                 }
                 if (mHardware->mode() == AudioSystem::MODE_IN_CALL) {
@@ -1586,6 +2207,10 @@ String8 AudioHardware::AudioStreamOutALSA::getParameters(const String8& keys)
     if (param.get(key, value) == NO_ERROR) {
         param.addInt(key, (int)mDevices);
     }
+    key = String8(PerfStats::keyPerfStats);
+    if (param.get(key, value) == NO_ERROR) {
+        param.add(key, mPerfStats.toString());
+    }
 
     ALOGV("AudioStreamOutALSA::getParameters() %s", param.toString().string());
     return param.toString();
@@ -1593,8 +2218,44 @@ String8 AudioHardware::AudioStreamOutALSA::getParameters(const String8& keys)
 
 status_t AudioHardware::AudioStreamOutALSA::getRenderPosition(uint32_t *dspFrames)
 {
-    //TODO
-    return INVALID_OPERATION;
+    uint64_t frames;
+    struct timespec timestamp;
+
+    if (dspFrames == NULL) {
+        return BAD_VALUE;
+    }
+    status_t status = getPresentationPosition(&frames, &timestamp);
+    if (status == NO_ERROR) {
+        *dspFrames = (uint32_t)frames;
+    }
+    return status;
+}
+
+// Frames rendered since the stream was opened and the CLOCK_MONOTONIC time at which the
+// last of them left the DAC, sampled from the kernel hardware pointer.
+status_t AudioHardware::AudioStreamOutALSA::getPresentationPosition(uint64_t *frames,
+                                                                     struct timespec *timestamp)
+{
+    size_t pending;
+
+    if (frames == NULL || timestamp == NULL) {
+        return BAD_VALUE;
+    }
+
+    AutoMutex lock(mLock);
+    // no pcm in standby
+    if (mPcm == NULL) {
+        return INVALID_OPERATION;
+    }
+    if (getKernelPending_l(&pending, timestamp) < 0) {
+        return INVALID_OPERATION;
+    }
+    // the pcm may have been opened by another user (e.g. FM radio) before this stream
+    if (pending > mFramesWritten) {
+        pending = mFramesWritten;
+    }
+    *frames = mFramesWritten - pending;
+    return NO_ERROR;
 }
 
 int AudioHardware::AudioStreamOutALSA::prepareLock()
@@ -1638,12 +2299,13 @@ void AudioHardware::AudioStreamOutALSA::removeEchoReference(struct echo_referenc
 //------------------------------------------------------------------------------
 
 AudioHardware::AudioStreamInALSA::AudioStreamInALSA() :
-    mHardware(0), mPcm(0), mMixer(0), mRouteCtl(0),
+    mHardware(0), mPcm(0), mMixer(0),
     mStandby(true), mDevices(0), mChannels(AUDIO_HW_IN_CHANNELS), mChannelCount(1),
     mSampleRate(AUDIO_HW_IN_SAMPLERATE), mBufferSize(AUDIO_HW_IN_PERIOD_BYTES),
     mDownSampler(NULL), mReadStatus(NO_ERROR), mInputBuf(NULL),
     mDriverOp(DRV_NONE), mStandbyCnt(0), mSleepReq(false),
-    mProcBuf(NULL), mProcBufSize(0), mRefBuf(NULL), mRefBufSize(0),
+    mProcBuf(NULL), mProcBufSize(0), mProcFront(0), mProcFramesIn(0),
+    mRefBuf(NULL), mRefBufSize(0), mRefFront(0), mRefFramesIn(0),
     mEchoReference(NULL), mNeedEchoReference(false)
 {
 }
@@ -1684,7 +2346,7 @@ status_t AudioHardware::AudioStreamInALSA::set(
         mBufferProvider.mProvider.get_next_buffer = getNextBufferStatic;
         mBufferProvider.mProvider.release_buffer = releaseBufferStatic;
         mBufferProvider.mInputStream = this;
-        int status = create_resampler(AUDIO_HW_OUT_SAMPLERATE,
+        int status = create_capture_resampler(AUDIO_HW_OUT_SAMPLERATE,
                                                     mSampleRate,
                                                     mChannelCount,
                                                     RESAMPLER_QUALITY_VOIP,
@@ -1698,6 +2360,14 @@ status_t AudioHardware::AudioStreamInALSA::set(
     }
     mInputBuf = new int16_t[AUDIO_HW_IN_PERIOD_SZ * mChannelCount];
 
+    // pre processing and echo reference rings are sized once here so that the capture
+    // thread never touches the heap: two read() requests worth of frames leave room for
+    // the frames a pre processor holds back between passes.
+    mProcBufSize = 2 * (mBufferSize / frameSize());
+    mProcBuf = new int16_t[mProcBufSize * mChannelCount];
+    mRefBufSize = mProcBufSize;
+    mRefBuf = new int16_t[mRefBufSize * mChannelCount];
+
     return NO_ERROR;
 }
 
@@ -1706,10 +2376,11 @@ AudioHardware::AudioStreamInALSA::~AudioStreamInALSA()
     standby();
 
     if (mDownSampler != NULL) {
-        release_resampler(mDownSampler);
+        release_capture_resampler(mDownSampler);
     }
     delete[] mInputBuf;
     delete[] mProcBuf;
+    delete[] mRefBuf;
 }
 
 // readFrames() reads frames from kernel driver, down samples to capture rate if necessary
@@ -1752,19 +2423,20 @@ ssize_t AudioHardware::AudioStreamInALSA::readFrames(void* buffer, ssize_t frame
 ssize_t AudioHardware::AudioStreamInALSA::processFrames(void* buffer, ssize_t frames)
 {
     ssize_t framesWr = 0;
+    size_t target = (size_t)frames < mProcBufSize ? (size_t)frames : mProcBufSize;
     while (framesWr < frames) {
-        // first reload enough frames at the end of process input buffer
-        if (mProcFramesIn < (size_t)frames) {
-            // expand process input buffer if necessary
-            if (mProcBufSize < (size_t)frames) {
-                mProcBufSize = (size_t)frames;
-                mProcBuf = (int16_t *)realloc(mProcBuf,
-                                              mProcBufSize * mChannelCount * sizeof(int16_t));
-                ALOGV("processFrames(): mProcBuf %p size extended to %d frames",
-                     mProcBuf, mProcBufSize);
+        // first reload enough frames at the rear of the process input ring, up to the
+        // wrap point: the next pass picks up where this one stopped
+        if (mProcFramesIn < target) {
+            size_t rear = mProcFront + mProcFramesIn;
+            if (rear >= mProcBufSize) {
+                rear -= mProcBufSize;
+            }
+            size_t framesRq = target - mProcFramesIn;
+            if (framesRq > mProcBufSize - rear) {
+                framesRq = mProcBufSize - rear;
             }
-            ssize_t framesRd = readFrames(mProcBuf + mProcFramesIn * mChannelCount,
-                                          frames - mProcFramesIn);
+            ssize_t framesRd = readFrames(mProcBuf + rear * mChannelCount, framesRq);
             if (framesRd < 0) {
                 framesWr = framesRd;
                 break;
@@ -1772,15 +2444,21 @@ ssize_t AudioHardware::AudioStreamInALSA::processFrames(void* buffer, ssize_t fr
             mProcFramesIn += framesRd;
         }
 
+        // pre processors need contiguous input: hand them the frames up to the wrap point
+        size_t framesIn = mProcBufSize - mProcFront;
+        if (framesIn > mProcFramesIn) {
+            framesIn = mProcFramesIn;
+        }
+
         if (mEchoReference != NULL) {
-            pushEchoReference(mProcFramesIn);
+            pushEchoReference(framesIn);
         }
 
         //inBuf.frameCount and outBuf.frameCount indicate respectively the maximum number of frames
         //to be consumed and produced by process()
         audio_buffer_t inBuf = {
-                mProcFramesIn,
-                {mProcBuf}
+                framesIn,
+                {mProcBuf + mProcFront * mChannelCount}
         };
         audio_buffer_t outBuf = {
                 frames - framesWr,
@@ -1795,12 +2473,14 @@ ssize_t AudioHardware::AudioStreamInALSA::processFrames(void* buffer, ssize_t fr
 
         // process() has updated the number of frames consumed and produced in
         // inBuf.frameCount and outBuf.frameCount respectively
-        // move remaining frames to the beginning of mProcBuf
+        // advance the ring front past the consumed frames
         mProcFramesIn -= inBuf.frameCount;
-        if (mProcFramesIn) {
-            memcpy(mProcBuf,
-                   mProcBuf + inBuf.frameCount * mChannelCount,
-                   mProcFramesIn * mChannelCount * sizeof(int16_t));
+        mProcFront += inBuf.frameCount;
+        if (mProcFront >= mProcBufSize) {
+            mProcFront -= mProcBufSize;
+        }
+        if (mProcFramesIn == 0) {
+            mProcFront = 0;
         }
 
         // if not enough frames were passed to process(), read more and retry.
@@ -1817,17 +2497,22 @@ int32_t AudioHardware::AudioStreamInALSA::updateEchoReference(size_t frames)
     struct echo_reference_buffer b;
     b.delay_ns = 0;
 
+    if (frames > mRefBufSize) {
+        frames = mRefBufSize;
+    }
+
     ALOGV("updateEchoReference1 START, frames = [%d], mRefFramesIn = [%d],  b.frame_count = [%d]",
          frames, mRefFramesIn, frames - mRefFramesIn);
     if (mRefFramesIn < frames) {
-        if (mRefBufSize < frames) {
-            mRefBufSize = frames;
-            mRefBuf = (int16_t *)realloc(mRefBuf,
-                                         mRefBufSize * mChannelCount * sizeof(int16_t));
+        size_t rear = mRefFront + mRefFramesIn;
+        if (rear >= mRefBufSize) {
+            rear -= mRefBufSize;
         }
-
         b.frame_count = frames - mRefFramesIn;
-        b.raw = (void *)(mRefBuf + mRefFramesIn * mChannelCount);
+        if (b.frame_count > mRefBufSize - rear) {
+            b.frame_count = mRefBufSize - rear;
+        }
+        b.raw = (void *)(mRefBuf + rear * mChannelCount);
 
         getCaptureDelay(frames, &b);
 
@@ -1853,10 +2538,13 @@ void AudioHardware::AudioStreamInALSA::pushEchoReference(size_t frames)
     if (mRefFramesIn < frames) {
         frames = mRefFramesIn;
     }
+    if (frames > mRefBufSize - mRefFront) {
+        frames = mRefBufSize - mRefFront;
+    }
 
     audio_buffer_t refBuf = {
             frames,
-            {mRefBuf}
+            {mRefBuf + mRefFront * mChannelCount}
     };
 
     for (size_t i = 0; i < mPreprocessors.size(); i++) {
@@ -1870,11 +2558,12 @@ void AudioHardware::AudioStreamInALSA::pushEchoReference(size_t frames)
     }
 
     mRefFramesIn -= refBuf.frameCount;
-    if (mRefFramesIn) {
-    ALOGV("pushEchoReference5: shifting mRefBuf down by = %d frames", mRefFramesIn);
-        memcpy(mRefBuf,
-               mRefBuf + refBuf.frameCount * mChannelCount,
-               mRefFramesIn * mChannelCount * sizeof(int16_t));
+    mRefFront += refBuf.frameCount;
+    if (mRefFront >= mRefBufSize) {
+        mRefFront -= mRefBufSize;
+    }
+    if (mRefFramesIn == 0) {
+        mRefFront = 0;
     }
 }
 
@@ -1961,6 +2650,12 @@ ssize_t AudioHardware::AudioStreamInALSA::read(void* buffer, ssize_t bytes)
 
     if (mHardware == NULL) return NO_INIT;
 
+    nsecs_t start = systemTime();
+    nsecs_t waitNs;
+    // kernel capture buffer duration
+    nsecs_t budgetNs = ((nsecs_t)AUDIO_HW_IN_PERIOD_SZ * AUDIO_HW_IN_PERIOD_CNT * 1000000000) /
+            AUDIO_HW_IN_SAMPLERATE;
+
     if (mSleepReq) {
         // 10ms are always shorter than the time to reconfigure the audio path
         // which is the only condition when mSleepReq would be true.
@@ -1969,9 +2664,13 @@ ssize_t AudioHardware::AudioStreamInALSA::read(void* buffer, ssize_t bytes)
 
     { // scope for the lock
         AutoMutex lock(mLock);
+        waitNs = systemTime() - start;
 
         if (mStandby) {
+            nsecs_t hwStart = systemTime();
             AutoMutex hwLock(mHardware->lock());
+            nsecs_t wakeStart = systemTime();
+            waitNs += wakeStart - hwStart;
 
             ALOGD("AudioHardware pcm capture is exiting standby.");
             sp<AudioStreamOutALSA> spOut = mHardware->output();
@@ -2016,6 +2715,8 @@ ssize_t AudioHardware::AudioStreamInALSA::read(void* buffer, ssize_t bytes)
                 goto Error;
             }
             mStandby = false;
+            mPerfStats.recordWakeup(systemTime() - wakeStart);
+            ATRACE_INT(inputStandbyTrace, 0);
         }
 
         size_t framesRq = bytes / mChannelCount/sizeof(int16_t);
@@ -2029,6 +2730,7 @@ ssize_t AudioHardware::AudioStreamInALSA::read(void* buffer, ssize_t bytes)
 
         if (framesRd >= 0) {
             //ALOGV("-----AudioStreamInALSA::read(%p, %d) END", buffer, (int)bytes);
+            mPerfStats.recordCall(start, waitNs, budgetNs);
             return framesRd * mChannelCount * sizeof(int16_t);
         }
 
@@ -2037,6 +2739,7 @@ ssize_t AudioHardware::AudioStreamInALSA::read(void* buffer, ssize_t bytes)
     }
 
 Error:
+    mPerfStats.recordError();
 
     standby();
 
@@ -2070,6 +2773,8 @@ void AudioHardware::AudioStreamInALSA::doStandby_l()
 
     if (!mStandby) {
         ALOGD("AudioHardware pcm capture is going to standby.");
+        mPerfStats.recordStandby();
+        ATRACE_INT(inputStandbyTrace, 1);
         if (mEchoReference != NULL) {
             // stop reading from echo reference
             mEchoReference->read(mEchoReference, NULL);
@@ -2098,50 +2803,19 @@ void AudioHardware::AudioStreamInALSA::close_l()
     if (mMixer) {
         mHardware->closeMixer_l();
         mMixer = NULL;
-        mRouteCtl = NULL;
     }
 
     if (mPcm) {
-        TRACE_DRIVER_IN(DRV_PCM_CLOSE)
-        pcm_close(mPcm);
-        TRACE_DRIVER_OUT
+        mHardware->closePcmIn_l(mPcm);
         mPcm = NULL;
     }
-
-    delete[] mProcBuf;
-    mProcBuf = NULL;
-    mProcBufSize = 0;
-    delete[] mRefBuf;
-    mRefBuf = NULL;
-    mRefBufSize = 0;
 }
 
 status_t AudioHardware::AudioStreamInALSA::open_l()
 {
-    unsigned flags = PCM_IN;
-
-    struct pcm_config config = {
-        channels : mChannelCount,
-        rate : AUDIO_HW_IN_SAMPLERATE,
-        period_size : AUDIO_HW_IN_PERIOD_SZ,
-        period_count : AUDIO_HW_IN_PERIOD_CNT,
-        format : PCM_FORMAT_S16_LE,
-        start_threshold : 0,
-        stop_threshold : 0,
-        silence_threshold : 0,
-	avail_min : 0,
-    };
-
     ALOGV("open pcm_in driver");
-    TRACE_DRIVER_IN(DRV_PCM_OPEN)
-    mPcm = pcm_open(0, 0, flags, &config);
-    TRACE_DRIVER_OUT
-    if (!pcm_is_ready(mPcm)) {
-        ALOGE("cannot open pcm_in driver: %s\n", pcm_get_error(mPcm));
-        TRACE_DRIVER_IN(DRV_PCM_CLOSE)
-        pcm_close(mPcm);
-        TRACE_DRIVER_OUT
-        mPcm = NULL;
+    mPcm = mHardware->openPcmIn_l(mChannelCount);
+    if (mPcm == NULL) {
         return NO_INIT;
     }
 
@@ -2150,26 +2824,17 @@ status_t AudioHardware::AudioStreamInALSA::open_l()
     }
     mInputFramesIn = 0;
 
-    mProcBufSize = 0;
+    mProcFront = 0;
     mProcFramesIn = 0;
-    mRefBufSize = 0;
+    mRefFront = 0;
     mRefFramesIn = 0;
 
     mMixer = mHardware->openMixer_l();
-    if (mMixer) {
-        TRACE_DRIVER_IN(DRV_MIXER_GET)
-        mRouteCtl = mixer_get_ctl_by_name(mMixer, "Capture MIC Path");
-        TRACE_DRIVER_OUT
-    }
 
     if (mHardware->mode() != AudioSystem::MODE_IN_CALL) {
         const char *route = mHardware->getInputRouteFromDevice(mDevices);
         ALOGV("read() wakeup setting route %s", route);
-        if (mRouteCtl) {
-            TRACE_DRIVER_IN(DRV_MIXER_SEL)
-            mixer_ctl_set_enum_by_string(mRouteCtl, route);
-            TRACE_DRIVER_OUT
-        }
+        mHardware->setMixerCtl_l(MIXER_CTL_CAPTURE_MIC_PATH, route);
     }
 
     return NO_ERROR;
@@ -2206,6 +2871,7 @@ status_t AudioHardware::AudioStreamInALSA::dump(int fd, const Vector<String16>&
     result.append(buffer);
     snprintf(buffer, SIZE, "\t\tmDriverOp: %d\n", mDriverOp);
     result.append(buffer);
+    mPerfStats.dump(result);
     write(fd, result.string(), result.size());
 
     return NO_ERROR;
@@ -2275,6 +2941,10 @@ String8 AudioHardware::AudioStreamInALSA::getParameters(const String8& keys)
     if (param.get(key, value) == NO_ERROR) {
         param.addInt(key, (int)mDevices);
     }
+    key = String8(PerfStats::keyPerfStats);
+    if (param.get(key, value) == NO_ERROR) {
+        param.add(key, mPerfStats.toString());
+    }
 
     ALOGV("AudioStreamInALSA::getParameters() %s", param.toString().string());
     return param.toString();
@@ -2417,6 +3087,142 @@ void AudioHardware::AudioStreamInALSA::unlock() {
     mLock.unlock();
 }
 
+//------------------------------------------------------------------------------
+//  PerfStats
+//------------------------------------------------------------------------------
+
+const char *AudioHardware::PerfStats::keyPerfStats = "perf_stats";
+
+// upper bound of each latency histogram bucket in us, the last one is open
+static const int32_t kLatencyBucketUs[] = {
+        500, 1000, 2000, 5000, 10000, 20000, 50000
+};
+
+AudioHardware::PerfStats::PerfStats() :
+    mCalls(0), mErrors(0), mXruns(0), mWakeups(0), mStandbys(0),
+    mMaxCallUs(0), mMaxWaitUs(0), mMaxOpenUs(0), mLastCallEnd(0)
+{
+    memset((void *)mCallHist, 0, sizeof(mCallHist));
+    memset((void *)mWaitHist, 0, sizeof(mWaitHist));
+}
+
+int AudioHardware::PerfStats::bucket(nsecs_t ns)
+{
+    int32_t us = (int32_t)(ns / 1000);
+    int i;
+    for (i = 0; i < LATENCY_BUCKET_CNT - 1; i++) {
+        if (us < kLatencyBucketUs[i]) {
+            break;
+        }
+    }
+    return i;
+}
+
+void AudioHardware::PerfStats::updateMax(volatile int32_t *max, int32_t value)
+{
+    int32_t old;
+    do {
+        old = *max;
+        if (value <= old) {
+            return;
+        }
+    } while (android_atomic_cmpxchg(old, value, max) != 0);
+}
+
+// called by the stream thread with the stream lock held
+void AudioHardware::PerfStats::recordCall(nsecs_t start, nsecs_t waitNs, nsecs_t budgetNs)
+{
+    nsecs_t end = systemTime();
+
+    android_atomic_inc(&mCalls);
+    android_atomic_inc(&mCallHist[bucket(end - start)]);
+    android_atomic_inc(&mWaitHist[bucket(waitNs)]);
+    updateMax(&mMaxCallUs, (int32_t)((end - start) / 1000));
+    updateMax(&mMaxWaitUs, (int32_t)(waitNs / 1000));
+    if (mLastCallEnd != 0 && start - mLastCallEnd > budgetNs) {
+        android_atomic_inc(&mXruns);
+    }
+    mLastCallEnd = end;
+}
+
+void AudioHardware::PerfStats::recordError()
+{
+    android_atomic_inc(&mErrors);
+}
+
+void AudioHardware::PerfStats::recordXrun()
+{
+    android_atomic_inc(&mXruns);
+}
+
+void AudioHardware::PerfStats::recordWakeup(nsecs_t openNs)
+{
+    android_atomic_inc(&mWakeups);
+    updateMax(&mMaxOpenUs, (int32_t)(openNs / 1000));
+}
+
+// called with the stream lock held: the pcm stops and the next call starts a new run
+void AudioHardware::PerfStats::recordStandby()
+{
+    android_atomic_inc(&mStandbys);
+    mLastCallEnd = 0;
+}
+
+void AudioHardware::PerfStats::dump(String8& result) const
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+
+    snprintf(buffer, SIZE, "\t\tCalls %d, errors %d, xruns %d, wakeups %d, standbys %d\n",
+             mCalls, mErrors, mXruns, mWakeups, mStandbys);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\t\tMax call %d us, max lock wait %d us, max wakeup %d us\n",
+             mMaxCallUs, mMaxWaitUs, mMaxOpenUs);
+    result.append(buffer);
+    result.append("\t\tLatency (us)   ");
+    for (int i = 0; i < LATENCY_BUCKET_CNT - 1; i++) {
+        snprintf(buffer, SIZE, " <%6d", kLatencyBucketUs[i]);
+        result.append(buffer);
+    }
+    result.append("   other\n\t\t  call         ");
+    for (int i = 0; i < LATENCY_BUCKET_CNT; i++) {
+        snprintf(buffer, SIZE, " %7d", mCallHist[i]);
+        result.append(buffer);
+    }
+    result.append("\n\t\t  lock wait    ");
+    for (int i = 0; i < LATENCY_BUCKET_CNT; i++) {
+        snprintf(buffer, SIZE, " %7d", mWaitHist[i]);
+        result.append(buffer);
+    }
+    result.append("\n");
+}
+
+// compact form returned for the perf_stats parameter key: no ';' nor '=' so that it
+// is carried as a single AudioParameter value
+String8 AudioHardware::PerfStats::toString() const
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    snprintf(buffer, SIZE, "calls:%d,errors:%d,xruns:%d,wakeups:%d,standbys:%d,"
+             "max_call_us:%d,max_wait_us:%d,max_wakeup_us:%d",
+             mCalls, mErrors, mXruns, mWakeups, mStandbys,
+             mMaxCallUs, mMaxWaitUs, mMaxOpenUs);
+    result.append(buffer);
+    result.append(",call_hist:");
+    for (int i = 0; i < LATENCY_BUCKET_CNT; i++) {
+        snprintf(buffer, SIZE, i ? "/%d" : "%d", mCallHist[i]);
+        result.append(buffer);
+    }
+    result.append(",wait_hist:");
+    for (int i = 0; i < LATENCY_BUCKET_CNT; i++) {
+        snprintf(buffer, SIZE, i ? "/%d" : "%d", mWaitHist[i]);
+        result.append(buffer);
+    }
+    return result;
+}
+
 //------------------------------------------------------------------------------
 //  Factory
 //------------------------------------------------------------------------------
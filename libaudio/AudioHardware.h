@@ -39,6 +39,7 @@ extern "C" {
 
 namespace android_audio_legacy {
     using android::AutoMutex;
+    using android::Condition;
     using android::Mutex;
     using android::RefBase;
     using android::SortedVector;
@@ -60,6 +61,21 @@ namespace android_audio_legacy {
 #define AUDIO_HW_OUT_PERIOD_CNT 4
 // Default audio output buffer size in bytes
 #define AUDIO_HW_OUT_PERIOD_BYTES (AUDIO_HW_OUT_PERIOD_SZ * 2 * sizeof(int16_t))
+// Low latency (AUDIO_OUTPUT_FLAG_FAST) pcm out buffer size in frames
+#define AUDIO_HW_OUT_FAST_PERIOD_SZ 256
+#define AUDIO_HW_OUT_FAST_PERIOD_CNT 4
+// Deep buffer (AUDIO_OUTPUT_FLAG_DEEP_BUFFER) pcm out buffer size in frames
+#define AUDIO_HW_OUT_DEEP_PERIOD_SZ 4096
+#define AUDIO_HW_OUT_DEEP_PERIOD_CNT 4
+// Duration of each deep buffer write in ms, rounded up to whole periods and
+// overridden with the hw.audio.deep_buffer_write_ms property. AudioFlinger mixes
+// and the decoder refills once per write, so this is how long they sleep during
+// screen off playback; it also bounds the pause and volume change delay.
+#define AUDIO_HW_OUT_DEEP_WRITE_MS 1000
+
+// Time the pcm and mixer are kept open once the last stream went to standby,
+// in ms, overridden with the hw.audio.standby_hysteresis_ms property
+#define AUDIO_HW_STANDBY_HYSTERESIS_MS 3000
 
 // Default audio input sample rate
 #define AUDIO_HW_IN_SAMPLERATE 44100
@@ -78,6 +94,7 @@ class AudioHardware : public AudioHardwareBase
 {
     class AudioStreamOutALSA;
     class AudioStreamInALSA;
+    class StandbyThread;
 
 public:
 
@@ -87,6 +104,38 @@ public:
     static const char *inputPathNameVoiceRecognition;
     static const char *inputPathNameVoiceCommunication;
 
+    // output stream profiles, selected from the output flags
+    enum {
+        OUTPUT_PROFILE_PRIMARY,
+        OUTPUT_PROFILE_FAST,
+        OUTPUT_PROFILE_DEEP_BUFFER,
+        OUTPUT_PROFILE_CNT
+    };
+
+    // column index in outputConfigTable[][]
+    enum {
+        OUTPUT_CONFIG_PERIOD_SZ,
+        OUTPUT_CONFIG_PERIOD_CNT,
+        OUTPUT_CONFIG_MMAP,
+        OUTPUT_CONFIG_CNT
+    };
+
+    // kernel pcm period size, count and transfer mode for each output profile
+    static const uint32_t  outputConfigTable[][OUTPUT_CONFIG_CNT];
+
+    // codec mixer controls, index in mixerCtlName[]
+    enum {
+        MIXER_CTL_PLAYBACK_PATH,
+        MIXER_CTL_VOICE_CALL_PATH,
+        MIXER_CTL_FM_RADIO_PATH,
+        MIXER_CTL_CAPTURE_MIC_PATH,
+        MIXER_CTL_INPUT_SOURCE,
+        MIXER_CTL_CODEC_STATUS,
+        MIXER_CTL_CNT
+    };
+
+    static const char *mixerCtlName[MIXER_CTL_CNT];
+
     AudioHardware();
     virtual ~AudioHardware();
     virtual status_t initCheck();
@@ -107,6 +156,14 @@ public:
         uint32_t devices, int *format=0, uint32_t *channels=0,
         uint32_t *sampleRate=0, status_t *status=0);
 
+    // Not an AudioHardwareInterface method before JB 4.2: on 4.1 it is only
+    // reached from openOutputStream() (hw.audio.output_profile "fast" or
+    // "deep_buffer" selects the profile) and from audio_hal_bench.
+    AudioStreamOut* openOutputStreamWithFlags(
+        uint32_t devices, audio_output_flags_t flags=(audio_output_flags_t)0,
+        int *format=0, uint32_t *channels=0,
+        uint32_t *sampleRate=0, status_t *status=0);
+
     virtual AudioStreamIn* openInputStream(
         uint32_t devices, int *format, uint32_t *channels,
         uint32_t *sampleRate, status_t *status,
@@ -138,12 +195,19 @@ public:
 
            Mutex& lock() { return mLock; }
 
-           struct pcm *openPcmOut_l();
+           struct pcm *openPcmOut_l(int profile = OUTPUT_PROFILE_PRIMARY);
            void closePcmOut_l();
+           bool pcmMmap_l() { return mPcmMmap; }
+
+           struct pcm *openPcmIn_l(uint32_t channelCount);
+           void closePcmIn_l(struct pcm *pcm);
 
            struct mixer *openMixer_l();
            void closeMixer_l();
 
+           bool setMixerCtl_l(int ctl, const char *value, bool force = false);
+           void postOutputRoute_l(const char *route);
+
            sp <AudioStreamOutALSA>  output() { return mOutput; }
 
            struct echo_reference_itfe *getEchoReference(audio_format_t format,
@@ -169,6 +233,8 @@ private:
     SortedVector < sp<AudioStreamInALSA> >   mInputs;
     Mutex           mLock;
     struct pcm*     mPcm;
+    int             mPcmProfile;
+    bool            mPcmMmap;
     struct mixer*   mMixer;
     uint32_t        mPcmOpenCnt;
     uint32_t        mMixerOpenCnt;
@@ -192,8 +258,68 @@ private:
     int             (*setCallClockSync)(HRilClient, SoundClockCondition);
     void            loadRILD(void);
     status_t        connectRILDIfRequired(void);
+
+    // secril-client calls are queued and sent by a dedicated thread so that a slow
+    // RIL socket never stalls a stream waiting for mLock
+    class RilThread : public android::Thread {
+    public:
+                        RilThread(AudioHardware *hw) :
+                            android::Thread(false), mHardware(hw) {}
+    private:
+        virtual bool    threadLoop();
+        AudioHardware*  mHardware;
+    };
+
+    void            queueCallClockSync(SoundClockCondition condition);
+    void            queueCallAudioPath(AudioPath path);
+    void            queueCallVolume(SoundType type, int volume);
+    bool            rilLoop();
+
+    sp <RilThread>  mRilThread;
+    Mutex           mRilLock;
+    Condition       mRilCond;
+    bool            mRilClockPending;
+    SoundClockCondition mRilClock;
+    bool            mRilPathPending;
+    AudioPath       mRilPath;
+    bool            mRilVolumePending;
+    SoundType       mRilVolumeType;
+    int             mRilVolume;
+    int             mRilQueued;
+    volatile int32_t mRilSent;
     struct echo_reference_itfe *mEchoReference;
 
+    // pcm and mixer are kept open (stopped) for mStandbyDelay after their
+    // last user closed them, so that leaving standby does not reopen them
+    class StandbyThread : public android::Thread {
+    public:
+                        StandbyThread(AudioHardware *hw) :
+                            android::Thread(false), mHardware(hw) {}
+    private:
+        virtual bool    threadLoop();
+        AudioHardware*  mHardware;
+    };
+
+    bool            standbyLoop();
+    void            scheduleStandby_l();
+    void            closeIdle_l();
+
+    sp <StandbyThread>  mStandbyThread;
+    Condition       mStandbyCond;
+    nsecs_t         mStandbyDelay;
+    nsecs_t         mStandbyTime;
+    struct pcm*     mPcmIn;
+    uint32_t        mPcmInChannels;
+    bool            mPcmInOpen;
+    const char*     mPendingRoute;
+
+    // control handles resolved at mixer open and the value last selected on
+    // each of them, NULL when unknown
+    void            resolveMixerCtls_l();
+    void            resetMixerCtls_l();
+    struct mixer_ctl* mMixerCtl[MIXER_CTL_CNT];
+    const char*     mMixerValue[MIXER_CTL_CNT];
+
     int             mFmFd;
     float           mFmVolume;
     bool            mFmResumeAfterCall;
@@ -202,6 +328,7 @@ private:
     int             mDriverOp;
 
     static uint32_t         checkInputSampleRate(uint32_t sampleRate);
+    static void             publishCallState(bool inCall);
 
     // column index in inputConfigTable[][]
     enum {
@@ -214,6 +341,46 @@ private:
     // between the kernel buffer size and audio hal buffer size for each sampling rate
     static const uint32_t  inputConfigTable[][INPUT_CONFIG_CNT];
 
+    // Per stream counters and latency histograms. Updated with atomic operations only
+    // so that they can be sampled by dump() and getParameters() without taking the
+    // stream lock.
+    class PerfStats {
+    public:
+        enum {
+            LATENCY_BUCKET_CNT = 8
+        };
+                        PerfStats();
+        // one write() or read() call that started at start and blocked waitNs on
+        // the stream and hardware locks. budgetNs is the kernel buffer duration: a
+        // longer gap since the previous call means the pcm ran dry (or over).
+        void            recordCall(nsecs_t start, nsecs_t waitNs, nsecs_t budgetNs);
+        void            recordError();
+        void            recordXrun();
+        void            recordWakeup(nsecs_t openNs);
+        void            recordStandby();
+        void            dump(String8& result) const;
+        String8         toString() const;
+
+        static const char *keyPerfStats;
+
+    private:
+        static int      bucket(nsecs_t ns);
+        static void     updateMax(volatile int32_t *max, int32_t value);
+
+        volatile int32_t mCalls;
+        volatile int32_t mErrors;
+        volatile int32_t mXruns;
+        volatile int32_t mWakeups;
+        volatile int32_t mStandbys;
+        volatile int32_t mMaxCallUs;
+        volatile int32_t mMaxWaitUs;
+        volatile int32_t mMaxOpenUs;
+        volatile int32_t mCallHist[LATENCY_BUCKET_CNT];
+        volatile int32_t mWaitHist[LATENCY_BUCKET_CNT];
+        // end of the previous call, only touched by the stream thread
+        nsecs_t         mLastCallEnd;
+    };
+
     class AudioStreamOutALSA : public AudioStreamOut, public RefBase
     {
     public:
@@ -223,7 +390,8 @@ private:
                      uint32_t devices,
                      int *pFormat,
                      uint32_t *pChannels,
-                     uint32_t *pRate);
+                     uint32_t *pRate,
+                     int profile);
         virtual uint32_t sampleRate()
             const { return mSampleRate; }
         virtual size_t bufferSize()
@@ -232,9 +400,11 @@ private:
             const { return mChannels; }
         virtual int format()
             const { return AUDIO_HW_OUT_FORMAT; }
+        // a write returns once its last frames are in the kernel buffer: only the
+        // kernel buffer adds to the latency, whatever the write size
         virtual uint32_t latency()
-            const { return (1000 * AUDIO_HW_OUT_PERIOD_CNT *
-                            (bufferSize()/frameSize()))/sampleRate() +
+            const { return (1000 * outputConfigTable[mProfile][OUTPUT_CONFIG_PERIOD_CNT] *
+                            outputConfigTable[mProfile][OUTPUT_CONFIG_PERIOD_SZ])/sampleRate() +
                             AUDIO_HW_OUT_LATENCY_MS; }
         virtual status_t setVolume(float left, float right)
                   { return INVALID_OPERATION; }
@@ -246,7 +416,9 @@ private:
         virtual status_t setParameters(const String8& keyValuePairs);
         virtual String8 getParameters(const String8& keys);
         uint32_t device() { return mDevices; }
+        int profile() const { return mProfile; }
         virtual status_t getRenderPosition(uint32_t *dspFrames);
+                status_t getPresentationPosition(uint64_t *frames, struct timespec *timestamp);
 
                 void doStandby_l();
                 void close_l();
@@ -260,27 +432,38 @@ private:
                 void addEchoReference(struct echo_reference_itfe *reference);
                 void removeEchoReference(struct echo_reference_itfe *reference);
 
+                const PerfStats& perfStats() const { return mPerfStats; }
+
     private:
 
                 int computeEchoReferenceDelay(size_t frames, struct timespec *echoRefRenderTime);
+                int getKernelPending_l(size_t *pending, struct timespec *timestamp);
                 int getPlaybackDelay(size_t frames, struct echo_reference_buffer *buffer);
+                status_t writeMmap_l(const void* buffer, size_t bytes);
 
         Mutex mLock;
         AudioHardware* mHardware;
         struct pcm *mPcm;
         struct mixer *mMixer;
-        struct mixer_ctl *mRouteCtl;
         const char *next_route;
         bool mStandby;
         uint32_t mDevices;
         uint32_t mChannels;
         uint32_t mSampleRate;
         size_t mBufferSize;
+        int mProfile;
+        // pcm opened with PCM_MMAP and started
+        bool mMmap;
+        bool mMmapRunning;
+        // frames handed to the kernel since the stream was opened, less the frames
+        // dropped from the kernel buffer on standby
+        uint64_t mFramesWritten;
         //  trace driver operations for dump
         int mDriverOp;
         int mStandbyCnt;
         bool mSleepReq;
         struct echo_reference_itfe *mEchoReference;
+        PerfStats mPerfStats;
     };
 
     class AudioStreamInALSA : public AudioStreamIn, public RefBase
@@ -315,6 +498,7 @@ private:
                 void close_l();
                 status_t open_l();
                 int standbyCnt() { return mStandbyCnt; }
+                const PerfStats& perfStats() const { return mPerfStats; }
 
         static size_t getBufferSize(uint32_t sampleRate, int channelCount);
 
@@ -352,7 +536,6 @@ private:
         AudioHardware* mHardware;
         struct pcm *mPcm;
         struct mixer *mMixer;
-        struct mixer_ctl *mRouteCtl;
         const char *next_route;
         bool mStandby;
         uint32_t mDevices;
@@ -371,13 +554,16 @@ private:
         bool mSleepReq;
         SortedVector<effect_handle_t> mPreprocessors;
         int16_t *mProcBuf;
-        size_t mProcBufSize;
+        size_t mProcBufSize;    // ring capacity in frames, fixed at set()
+        size_t mProcFront;
         size_t mProcFramesIn;
         int16_t *mRefBuf;
         size_t mRefBufSize;
+        size_t mRefFront;
         size_t mRefFramesIn;
         struct echo_reference_itfe *mEchoReference;
         bool mNeedEchoReference;
+        PerfStats mPerfStats;
     };
 
 };
@@ -0,0 +1,389 @@
+/*
+** Copyright 2012, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <math.h>
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "PolyphaseResampler"
+
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PolyphaseResampler.h"
+
+namespace android_audio_legacy {
+
+// coefficients are Q14: the L1 norm of a windowed sinc phase stays well below 2 so that
+// the 32 bit accumulator cannot overflow with full scale input
+#define COEF_SHIFT              14
+// taps per phase for each unit of decimation ratio
+#define TAPS_PER_RATIO          8
+#define MAX_TAPS                64
+#define MAX_PHASES              512
+// input frames copied from the provider per refill, on top of the filter history
+#define INPUT_CHUNK_FRAMES      512
+// pass band edge relative to the output Nyquist frequency
+#define CUTOFF_RATIO            0.90
+#define KAISER_BETA             8.0
+
+struct polyphase_resampler {
+    struct resampler_itfe itfe;     // must be first
+    struct resampler_buffer_provider *provider;
+    uint32_t inSampleRate;
+    uint32_t channelCount;
+    uint32_t interpolation;         // phases (L)
+    uint32_t decimation;            // input step per output in phase units (M)
+    uint32_t taps;
+    int16_t *coefs;                 // interpolation * taps, oldest input sample first
+    int16_t *buf;                   // filter history followed by fresh input, interleaved
+    size_t bufSize;                 // in frames
+    size_t bufCount;                // valid frames in buf
+    size_t index;                   // newest frame under the filter for next output
+    uint32_t phase;
+};
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+    while (b != 0) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// zeroth order modified Bessel function of the first kind, for the Kaiser window
+static double besselI0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+    double y = x * x / 4.0;
+    for (int k = 1; k < 50; k++) {
+        term *= y / ((double)k * k);
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+// designs the prototype low pass at interpolation * inSampleRate and splits it into
+// phases, each normalized to unity DC gain
+static int16_t *designCoefs(uint32_t phases, uint32_t taps, uint32_t inSampleRate,
+                            uint32_t outSampleRate)
+{
+    size_t n = phases * taps;
+    double *h = new double[n];
+    int16_t *coefs = new int16_t[n];
+    double fc = 0.5 * CUTOFF_RATIO * outSampleRate / inSampleRate / phases;
+    double center = (n - 1) / 2.0;
+    double i0Beta = besselI0(KAISER_BETA);
+
+    for (size_t m = 0; m < n; m++) {
+        double t = m - center;
+        double x = 2.0 * fc * t;
+        double sinc = (x == 0.0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+        double r = 2.0 * m / (n - 1) - 1.0;
+        double w = besselI0(KAISER_BETA * sqrt(1.0 - r * r)) / i0Beta;
+        h[m] = sinc * w;
+    }
+
+    for (uint32_t p = 0; p < phases; p++) {
+        double sum = 0;
+        for (uint32_t j = 0; j < taps; j++) {
+            sum += h[p + j * phases];
+        }
+        // tap j is applied to input sample (index - j): store reversed so that the
+        // filter walks input and coefficients in the same direction
+        for (uint32_t j = 0; j < taps; j++) {
+            double v = h[p + j * phases] / sum * (1 << COEF_SHIFT);
+            coefs[p * taps + (taps - 1 - j)] = (int16_t)floor(v + 0.5);
+        }
+    }
+
+    delete[] h;
+    return coefs;
+}
+
+static inline int16_t clamp16(int32_t sample)
+{
+    if ((sample >> 15) ^ (sample >> 31)) {
+        sample = 0x7FFF ^ (sample >> 31);
+    }
+    return sample;
+}
+
+static void filterMono(struct polyphase_resampler *rsmp, int16_t *out)
+{
+    const int16_t *x = rsmp->buf + (rsmp->index - (rsmp->taps - 1));
+    const int16_t *c = rsmp->coefs + rsmp->phase * rsmp->taps;
+    int32_t acc = 1 << (COEF_SHIFT - 1);
+
+    // taps is always a multiple of TAPS_PER_RATIO
+    for (uint32_t k = 0; k < rsmp->taps; k += 4) {
+        acc += x[k] * c[k];
+        acc += x[k + 1] * c[k + 1];
+        acc += x[k + 2] * c[k + 2];
+        acc += x[k + 3] * c[k + 3];
+    }
+    *out = clamp16(acc >> COEF_SHIFT);
+}
+
+static void filterStereo(struct polyphase_resampler *rsmp, int16_t *out)
+{
+    const int16_t *x = rsmp->buf + (rsmp->index - (rsmp->taps - 1)) * 2;
+    const int16_t *c = rsmp->coefs + rsmp->phase * rsmp->taps;
+    int32_t accL = 1 << (COEF_SHIFT - 1);
+    int32_t accR = accL;
+
+    for (uint32_t k = 0; k < rsmp->taps; k += 2) {
+        accL += x[2 * k] * c[k];
+        accR += x[2 * k + 1] * c[k];
+        accL += x[2 * k + 2] * c[k + 1];
+        accR += x[2 * k + 3] * c[k + 1];
+    }
+    out[0] = clamp16(accL >> COEF_SHIFT);
+    out[1] = clamp16(accR >> COEF_SHIFT);
+}
+
+// drops the input frames no longer under the filter. taps is at least TAPS_PER_RATIO times
+// the largest input step so the oldest frame needed is always still in the buffer.
+static void compact(struct polyphase_resampler *rsmp)
+{
+    size_t start = rsmp->index - (rsmp->taps - 1);
+    size_t ch = rsmp->channelCount;
+
+    memmove(rsmp->buf, rsmp->buf + start * ch, (rsmp->bufCount - start) * ch * sizeof(int16_t));
+    rsmp->bufCount -= start;
+    rsmp->index -= start;
+}
+
+// appends frames from the provider until the next output can be computed
+static int loadFromProvider(struct polyphase_resampler *rsmp)
+{
+    size_t ch = rsmp->channelCount;
+
+    while (rsmp->index >= rsmp->bufCount) {
+        struct resampler_buffer b;
+        b.raw = NULL;
+        b.frame_count = rsmp->bufSize - rsmp->bufCount;
+
+        int status = rsmp->provider->get_next_buffer(rsmp->provider, &b);
+        if (status != 0 || b.raw == NULL) {
+            return status != 0 ? status : -ENODATA;
+        }
+        memcpy(rsmp->buf + rsmp->bufCount * ch, b.i16, b.frame_count * ch * sizeof(int16_t));
+        rsmp->bufCount += b.frame_count;
+        rsmp->provider->release_buffer(rsmp->provider, &b);
+    }
+    return 0;
+}
+
+// produces up to *outFrameCount frames, pulling input from the provider when in is NULL.
+// *outFrameCount and *inFrameCount are updated with frames produced and consumed.
+static int resample(struct polyphase_resampler *rsmp,
+                    const int16_t *in, size_t *inFrameCount,
+                    int16_t *out, size_t *outFrameCount)
+{
+    size_t ch = rsmp->channelCount;
+    size_t framesWr = 0;
+    size_t framesRd = 0;
+    int status = 0;
+
+    while (framesWr < *outFrameCount) {
+        if (rsmp->index >= rsmp->bufCount) {
+            compact(rsmp);
+            if (in == NULL) {
+                status = loadFromProvider(rsmp);
+                if (status != 0) {
+                    break;
+                }
+            } else {
+                size_t frames = rsmp->bufSize - rsmp->bufCount;
+                if (frames > *inFrameCount - framesRd) {
+                    frames = *inFrameCount - framesRd;
+                }
+                memcpy(rsmp->buf + rsmp->bufCount * ch, in + framesRd * ch,
+                       frames * ch * sizeof(int16_t));
+                rsmp->bufCount += frames;
+                framesRd += frames;
+                if (rsmp->index >= rsmp->bufCount) {
+                    break;
+                }
+            }
+        }
+
+        while (framesWr < *outFrameCount && rsmp->index < rsmp->bufCount) {
+            if (ch == 1) {
+                filterMono(rsmp, out + framesWr);
+            } else {
+                filterStereo(rsmp, out + framesWr * 2);
+            }
+            framesWr++;
+            rsmp->phase += rsmp->decimation;
+            rsmp->index += rsmp->phase / rsmp->interpolation;
+            rsmp->phase %= rsmp->interpolation;
+        }
+    }
+
+    *outFrameCount = framesWr;
+    if (inFrameCount != NULL) {
+        *inFrameCount = framesRd;
+    }
+    return status;
+}
+
+static int polyphase_resample_from_provider(struct resampler_itfe *resampler,
+                                            int16_t *out,
+                                            size_t *outFrameCount)
+{
+    struct polyphase_resampler *rsmp = (struct polyphase_resampler *)resampler;
+
+    if (rsmp == NULL || out == NULL || outFrameCount == NULL || rsmp->provider == NULL) {
+        return -EINVAL;
+    }
+    return resample(rsmp, NULL, NULL, out, outFrameCount);
+}
+
+static int polyphase_resample_from_input(struct resampler_itfe *resampler,
+                                         int16_t *in,
+                                         size_t *inFrameCount,
+                                         int16_t *out,
+                                         size_t *outFrameCount)
+{
+    struct polyphase_resampler *rsmp = (struct polyphase_resampler *)resampler;
+
+    if (rsmp == NULL || in == NULL || inFrameCount == NULL ||
+            out == NULL || outFrameCount == NULL) {
+        return -EINVAL;
+    }
+    return resample(rsmp, in, inFrameCount, out, outFrameCount);
+}
+
+static void polyphase_reset(struct resampler_itfe *resampler)
+{
+    struct polyphase_resampler *rsmp = (struct polyphase_resampler *)resampler;
+
+    // start with a silent history so that the first output only needs fresh input
+    memset(rsmp->buf, 0, (rsmp->taps - 1) * rsmp->channelCount * sizeof(int16_t));
+    rsmp->bufCount = rsmp->taps - 1;
+    rsmp->index = rsmp->taps - 1;
+    rsmp->phase = 0;
+}
+
+static int32_t polyphase_delay_ns(struct resampler_itfe *resampler)
+{
+    struct polyphase_resampler *rsmp = (struct polyphase_resampler *)resampler;
+
+    // buffered input not yet under the filter plus the filter group delay;
+    // when downsampling index can step past bufCount
+    int64_t pending = (int64_t)rsmp->bufCount - (int64_t)rsmp->index;
+    if (pending < 0) {
+        pending = 0;
+    }
+    int64_t frames = pending + rsmp->taps / 2;
+    return (int32_t)((frames * 1000000000) / rsmp->inSampleRate);
+}
+
+static int create_polyphase_resampler(uint32_t inSampleRate,
+                                      uint32_t outSampleRate,
+                                      uint32_t channelCount,
+                                      struct resampler_buffer_provider *provider,
+                                      struct resampler_itfe **resampler)
+{
+    if (channelCount < 1 || channelCount > 2 || outSampleRate == 0 ||
+            outSampleRate >= inSampleRate) {
+        return -EINVAL;
+    }
+
+    uint32_t div = gcd(inSampleRate, outSampleRate);
+    uint32_t phases = outSampleRate / div;
+    if (phases > MAX_PHASES) {
+        return -EINVAL;
+    }
+    uint32_t taps = TAPS_PER_RATIO *
+            ((inSampleRate + outSampleRate - 1) / outSampleRate);
+    if (taps > MAX_TAPS) {
+        return -EINVAL;
+    }
+
+    struct polyphase_resampler *rsmp = new polyphase_resampler;
+    memset(rsmp, 0, sizeof(struct polyphase_resampler));
+    rsmp->itfe.reset = polyphase_reset;
+    rsmp->itfe.resample_from_provider = polyphase_resample_from_provider;
+    rsmp->itfe.resample_from_input = polyphase_resample_from_input;
+    rsmp->itfe.delay_ns = polyphase_delay_ns;
+    rsmp->provider = provider;
+    rsmp->inSampleRate = inSampleRate;
+    rsmp->channelCount = channelCount;
+    rsmp->interpolation = phases;
+    rsmp->decimation = inSampleRate / div;
+    rsmp->taps = taps;
+    rsmp->coefs = designCoefs(phases, taps, inSampleRate, outSampleRate);
+    rsmp->bufSize = taps + INPUT_CHUNK_FRAMES;
+    rsmp->buf = new int16_t[rsmp->bufSize * channelCount];
+    polyphase_reset(&rsmp->itfe);
+
+    ALOGV("create_polyphase_resampler() %u -> %u ch %u: %u phases %u taps",
+          inSampleRate, outSampleRate, channelCount, phases, taps);
+
+    *resampler = &rsmp->itfe;
+    return 0;
+}
+
+int create_capture_resampler(uint32_t inSampleRate,
+                             uint32_t outSampleRate,
+                             uint32_t channelCount,
+                             uint32_t quality,
+                             struct resampler_buffer_provider *provider,
+                             struct resampler_itfe **resampler)
+{
+    if (resampler == NULL) {
+        return -EINVAL;
+    }
+    *resampler = NULL;
+
+    if (create_polyphase_resampler(inSampleRate, outSampleRate, channelCount,
+                                   provider, resampler) == 0) {
+        return 0;
+    }
+    ALOGV("create_capture_resampler() %u -> %u not supported, using generic resampler",
+          inSampleRate, outSampleRate);
+    return create_resampler(inSampleRate, outSampleRate, channelCount, quality,
+                            provider, resampler);
+}
+
+void release_capture_resampler(struct resampler_itfe *resampler)
+{
+    if (resampler == NULL) {
+        return;
+    }
+    if (resampler->reset != polyphase_reset) {
+        release_resampler(resampler);
+        return;
+    }
+
+    struct polyphase_resampler *rsmp = (struct polyphase_resampler *)resampler;
+    delete[] rsmp->coefs;
+    delete[] rsmp->buf;
+    delete rsmp;
+}
+
+}; // namespace android_audio_legacy
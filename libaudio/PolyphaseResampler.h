@@ -0,0 +1,44 @@
+/*
+** Copyright 2012, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_POLYPHASE_RESAMPLER_H
+#define ANDROID_POLYPHASE_RESAMPLER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <audio_utils/resampler.h>
+
+namespace android_audio_legacy {
+
+// Fixed point polyphase down sampler behind the audio_utils resampler_itfe interface.
+// Only rational ratios with a small interpolation factor are handled (all the capture
+// sampling rates in inputConfigTable from 44.1kHz); create_capture_resampler() falls back
+// to the generic audio_utils resampler for anything else.
+int create_capture_resampler(uint32_t inSampleRate,
+                             uint32_t outSampleRate,
+                             uint32_t channelCount,
+                             uint32_t quality,
+                             struct resampler_buffer_provider *provider,
+                             struct resampler_itfe **resampler);
+
+// releases a resampler returned by create_capture_resampler() whichever implementation
+// was selected
+void release_capture_resampler(struct resampler_itfe *resampler);
+
+}; // namespace android
+
+#endif // ANDROID_POLYPHASE_RESAMPLER_H
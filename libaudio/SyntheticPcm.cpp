@@ -0,0 +1,520 @@
+/*
+** Copyright 2012, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "SyntheticPcm"
+
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tinyalsa/asoundlib.h>
+
+#include "SyntheticPcm.h"
+
+using namespace android_audio_legacy;
+
+// The hardware pointer of a running pcm moves one period at a time, at the nominal rate
+// from the moment the pcm was started, like it does on period interrupts. Playback
+// underruns stop the pcm the way tinyalsa recovers from EPIPE in pcm_write(); capture
+// overruns drop the kernel buffer. pcm_avail_update() reports the raw avail so that the
+// mmap path of AudioHardware sees its underruns as on the real driver.
+
+// loopback history in mono frames, a power of two above the largest kernel buffer
+#define LOOPBACK_FRAMES         65536
+
+struct pcm {
+    unsigned int flags;
+    struct pcm_config config;
+    unsigned int bufferFrames;
+    unsigned int frameSize;
+    unsigned int startThreshold;
+    bool running;
+    bool xrun;                      // underrun already counted
+    uint64_t hwBase;                // hardware position when last started
+    int64_t startNs;
+    uint64_t appl;                  // frames written (playback) or read (capture)
+    int16_t *area;                  // mmap buffer
+    FILE *file;
+    char error[64];
+};
+
+struct mixer {
+    int unused;
+};
+
+struct mixer_ctl {
+    int unused;
+};
+
+static pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+static int sBackend = SYNTHETIC_PCM_NULL;
+static const char *sInPath;
+static const char *sOutPath;
+static bool sOutFileOpened;
+static struct synthetic_pcm_stats sStats;
+
+// the playback pcm feeding the loopback and the position its successor starts from, so
+// that sLoop is indexed by a playback position that never goes back
+static struct pcm *sPlayback;
+static uint64_t sPlaybackEnd;
+static int16_t sLoop[LOOPBACK_FRAMES];
+
+static struct mixer sMixer;
+static struct mixer_ctl sMixerCtl;
+
+static int64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// called with sLock held, which is released while sleeping
+static void sleepUntil_l(int64_t ns)
+{
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    pthread_mutex_unlock(&sLock);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    pthread_mutex_lock(&sLock);
+}
+
+// frames rendered or captured since the pcm was started, not rounded to periods
+static uint64_t elapsedFrames(const struct pcm *pcm, int64_t ns)
+{
+    if (!pcm->running || ns <= pcm->startNs) {
+        return 0;
+    }
+    return (uint64_t)(ns - pcm->startNs) * pcm->config.rate / 1000000000LL;
+}
+
+static uint64_t hwPos_l(const struct pcm *pcm, int64_t ns)
+{
+    uint64_t elapsed = elapsedFrames(pcm, ns);
+    return pcm->hwBase + elapsed - elapsed % pcm->config.period_size;
+}
+
+// time at which the hardware pointer reaches pos, rounded up to a period
+static int64_t posTimeNs_l(const struct pcm *pcm, uint64_t pos)
+{
+    uint64_t period = pcm->config.period_size;
+    uint64_t frames = pos > pcm->hwBase ? pos - pcm->hwBase : 0;
+    frames = ((frames + period - 1) / period) * period;
+    return pcm->startNs + (int64_t)(frames * 1000000000ULL / pcm->config.rate) + 1;
+}
+
+static void start_l(struct pcm *pcm, int64_t ns)
+{
+    pcm->running = true;
+    pcm->xrun = false;
+    pcm->startNs = ns;
+}
+
+// a running playback pcm whose pointers have crossed stops, the frames in flight are lost
+static void checkUnderrun_l(struct pcm *pcm, int64_t ns)
+{
+    if (pcm->running && hwPos_l(pcm, ns) > pcm->appl) {
+        if (!pcm->xrun) {
+            sStats.underruns++;
+        }
+        pcm->running = false;
+        pcm->hwBase = pcm->appl;
+    }
+}
+
+static unsigned int playbackAvail_l(const struct pcm *pcm, int64_t ns)
+{
+    uint64_t queued = pcm->appl - hwPos_l(pcm, ns);
+    return queued < pcm->bufferFrames ? pcm->bufferFrames - (unsigned int)queued : 0;
+}
+
+static void playFrames_l(struct pcm *pcm, const int16_t *src, unsigned int frames)
+{
+    unsigned int channels = pcm->config.channels;
+
+    if (pcm->file != NULL) {
+        fwrite(src, pcm->frameSize, frames, pcm->file);
+    }
+    if (sBackend == SYNTHETIC_PCM_LOOPBACK && pcm == sPlayback) {
+        for (unsigned int i = 0; i < frames; i++) {
+            int32_t sum = 0;
+            for (unsigned int c = 0; c < channels; c++) {
+                sum += src[i * channels + c];
+            }
+            sLoop[(pcm->appl + i) & (LOOPBACK_FRAMES - 1)] = (int16_t)(sum / (int32_t)channels);
+        }
+    }
+    pcm->appl += frames;
+    sStats.frames_played += frames;
+}
+
+// fills dst with the frames captured from pcm->appl on
+static void captureFrames_l(struct pcm *pcm, int16_t *dst, unsigned int frames)
+{
+    unsigned int channels = pcm->config.channels;
+    unsigned int done = 0;
+
+    if (sBackend == SYNTHETIC_PCM_FILE && pcm->file != NULL) {
+        while (done < frames) {
+            size_t n = fread(dst + done * channels, pcm->frameSize, frames - done, pcm->file);
+            if (n == 0) {
+                if (ftell(pcm->file) <= 0) {
+                    break;
+                }
+                rewind(pcm->file);
+            }
+            done += n;
+        }
+    } else if (sBackend == SYNTHETIC_PCM_LOOPBACK && sPlayback != NULL &&
+            sPlayback->running) {
+        // the playback frame under the speaker when the first frame hit the microphone
+        struct pcm *out = sPlayback;
+        int64_t first = pcm->startNs +
+                (int64_t)((pcm->appl - pcm->hwBase) * 1000000000ULL / pcm->config.rate);
+        uint64_t pos = out->hwBase + elapsedFrames(out, first);
+        for (; done < frames; done++) {
+            uint64_t p = pos + (uint64_t)done * out->config.rate / pcm->config.rate;
+            int16_t s = 0;
+            if (p < out->appl && p + LOOPBACK_FRAMES > out->appl) {
+                s = sLoop[p & (LOOPBACK_FRAMES - 1)];
+            }
+            for (unsigned int c = 0; c < channels; c++) {
+                dst[done * channels + c] = s;
+            }
+        }
+    }
+    if (done < frames) {
+        memset(dst + done * channels, 0, (frames - done) * pcm->frameSize);
+    }
+    pcm->appl += frames;
+    sStats.frames_captured += frames;
+}
+
+namespace android_audio_legacy {
+
+void synthetic_pcm_set_backend(int backend, const char *inPath, const char *outPath)
+{
+    pthread_mutex_lock(&sLock);
+    sBackend = backend;
+    sInPath = inPath;
+    sOutPath = outPath;
+    sOutFileOpened = false;
+    pthread_mutex_unlock(&sLock);
+}
+
+void synthetic_pcm_get_stats(struct synthetic_pcm_stats *stats)
+{
+    pthread_mutex_lock(&sLock);
+    *stats = sStats;
+    pthread_mutex_unlock(&sLock);
+}
+
+}; // namespace android
+
+extern "C" {
+
+struct pcm *pcm_open(unsigned int card, unsigned int device,
+                     unsigned int flags, struct pcm_config *config)
+{
+    struct pcm *pcm = (struct pcm *)calloc(1, sizeof(struct pcm));
+    if (pcm == NULL) {
+        return NULL;
+    }
+    if (config == NULL || config->rate == 0 || config->channels == 0 ||
+            config->period_size == 0 || config->period_count == 0) {
+        snprintf(pcm->error, sizeof(pcm->error), "invalid configuration");
+        return pcm;
+    }
+
+    pcm->flags = flags;
+    pcm->config = *config;
+    pcm->bufferFrames = config->period_size * config->period_count;
+    pcm->frameSize = config->channels * (config->format == PCM_FORMAT_S32_LE ? 4 : 2);
+    // same default as tinyalsa
+    pcm->startThreshold = config->start_threshold ? config->start_threshold :
+                                                    pcm->bufferFrames / 2;
+    if (flags & PCM_MMAP) {
+        pcm->area = (int16_t *)calloc(pcm->bufferFrames, pcm->frameSize);
+    }
+
+    pthread_mutex_lock(&sLock);
+    if (sBackend == SYNTHETIC_PCM_FILE) {
+        if ((flags & PCM_IN) && sInPath != NULL) {
+            pcm->file = fopen(sInPath, "r");
+        } else if (!(flags & PCM_IN) && sOutPath != NULL) {
+            // successive opens append to the output of the run
+            pcm->file = fopen(sOutPath, sOutFileOpened ? "a" : "w");
+            sOutFileOpened = true;
+        }
+        if (pcm->file == NULL && ((flags & PCM_IN) ? sInPath : sOutPath) != NULL) {
+            snprintf(pcm->error, sizeof(pcm->error), "cannot open %s: %s",
+                     (flags & PCM_IN) ? sInPath : sOutPath, strerror(errno));
+        }
+    }
+    if (!(flags & PCM_IN)) {
+        pcm->appl = pcm->hwBase = sPlaybackEnd;
+        sPlayback = pcm;
+    }
+    pthread_mutex_unlock(&sLock);
+
+    ALOGV("pcm_open() card %u device %u flags %x, %u ch %u Hz %u x %u frames",
+          card, device, flags, config->channels, config->rate,
+          config->period_count, config->period_size);
+    return pcm;
+}
+
+int pcm_close(struct pcm *pcm)
+{
+    if (pcm == NULL) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&sLock);
+    if (pcm == sPlayback) {
+        sPlaybackEnd = pcm->appl;
+        sPlayback = NULL;
+    }
+    pthread_mutex_unlock(&sLock);
+
+    if (pcm->file != NULL) {
+        fclose(pcm->file);
+    }
+    free(pcm->area);
+    free(pcm);
+    return 0;
+}
+
+int pcm_is_ready(struct pcm *pcm)
+{
+    return pcm != NULL && pcm->error[0] == '\0';
+}
+
+const char *pcm_get_error(struct pcm *pcm)
+{
+    return pcm != NULL ? pcm->error : "out of memory";
+}
+
+unsigned int pcm_get_buffer_size(struct pcm *pcm)
+{
+    return pcm->bufferFrames;
+}
+
+unsigned int pcm_frames_to_bytes(struct pcm *pcm, unsigned int frames)
+{
+    return frames * pcm->frameSize;
+}
+
+unsigned int pcm_bytes_to_frames(struct pcm *pcm, unsigned int bytes)
+{
+    return bytes / pcm->frameSize;
+}
+
+int pcm_start(struct pcm *pcm)
+{
+    pthread_mutex_lock(&sLock);
+    if (!pcm->running) {
+        start_l(pcm, nowNs());
+    }
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+// drops the frames in flight, as SNDRV_PCM_IOCTL_DROP does
+int pcm_stop(struct pcm *pcm)
+{
+    pthread_mutex_lock(&sLock);
+    pcm->running = false;
+    pcm->hwBase = pcm->appl;
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+int pcm_write(struct pcm *pcm, const void *data, unsigned int count)
+{
+    const int16_t *src = (const int16_t *)data;
+    unsigned int frames = count / pcm->frameSize;
+
+    if (pcm->flags & PCM_IN) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&sLock);
+    while (frames) {
+        int64_t now = nowNs();
+        checkUnderrun_l(pcm, now);
+        unsigned int avail = playbackAvail_l(pcm, now);
+        if (avail == 0) {
+            sleepUntil_l(posTimeNs_l(pcm, hwPos_l(pcm, now) + 1));
+            continue;
+        }
+        unsigned int n = frames < avail ? frames : avail;
+        playFrames_l(pcm, src, n);
+        src += n * pcm->config.channels;
+        frames -= n;
+        if (!pcm->running && pcm->appl - pcm->hwBase >= pcm->startThreshold) {
+            start_l(pcm, now);
+        }
+    }
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+int pcm_read(struct pcm *pcm, void *data, unsigned int count)
+{
+    unsigned int frames = count / pcm->frameSize;
+
+    if (!(pcm->flags & PCM_IN)) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&sLock);
+    if (!pcm->running) {
+        start_l(pcm, nowNs());
+    }
+    for (;;) {
+        uint64_t hw = hwPos_l(pcm, nowNs());
+        if (hw - pcm->appl > pcm->bufferFrames) {
+            sStats.overruns++;
+            pcm->appl = hw;
+        }
+        if (hw - pcm->appl >= frames) {
+            break;
+        }
+        sleepUntil_l(posTimeNs_l(pcm, pcm->appl + frames));
+    }
+    captureFrames_l(pcm, (int16_t *)data, frames);
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+int pcm_get_htimestamp(struct pcm *pcm, size_t *avail, struct timespec *tstamp)
+{
+    pthread_mutex_lock(&sLock);
+    if (!pcm->running) {
+        pthread_mutex_unlock(&sLock);
+        return -1;
+    }
+    // the position and time of the last period interrupt
+    uint64_t hw = hwPos_l(pcm, nowNs());
+    int64_t ns = pcm->startNs + (int64_t)((hw - pcm->hwBase) * 1000000000ULL / pcm->config.rate);
+    if (pcm->flags & PCM_IN) {
+        *avail = hw - pcm->appl;
+    } else {
+        *avail = hw > pcm->appl ? pcm->bufferFrames : playbackAvail_l(pcm, ns);
+    }
+    tstamp->tv_sec = ns / 1000000000LL;
+    tstamp->tv_nsec = ns % 1000000000LL;
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+int pcm_avail_update(struct pcm *pcm)
+{
+    pthread_mutex_lock(&sLock);
+    uint64_t hw = hwPos_l(pcm, nowNs());
+    int64_t avail = (int64_t)pcm->bufferFrames + (int64_t)(hw - pcm->appl);
+    if (avail > pcm->bufferFrames && !pcm->xrun) {
+        sStats.underruns++;
+        pcm->xrun = true;
+    }
+    pthread_mutex_unlock(&sLock);
+    return (int)avail;
+}
+
+int pcm_wait(struct pcm *pcm, int timeout)
+{
+    unsigned int availMin = pcm->config.avail_min > 0 ? pcm->config.avail_min : 1;
+    int64_t deadline = nowNs() + (int64_t)timeout * 1000000LL;
+    int ret = 1;
+
+    pthread_mutex_lock(&sLock);
+    for (;;) {
+        int64_t now = nowNs();
+        if (hwPos_l(pcm, now) > pcm->appl || playbackAvail_l(pcm, now) >= availMin) {
+            break;
+        }
+        if (now >= deadline) {
+            ret = 0;
+            break;
+        }
+        int64_t due = deadline;
+        if (pcm->running) {
+            int64_t ready = posTimeNs_l(pcm, pcm->appl + availMin - pcm->bufferFrames);
+            if (ready < due) {
+                due = ready;
+            }
+        }
+        sleepUntil_l(due);
+    }
+    pthread_mutex_unlock(&sLock);
+    return ret;
+}
+
+int pcm_mmap_begin(struct pcm *pcm, void **areas, unsigned int *offset, unsigned int *frames)
+{
+    if (pcm->area == NULL) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&sLock);
+    unsigned int avail = playbackAvail_l(pcm, nowNs());
+    pthread_mutex_unlock(&sLock);
+
+    *areas = pcm->area;
+    *offset = pcm->appl % pcm->bufferFrames;
+    if (*frames > avail) {
+        *frames = avail;
+    }
+    if (*frames > pcm->bufferFrames - *offset) {
+        *frames = pcm->bufferFrames - *offset;
+    }
+    return 0;
+}
+
+int pcm_mmap_commit(struct pcm *pcm, unsigned int offset, unsigned int frames)
+{
+    pthread_mutex_lock(&sLock);
+    playFrames_l(pcm, pcm->area + offset * pcm->config.channels, frames);
+    pthread_mutex_unlock(&sLock);
+    return frames;
+}
+
+struct mixer *mixer_open(unsigned int card)
+{
+    return &sMixer;
+}
+
+void mixer_close(struct mixer *mixer)
+{
+}
+
+struct mixer_ctl *mixer_get_ctl_by_name(struct mixer *mixer, const char *name)
+{
+    return &sMixerCtl;
+}
+
+int mixer_ctl_set_enum_by_string(struct mixer_ctl *ctl, const char *string)
+{
+    ALOGV("mixer_ctl_set_enum_by_string() %s", string);
+    return 0;
+}
+
+}; // extern "C"
@@ -0,0 +1,48 @@
+/*
+** Copyright 2012, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_SYNTHETIC_PCM_H
+#define ANDROID_SYNTHETIC_PCM_H
+
+#include <stdint.h>
+
+namespace android_audio_legacy {
+
+// SyntheticPcm.cpp implements the part of the tinyalsa API used by AudioHardware on top
+// of a clock paced model of the kernel pcm: linked instead of libtinyalsa, it lets the HAL
+// run without audio hardware (see audio_hal_bench).
+enum {
+    SYNTHETIC_PCM_NULL,         // playback frames are dropped, capture returns silence
+    SYNTHETIC_PCM_FILE,         // playback appended to a file, capture looped from a file
+    SYNTHETIC_PCM_LOOPBACK,     // capture returns the playback frames being rendered
+};
+
+struct synthetic_pcm_stats {
+    uint64_t frames_played;
+    uint64_t frames_captured;
+    uint32_t underruns;
+    uint32_t overruns;
+};
+
+// selects the backend of the pcms opened afterwards. The files hold raw S16_LE frames
+// with the channel count of the pcm; with SYNTHETIC_PCM_FILE either path may be NULL.
+void synthetic_pcm_set_backend(int backend, const char *inPath, const char *outPath);
+
+void synthetic_pcm_get_stats(struct synthetic_pcm_stats *stats);
+
+}; // namespace android
+
+#endif // ANDROID_SYNTHETIC_PCM_H
@@ -0,0 +1,547 @@
+/*
+** Copyright 2012, The Android Open-Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+// audio_hal_bench: runs the audio HAL without the framework or audio hardware.
+// AudioHardware is linked with SyntheticPcm.cpp in place of libtinyalsa, so the pcms are
+// clock paced models with a null, file or loopback backend. One thread plays a tone on
+// the primary (or fast, or deep buffer) output while another captures at a rate that
+// goes through the resampler, with the AEC and NS pre processors of the effects factory
+// attached. Reported for each stream: CPU time per write() / read() call, jitter of the
+// call returns against the nominal buffer duration and heap allocations per call; then
+// the latency of the first call after standby. Allocations are counted for the calls
+// made from the HAL objects (linked with --wrap) and for any operator new.
+//
+// usage: audio_hal_bench [-b null|file|loopback] [-i file] [-o file] [-t seconds]
+//                        [-p primary|fast|deep] [-r rate] [-c channels] [-e aec,ns|none]
+//                        [-n cycles] [-w ms]
+
+#define LOG_TAG "audio_hal_bench"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <utils/Log.h>
+#include <utils/String8.h>
+#include <cutils/atomic.h>
+#include <hardware_legacy/AudioHardwareInterface.h>
+#include <media/EffectsFactoryApi.h>
+#include <audio_effects/effect_aec.h>
+#include <audio_effects/effect_ns.h>
+
+#include "AudioHardware.h"
+#include "SyntheticPcm.h"
+
+using namespace android;
+using namespace android_audio_legacy;
+
+#define DEFAULT_DURATION_S      10
+#define DEFAULT_CAPTURE_RATE    16000
+#define DEFAULT_STANDBY_CYCLES  20
+#define WARMUP_NS               500000000LL
+#define MAX_EFFECTS             4
+#define TONE_HZ                 997
+
+extern "C" AudioHardwareInterface* createAudioHardware(void);
+
+struct StreamBench {
+    const char *name;
+    AudioStreamOut *out;
+    AudioStreamIn *in;
+    void *buffer;
+    size_t bytes;
+    int64_t periodNs;           // duration of the frames transferred per call
+    // steady state results
+    int64_t *cpuNs;
+    int64_t *intervalNs;
+    size_t calls;
+    size_t maxCalls;
+    int32_t allocs;
+    int errors;
+    pthread_t thread;
+};
+
+static volatile int32_t sMeasuring;
+static volatile int32_t sDone;
+static volatile int32_t sOtherAllocs;
+
+// points to the allocation counter of the thread while it is in a measured call
+static pthread_key_t sAllocKey;
+static bool sAllocKeyValid;
+
+static inline void countAlloc()
+{
+    int32_t *counter = sAllocKeyValid ? (int32_t *)pthread_getspecific(sAllocKey) : NULL;
+    if (counter != NULL) {
+        (*counter)++;
+    } else if (sMeasuring) {
+        android_atomic_inc(&sOtherAllocs);
+    }
+}
+
+extern "C" {
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    countAlloc();
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    countAlloc();
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    countAlloc();
+    return __real_realloc(ptr, size);
+}
+
+}; // extern "C"
+
+void *operator new(size_t size)
+{
+    countAlloc();
+    return __real_malloc(size);
+}
+
+void *operator new[](size_t size)
+{
+    countAlloc();
+    return __real_malloc(size);
+}
+
+void operator delete(void *ptr)
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr)
+{
+    free(ptr);
+}
+
+static int64_t clockNow(clockid_t clock)
+{
+    struct timespec t;
+    t.tv_sec = t.tv_nsec = 0;
+    clock_gettime(clock, &t);
+    return int64_t(t.tv_sec) * 1000000000LL + t.tv_nsec;
+}
+
+static int compareNs(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int64_t percentile(const int64_t *sorted, size_t count, int pct)
+{
+    if (count == 0) {
+        return 0;
+    }
+    size_t i = (count * pct) / 100;
+    return sorted[i < count ? i : count - 1];
+}
+
+static ssize_t transfer(StreamBench *s)
+{
+    if (s->out != NULL) {
+        return s->out->write(s->buffer, s->bytes);
+    }
+    return s->in->read(s->buffer, s->bytes);
+}
+
+// one call with its allocations counted, returns the CPU time used by the call
+static int64_t measuredTransfer(StreamBench *s, int32_t *allocs, ssize_t *ret)
+{
+    pthread_setspecific(sAllocKey, allocs);
+    int64_t cpu = clockNow(CLOCK_THREAD_CPUTIME_ID);
+    *ret = transfer(s);
+    cpu = clockNow(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    pthread_setspecific(sAllocKey, NULL);
+    return cpu;
+}
+
+static void *streamLoop(void *arg)
+{
+    StreamBench *s = (StreamBench *)arg;
+    int64_t last = 0;
+    int32_t warmupAllocs = 0;
+
+    while (!sDone) {
+        bool measuring = sMeasuring;
+        ssize_t ret;
+        int64_t cpu = measuredTransfer(s, measuring ? &s->allocs : &warmupAllocs, &ret);
+        int64_t now = clockNow(CLOCK_MONOTONIC);
+        if (ret < 0) {
+            s->errors++;
+        }
+        if (measuring && last != 0 && s->calls < s->maxCalls) {
+            s->cpuNs[s->calls] = cpu;
+            s->intervalNs[s->calls] = now - last;
+            s->calls++;
+        }
+        last = now;
+    }
+    return NULL;
+}
+
+static void reportStream(StreamBench *s)
+{
+    printf("%s: %u bytes per call (%.2f ms), %u calls, %d errors\n", s->name,
+           (unsigned)s->bytes, s->periodNs / 1e6, (unsigned)s->calls, s->errors);
+    if (s->calls == 0) {
+        return;
+    }
+
+    int64_t sum = 0;
+    for (size_t i = 0; i < s->calls; i++) {
+        sum += s->intervalNs[i];
+        // the jitter is the deviation from the nominal duration of a buffer
+        s->intervalNs[i] = llabs(s->intervalNs[i] - s->periodNs);
+    }
+    qsort(s->cpuNs, s->calls, sizeof(int64_t), compareNs);
+    qsort(s->intervalNs, s->calls, sizeof(int64_t), compareNs);
+
+    printf("  cpu per call      p50 %6lld us  p90 %6lld us  p99 %6lld us  max %6lld us\n",
+           (long long)percentile(s->cpuNs, s->calls, 50) / 1000,
+           (long long)percentile(s->cpuNs, s->calls, 90) / 1000,
+           (long long)percentile(s->cpuNs, s->calls, 99) / 1000,
+           (long long)s->cpuNs[s->calls - 1] / 1000);
+    printf("  jitter            p50 %6lld us  p90 %6lld us  p99 %6lld us  max %6lld us"
+           "  (mean interval %.2f ms)\n",
+           (long long)percentile(s->intervalNs, s->calls, 50) / 1000,
+           (long long)percentile(s->intervalNs, s->calls, 90) / 1000,
+           (long long)percentile(s->intervalNs, s->calls, 99) / 1000,
+           (long long)s->intervalNs[s->calls - 1] / 1000,
+           sum / 1e6 / s->calls);
+    printf("  allocations       %.2f per 1000 calls\n", s->allocs * 1000.0 / s->calls);
+    printf("  hal %s\n", s->out != NULL ?
+           s->out->getParameters(String8("perf_stats")).string() :
+           s->in->getParameters(String8("perf_stats")).string());
+}
+
+// latency of the first call after standby, with the streams left idle for waitMs
+static void benchStandbyExit(StreamBench *streams[], int count, int cycles, int waitMs)
+{
+    int64_t *latency[2];
+    int32_t allocs[2] = { 0, 0 };
+
+    if (cycles <= 0) {
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        latency[i] = new int64_t[cycles];
+    }
+    for (int c = 0; c < cycles; c++) {
+        for (int i = 0; i < count; i++) {
+            if (streams[i]->out != NULL) {
+                streams[i]->out->standby();
+            } else {
+                streams[i]->in->standby();
+            }
+        }
+        if (waitMs > 0) {
+            usleep(waitMs * 1000);
+        }
+        for (int i = 0; i < count; i++) {
+            ssize_t ret;
+            int64_t start = clockNow(CLOCK_MONOTONIC);
+            measuredTransfer(streams[i], &allocs[i], &ret);
+            latency[i][c] = clockNow(CLOCK_MONOTONIC) - start;
+            if (ret < 0) {
+                streams[i]->errors++;
+            }
+        }
+    }
+
+    printf("standby exit, %d cycles %d ms apart:\n", cycles, waitMs);
+    for (int i = 0; i < count; i++) {
+        qsort(latency[i], cycles, sizeof(int64_t), compareNs);
+        printf("  %-16s  p50 %6lld us  p90 %6lld us  max %6lld us  %.1f allocations\n",
+               streams[i]->name,
+               (long long)percentile(latency[i], cycles, 50) / 1000,
+               (long long)percentile(latency[i], cycles, 90) / 1000,
+               (long long)latency[i][cycles - 1] / 1000,
+               (double)allocs[i] / cycles);
+        delete[] latency[i];
+    }
+}
+
+// creates the pre processors of the given types from the effects factory,
+// configured for the capture stream
+static int createEffects(const char *list, AudioStreamIn *in, effect_handle_t *effects)
+{
+    uint32_t numEffects = 0;
+    int count = 0;
+
+    if (!strcmp(list, "none") || EffectQueryNumberEffects(&numEffects) != 0) {
+        return 0;
+    }
+
+    effect_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.inputCfg.samplingRate = config.outputCfg.samplingRate = in->sampleRate();
+    config.inputCfg.channels = config.outputCfg.channels = in->channels();
+    config.inputCfg.format = config.outputCfg.format = AUDIO_FORMAT_PCM_16_BIT;
+    config.inputCfg.accessMode = EFFECT_BUFFER_ACCESS_READ;
+    config.outputCfg.accessMode = EFFECT_BUFFER_ACCESS_WRITE;
+    config.inputCfg.mask = config.outputCfg.mask = EFFECT_CONFIG_ALL;
+
+    static const struct {
+        const char *name;
+        const effect_uuid_t *type;
+    } kTypes[] = {
+        { "aec", FX_IID_AEC },
+        { "ns", FX_IID_NS },
+    };
+    for (size_t t = 0; t < sizeof(kTypes) / sizeof(kTypes[0]); t++) {
+        if (strstr(list, kTypes[t].name) == NULL || count >= MAX_EFFECTS) {
+            continue;
+        }
+        for (uint32_t i = 0; i < numEffects; i++) {
+            effect_descriptor_t desc;
+            effect_handle_t effect;
+            if (EffectQueryEffect(i, &desc) != 0 ||
+                    memcmp(&desc.type, kTypes[t].type, sizeof(effect_uuid_t)) != 0) {
+                continue;
+            }
+            if (EffectCreate(&desc.uuid, 1, 1, &effect) != 0) {
+                continue;
+            }
+            int reply;
+            uint32_t size = sizeof(reply);
+            (*effect)->command(effect, EFFECT_CMD_SET_CONFIG, sizeof(config), &config,
+                               &size, &reply);
+            size = sizeof(reply);
+            (*effect)->command(effect, EFFECT_CMD_ENABLE, 0, NULL, &size, &reply);
+            in->addAudioEffect(effect);
+            effects[count++] = effect;
+            printf("capture pre processor: %s\n", desc.name);
+            break;
+        }
+    }
+    return count;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: audio_hal_bench [-b null|file|loopback] [-i file] [-o file] [-t seconds]\n"
+            "                       [-p primary|fast|deep] [-r rate] [-c channels]\n"
+            "                       [-e aec,ns|none] [-n cycles] [-w ms]\n"
+            "  -b backend         synthetic pcm backend (loopback)\n"
+            "  -i file            raw capture frames for the file backend, looped\n"
+            "  -o file            raw playback frames written by the file backend\n"
+            "  -t seconds         length of the steady state run (%d)\n"
+            "  -p profile         output profile (primary)\n"
+            "  -r rate            capture sampling rate (%d)\n"
+            "  -c channels        capture channel count (1)\n"
+            "  -e effects         capture pre processors (aec,ns)\n"
+            "  -n cycles          standby exits measured after the run (%d)\n"
+            "  -w ms              time spent in standby before each exit (0)\n",
+            DEFAULT_DURATION_S, DEFAULT_CAPTURE_RATE, DEFAULT_STANDBY_CYCLES);
+}
+
+int main(int argc, char **argv)
+{
+    int backend = SYNTHETIC_PCM_LOOPBACK;
+    const char *inPath = NULL;
+    const char *outPath = NULL;
+    const char *effectList = "aec,ns";
+    audio_output_flags_t flags = (audio_output_flags_t)0;
+    int duration = DEFAULT_DURATION_S;
+    uint32_t rate = DEFAULT_CAPTURE_RATE;
+    uint32_t channelCount = 1;
+    int cycles = DEFAULT_STANDBY_CYCLES;
+    int waitMs = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:i:o:t:p:r:c:e:n:w:")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (!strcmp(optarg, "null")) {
+                backend = SYNTHETIC_PCM_NULL;
+            } else if (!strcmp(optarg, "file")) {
+                backend = SYNTHETIC_PCM_FILE;
+            } else if (!strcmp(optarg, "loopback")) {
+                backend = SYNTHETIC_PCM_LOOPBACK;
+            } else {
+                usage();
+                return 1;
+            }
+            break;
+        case 'i':
+            inPath = optarg;
+            break;
+        case 'o':
+            outPath = optarg;
+            break;
+        case 't':
+            duration = atoi(optarg);
+            break;
+        case 'p':
+            if (!strcmp(optarg, "fast")) {
+                flags = AUDIO_OUTPUT_FLAG_FAST;
+            } else if (!strcmp(optarg, "deep")) {
+                flags = AUDIO_OUTPUT_FLAG_DEEP_BUFFER;
+            } else if (strcmp(optarg, "primary")) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 'c':
+            channelCount = atoi(optarg);
+            break;
+        case 'e':
+            effectList = optarg;
+            break;
+        case 'n':
+            cycles = atoi(optarg);
+            break;
+        case 'w':
+            waitMs = atoi(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    sAllocKeyValid = pthread_key_create(&sAllocKey, NULL) == 0;
+    synthetic_pcm_set_backend(backend, inPath, outPath);
+
+    AudioHardwareInterface *hw = createAudioHardware();
+    if (hw == NULL || hw->initCheck() != NO_ERROR) {
+        fprintf(stderr, "audio hardware init failed\n");
+        return 1;
+    }
+
+    status_t status;
+    int format = AudioSystem::PCM_16_BIT;
+    uint32_t outChannels = AudioSystem::CHANNEL_OUT_STEREO;
+    uint32_t outRate = 44100;
+    // not reachable through AudioHardwareInterface on JB 4.1
+    AudioStreamOut *out = static_cast<AudioHardware *>(hw)->openOutputStreamWithFlags(
+            AudioSystem::DEVICE_OUT_SPEAKER, flags, &format, &outChannels, &outRate, &status);
+    if (out == NULL) {
+        fprintf(stderr, "cannot open the output stream (%d)\n", status);
+        return 1;
+    }
+
+    format = AudioSystem::PCM_16_BIT;
+    uint32_t inChannels = channelCount == 2 ? AudioSystem::CHANNEL_IN_STEREO :
+                                              AudioSystem::CHANNEL_IN_MONO;
+    AudioStreamIn *in = hw->openInputStream(AudioSystem::DEVICE_IN_BUILTIN_MIC, &format,
+                                            &inChannels, &rate, &status,
+                                            (AudioSystem::audio_in_acoustics)0);
+    if (in == NULL) {
+        fprintf(stderr, "cannot open the input stream at %u Hz (%d)\n", rate, status);
+        return 1;
+    }
+
+    effect_handle_t effects[MAX_EFFECTS];
+    int numEffects = createEffects(effectList, in, effects);
+
+    StreamBench playback, capture;
+    StreamBench *streams[2] = { &playback, &capture };
+    memset(&playback, 0, sizeof(playback));
+    memset(&capture, 0, sizeof(capture));
+
+    playback.name = "playback";
+    playback.out = out;
+    playback.bytes = out->bufferSize();
+    playback.periodNs = (int64_t)(playback.bytes / out->frameSize()) * 1000000000LL /
+            out->sampleRate();
+    int16_t *tone = new int16_t[playback.bytes / sizeof(int16_t)];
+    size_t toneFrames = playback.bytes / out->frameSize();
+    for (size_t i = 0; i < toneFrames; i++) {
+        int16_t s = (int16_t)(8192 * sin(2 * M_PI * TONE_HZ * i / out->sampleRate()));
+        tone[i * 2] = tone[i * 2 + 1] = s;
+    }
+    playback.buffer = tone;
+
+    capture.name = "capture";
+    capture.in = in;
+    capture.bytes = in->bufferSize();
+    capture.periodNs = (int64_t)(capture.bytes / in->frameSize()) * 1000000000LL /
+            in->sampleRate();
+    capture.buffer = new int16_t[capture.bytes / sizeof(int16_t)];
+
+    printf("output %u Hz, input %u Hz %u ch, backend %s\n", out->sampleRate(),
+           in->sampleRate(), channelCount,
+           backend == SYNTHETIC_PCM_NULL ? "null" :
+           backend == SYNTHETIC_PCM_FILE ? "file" : "loopback");
+
+    for (int i = 0; i < 2; i++) {
+        StreamBench *s = streams[i];
+        s->maxCalls = (size_t)((duration * 1000000000LL) / s->periodNs) * 2 + 16;
+        s->cpuNs = new int64_t[s->maxCalls];
+        s->intervalNs = new int64_t[s->maxCalls];
+        pthread_create(&s->thread, NULL, streamLoop, s);
+    }
+
+    // the first calls open the pcms and fill the kernel buffers: leave them out
+    usleep(WARMUP_NS / 1000);
+    android_atomic_release_store(1, &sMeasuring);
+    struct timespec ts;
+    ts.tv_sec = duration;
+    ts.tv_nsec = 0;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+    android_atomic_release_store(0, &sMeasuring);
+    android_atomic_release_store(1, &sDone);
+    for (int i = 0; i < 2; i++) {
+        pthread_join(streams[i]->thread, NULL);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        reportStream(streams[i]);
+    }
+    printf("other threads: %d allocations\n", sOtherAllocs);
+
+    benchStandbyExit(streams, 2, cycles, waitMs);
+
+    struct synthetic_pcm_stats stats;
+    synthetic_pcm_get_stats(&stats);
+    printf("pcm: %llu frames played, %llu captured, %u underruns, %u overruns\n",
+           (unsigned long long)stats.frames_played, (unsigned long long)stats.frames_captured,
+           stats.underruns, stats.overruns);
+
+    for (int i = 0; i < numEffects; i++) {
+        in->removeAudioEffect(effects[i]);
+        EffectRelease(effects[i]);
+    }
+    hw->closeInputStream(in);
+    hw->closeOutputStream(out);
+    delete hw;
+    return 0;
+}
@@ -23,15 +23,19 @@
 //#define LOG_NDEBUG 0
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 
 #include <hardware/lights.h>
@@ -42,6 +46,15 @@
 #define ENABLE_BL		1
 #define DISABLE_BL		0
 
+/* Backlight updates closer together than a display frame are coalesced */
+#define BACKLIGHT_FRAME_NS	16666667LL
+
+/* Fade duration applied to every backlight change, 0 to step straight to
+ * the requested level. A LIGHT_FLASH_TIMED backlight request fades over
+ * flashOnMS instead. */
+#define BACKLIGHT_RAMP_PROPERTY	"hw.lights.backlight_ramp_ms"
+#define BACKLIGHT_RAMP_MAX_MS	5000
+
 static pthread_once_t g_init = PTHREAD_ONCE_INIT;
 static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -50,32 +63,214 @@ char const*const BUTTON_FILE = "/sys/class/leds/button-backlight/brightness"; //
 //char const*const BUTTON_FILE = "/sys/class/misc/melfas_touchkey/brightness"; // For Captivate Glide
 char const*const NOTIFICATION_FILE_BLN = "/sys/class/misc/backlightnotification/notification_led";
 
+/* A sysfs attribute kept open across writes. The last value written is
+ * remembered so that writing it again can be skipped, unless the driver
+ * may change the attribute behind our back. */
+struct light_file {
+    char const *path;
+    int fd;
+    int value;      /* -1 if unknown */
+    int cached;
+    int warned;
+};
+
+static struct light_file g_panel;
+static struct light_file g_buttons;
+static struct light_file g_notification;
+
+/* Backlight value waiting for the writer thread, -1 if none */
+static int g_backlight_pending = -1;
+static int64_t g_backlight_written_ns;
+static int g_backlight_thread_started;
+static pthread_t g_backlight_thread;
+static pthread_cond_t g_backlight_cond = PTHREAD_COND_INITIALIZER;
+
+/* Fade in progress: from g_ramp_from at g_ramp_start_ns to g_ramp_to
+ * g_ramp_ns later; g_ramp_ns is 0 when there is none */
+static int g_ramp_from;
+static int g_ramp_to;
+static int64_t g_ramp_start_ns;
+static int64_t g_ramp_ns;
+static int g_ramp_default_ms;
+
+static void init_light_file(struct light_file *file, char const *path, int cached)
+{
+    file->path = path;
+    file->fd = -1;
+    file->value = -1;
+    file->cached = cached;
+    file->warned = 0;
+}
+
 void init_g_lock(void)
 {
     pthread_mutex_init(&g_lock, NULL);
+    pthread_cond_init(&g_backlight_cond, NULL);
+
+    init_light_file(&g_panel, PANEL_FILE, 1);
+    init_light_file(&g_buttons, BUTTON_FILE, 1);
+    /* BLN switches itself off when the screen comes on */
+    init_light_file(&g_notification, NOTIFICATION_FILE_BLN, 0);
+
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get(BACKLIGHT_RAMP_PROPERTY, value, NULL) > 0) {
+        g_ramp_default_ms = atoi(value);
+        if (g_ramp_default_ms < 0)
+            g_ramp_default_ms = 0;
+        if (g_ramp_default_ms > BACKLIGHT_RAMP_MAX_MS)
+            g_ramp_default_ms = BACKLIGHT_RAMP_MAX_MS;
+    }
 }
 
-static int write_int(char const *path, int value)
+static int64_t now_ns(void)
 {
-    int fd;
-    static int already_warned;
+    struct timespec ts;
 
-    already_warned = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* called with g_lock held */
+static int write_int(struct light_file *file, int value)
+{
+    char buffer[20];
+    int bytes, amt, err;
+
+    if (file->cached && file->value == value)
+        return 0;
+
+    if (file->fd < 0) {
+        file->fd = open(file->path, O_RDWR);
+        if (file->fd < 0) {
+            err = -errno;
+            if (file->warned == 0) {
+                ALOGE("write_int failed to open %s, %s\n", file->path, strerror(errno));
+                file->warned = 1;
+            }
+            return err;
+        }
+        file->warned = 0;
+    }
+
+    bytes = sprintf(buffer, "%d\n", value);
+    amt = pwrite(file->fd, buffer, bytes, 0);
+    if (amt == -1) {
+        /* reopen on the next write in case the attribute went away */
+        err = -errno;
+        close(file->fd);
+        file->fd = -1;
+        file->value = -1;
+        return err;
+    }
+
+    file->value = value;
+    return 0;
+}
+
+/* called with g_lock held: backlight level of the fade in progress at now */
+static int ramp_value(int64_t now)
+{
+    int64_t elapsed = now - g_ramp_start_ns;
+
+    if (elapsed >= g_ramp_ns)
+        return g_ramp_to;
+    return g_ramp_from + (int)((g_ramp_to - g_ramp_from) * elapsed / g_ramp_ns);
+}
+
+/* called with g_lock held: when the fade in progress next changes level */
+static int64_t ramp_next_step_ns(void)
+{
+    int64_t steps = g_ramp_to > g_ramp_from ? g_ramp_to - g_ramp_from : g_ramp_from - g_ramp_to;
+    int64_t done = g_panel.value > g_ramp_from ? g_panel.value - g_ramp_from : g_ramp_from - g_panel.value;
+
+    /* not on the way yet: the first step is due straight away */
+    if (g_panel.value < 0 || steps == 0 ||
+            (g_panel.value - g_ramp_from) * (g_ramp_to - g_panel.value) < 0)
+        return g_ramp_start_ns;
+    return g_ramp_start_ns + (done + 1) * g_ramp_ns / steps;
+}
 
-    fd = open(path, O_RDWR);
-    if (fd >= 0) {
-        char buffer[20];
-        int bytes = sprintf(buffer, "%d\n", value);
-        int amt = write(fd, buffer, bytes);
-        close(fd);
-        return amt == -1 ? -errno : 0;
+static void wait_until(int tfd, int64_t when)
+{
+    struct itimerspec its;
+    uint64_t expirations;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = when / 1000000000LL;
+    its.it_value.tv_nsec = when % 1000000000LL;
+    if (tfd >= 0 && timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+        read(tfd, &expirations, sizeof(expirations));
     } else {
-        if (already_warned == 0) {
-            ALOGE("write_int failed to open %s, %s\n", path, strerror(errno));
-            already_warned = 1;
+        int64_t delay = when - now_ns();
+        struct timespec ts;
+
+        if (delay <= 0)
+            return;
+        ts.tv_sec = delay / 1000000000LL;
+        ts.tv_nsec = delay % 1000000000LL;
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Writes out the backlight values left pending by set_light_backlight and
+ * steps fades, no more than once per display frame and only when the level
+ * actually changes. Sleeps on a timerfd between steps. */
+static void *backlight_thread(void *arg)
+{
+    int tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+
+    if (tfd < 0)
+        ALOGW("timerfd_create failed, %s", strerror(errno));
+
+    pthread_mutex_lock(&g_lock);
+    for (;;) {
+        int64_t when, now;
+        int value;
+
+        while (g_backlight_pending < 0 && g_ramp_ns == 0)
+            pthread_cond_wait(&g_backlight_cond, &g_lock);
+
+        when = g_backlight_written_ns + BACKLIGHT_FRAME_NS;
+        if (g_ramp_ns && ramp_next_step_ns() > when)
+            when = ramp_next_step_ns();
+        if (when > now_ns()) {
+            pthread_mutex_unlock(&g_lock);
+            wait_until(tfd, when);
+            pthread_mutex_lock(&g_lock);
+        }
+
+        /* a new request may have replaced what we were waiting for */
+        now = now_ns();
+        if (g_ramp_ns) {
+            value = ramp_value(now);
+            if (value == g_ramp_to)
+                g_ramp_ns = 0;
+        } else if (g_backlight_pending >= 0) {
+            value = g_backlight_pending;
+            g_backlight_pending = -1;
+        } else {
+            continue;
+        }
+
+        ALOGV("%s(%d)", __FUNCTION__, value);
+        if (value != g_panel.value) {
+            write_int(&g_panel, value);
+            g_backlight_written_ns = now;
         }
-        return -errno;
     }
+
+    return NULL;
+}
+
+/* called with g_lock held */
+static int start_backlight_thread(void)
+{
+    if (g_backlight_thread_started)
+        return 0;
+    if (pthread_create(&g_backlight_thread, NULL, backlight_thread, NULL) != 0)
+        return -1;
+    g_backlight_thread_started = 1;
+    return 0;
 }
 
 static int rgb_to_brightness(struct light_state_t const *state)
@@ -91,10 +286,50 @@ static int set_light_backlight(struct light_device_t *dev,
 {
     int err = 0;
     int brightness = rgb_to_brightness(state);
+    int ramp_ms = g_ramp_default_ms;
+
+    if (state->flashMode == LIGHT_FLASH_TIMED)
+        ramp_ms = state->flashOnMS < BACKLIGHT_RAMP_MAX_MS ? state->flashOnMS : BACKLIGHT_RAMP_MAX_MS;
 
     pthread_mutex_lock(&g_lock);
-    ALOGV("%s(%d)", __FUNCTION__, brightness);
-    err = write_int(PANEL_FILE, brightness);
+    ALOGV("%s(%d, %dms)", __FUNCTION__, brightness, ramp_ms);
+    if (ramp_ms > 0 && g_panel.value >= 0 && start_backlight_thread() == 0) {
+        /* fade from wherever the panel is heading to now */
+        int64_t now = now_ns();
+
+        g_ramp_from = g_ramp_ns ? ramp_value(now) :
+                g_backlight_pending >= 0 ? g_backlight_pending : g_panel.value;
+        g_ramp_to = brightness;
+        g_ramp_start_ns = now;
+        g_ramp_ns = ramp_ms * 1000000LL;
+        g_backlight_pending = -1;
+        pthread_cond_signal(&g_backlight_cond);
+        pthread_mutex_unlock(&g_lock);
+        return 0;
+    }
+
+    /* a plain request ends any fade */
+    g_ramp_ns = 0;
+    if (g_backlight_pending < 0 &&
+            (brightness == g_panel.value ||
+             now_ns() - g_backlight_written_ns >= BACKLIGHT_FRAME_NS)) {
+        /* nothing queued and the last write is a frame old: write now */
+        if (brightness != g_panel.value) {
+            err = write_int(&g_panel, brightness);
+            g_backlight_written_ns = now_ns();
+        }
+    } else {
+        /* within a frame of the last write: leave the latest value to the
+         * writer thread */
+        if (start_backlight_thread() != 0) {
+            err = write_int(&g_panel, brightness);
+            g_backlight_written_ns = now_ns();
+            pthread_mutex_unlock(&g_lock);
+            return err;
+        }
+        g_backlight_pending = brightness;
+        pthread_cond_signal(&g_backlight_cond);
+    }
     pthread_mutex_unlock(&g_lock);
 
     return err;
@@ -111,7 +346,7 @@ static int set_light_buttons(struct light_device_t *dev,
 
     pthread_mutex_lock(&g_lock);
     ALOGV("%s(%d)", __FUNCTION__, brightness);
-    err = write_int(BUTTON_FILE, brightness);
+    err = write_int(&g_buttons, brightness);
     pthread_mutex_unlock(&g_lock);
 
     return err;
@@ -138,10 +373,10 @@ static int set_light_leds_notifications(struct light_device_t *dev,
 
     	if (state->color & 0x00ffffff) {
     		ALOGV("[LED Notify] set_light_leds_notifications - ENABLE_BL\n");
-            	err = write_int (NOTIFICATION_FILE_BLN, ENABLE_BL);
+            	err = write_int (&g_notification, ENABLE_BL);
     	} else {
     		ALOGV("[LED Notify] set_light_leds_notifications - DISABLE_BL\n");
-    		err = write_int (NOTIFICATION_FILE_BLN, DISABLE_BL);
+    		err = write_int (&g_notification, DISABLE_BL);
     	}
         pthread_mutex_unlock(&g_lock);
     }
@@ -18,9 +18,11 @@
 #include <errno.h>
 #include <math.h>
 #include <poll.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/select.h>
+#include <sys/timerfd.h>
 
 //#define LOG_NDEBUG 0
 
@@ -32,97 +34,215 @@
 
 #define TAG "AK8975"
 
+/* 0.3 uT per LSB, before the fuse ROM sensitivity adjustment */
+#define AK8975_RAW_TO_UT        0.3f
+
+/* a single measurement takes 7.3ms max, it is read back on the next tick */
+#define AK8975_MIN_DELAY        10000000LL
+
+/* ST1 / ST2 bits */
+#define AK8975_ST1_DRDY         0x01
+#define AK8975_ST2_DERR         0x04
+#define AK8975_ST2_HOFL         0x08
+
+/*
+ * Hard iron: the offset is the center of the min/max box seen on each
+ * axis. Soft iron: the axes are scaled to the mean half span, which only
+ * handles the axis-aligned part of the distortion. The accuracy follows
+ * how much of the sphere was covered.
+ */
+#define CAL_FILE                "/data/misc/sensors/ak8975_cal"
+#define CAL_SPAN_MEDIUM         40.0f   /* uT min - max on every axis */
+#define CAL_SPAN_HIGH           60.0f
+#define CAL_MAX_FIELD           200.0f  /* reject anything past this, magnets */
+#define CAL_MAX_SPAN            160.0f  /* wider than twice the earth field */
+#define CAL_FIELD_TOLERANCE     0.3f    /* off the converged radius, outlier */
+#define CAL_REJECT_RESET        100     /* outliers in a row: the field moved */
+#define CAL_DECAY_NS            1200000000000LL /* box forgets in 20 minutes */
+
+static const float sRadToDeg = 180.0f / float(M_PI);
+
 /*****************************************************************************/
 
-SensorAK8975::SensorAK8975() : SensorBase("/dev/akm8975_aot", "compass"),
+SensorAK8975::SensorAK8975() : SensorBase(AKM_DEVICE_NAME, NULL),
     mEnabled(0),
-    mHasPendingEvent(false),
     mPendingMask(0),
-    mInputReader(32)
+    mTimerFd(-1),
+    mMeasuring(false),
+    mCalibrationValid(false),
+    mCalibrationTime(0),
+    mRejected(0),
+    mSavedStatus(SENSOR_STATUS_UNRELIABLE),
+    mCalibrationDirty(false),
+    mHaveAccel(false)
 {
     memset(mPendingEvents, 0, sizeof(mPendingEvents));
 
-    mPendingEvents[Accelerometer].version = sizeof(sensors_event_t);
-    mPendingEvents[Accelerometer].sensor = SENSOR_TYPE_ACCELEROMETER;
-    mPendingEvents[Accelerometer].type = SENSOR_TYPE_ACCELEROMETER;
-    mPendingEvents[Accelerometer].acceleration.status = SENSOR_STATUS_ACCURACY_HIGH;
-
     mPendingEvents[MagneticField].version = sizeof(sensors_event_t);
-    mPendingEvents[MagneticField].sensor = SENSOR_TYPE_MAGNETIC_FIELD;
+    mPendingEvents[MagneticField].sensor = ID_M;
     mPendingEvents[MagneticField].type = SENSOR_TYPE_MAGNETIC_FIELD;
-    mPendingEvents[MagneticField].magnetic.status = SENSOR_STATUS_ACCURACY_MEDIUM;
+    mPendingEvents[MagneticField].magnetic.status = SENSOR_STATUS_UNRELIABLE;
 
     mPendingEvents[Orientation].version = sizeof(sensors_event_t);
-    mPendingEvents[Orientation].sensor = SENSOR_TYPE_ORIENTATION;
+    mPendingEvents[Orientation].sensor = ID_O;
     mPendingEvents[Orientation].type = SENSOR_TYPE_ORIENTATION;
-    mPendingEvents[Orientation].orientation.status = SENSOR_STATUS_ACCURACY_HIGH;
-
-    mPendingEvents[Temperature].version = sizeof(sensors_event_t);
-    mPendingEvents[Temperature].sensor = SENSOR_TYPE_AMBIENT_TEMPERATURE;
-    mPendingEvents[Temperature].type = SENSOR_TYPE_AMBIENT_TEMPERATURE;
+    mPendingEvents[Orientation].orientation.status = SENSOR_STATUS_UNRELIABLE;
 
     for (int i = 0 ; i < numSensors; i++) {
         mDelays[i] = AK8975_DEFAULT_DELAY;
     }
+    for (int i = 0 ; i < 3; i++) {
+        mSensitivity[i] = AK8975_RAW_TO_UT;
+        mMin[i] = mMax[i] = 0;
+        mOffset[i] = 0;
+        mScale[i] = 1.0f;
+    }
+
+    mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    ALOGE_IF(mTimerFd < 0, TAG ": couldn't create timerfd (%s)", strerror(errno));
+
+    open_device();
+    if (dev_fd >= 0) {
+        readSensitivity();
+    }
+    loadCalibration();
 }
 
 SensorAK8975::~SensorAK8975()
 {
+    if (mCalibrationDirty) {
+        saveCalibration();
+    }
+    if (mTimerFd >= 0) {
+        close(mTimerFd);
+    }
 }
 
-int SensorAK8975::enable(int32_t handle, int en)
+int SensorAK8975::getFd() const
 {
-    int what;
-    int newState = en ? 1 : 0;
-    int err = 0;
-
+    return mTimerFd;
+}
 
-    switch (handle) {
-        case SENSOR_TYPE_ACCELEROMETER:       what = Accelerometer; break;
-        case SENSOR_TYPE_MAGNETIC_FIELD:      what = MagneticField; break;
-        case SENSOR_TYPE_ORIENTATION:         what = Orientation; break;
-        case SENSOR_TYPE_AMBIENT_TEMPERATURE: what = Temperature; break;
-        default: return -EINVAL;
+/*
+ * ECS_IOCTL_WRITE / ECS_IOCTL_READ take { length, register, data... }
+ */
+int SensorAK8975::writeRegister(int reg, int value)
+{
+    char buf[5];
+    buf[0] = 2;
+    buf[1] = reg;
+    buf[2] = value;
+    if (ioctl(dev_fd, ECS_IOCTL_WRITE, buf) < 0) {
+        return -errno;
     }
+    return 0;
+}
 
-    if ((uint32_t(newState) << what) != (mEnabled & (1 << what))) {
-        if (!mEnabled) {
-            open_device();
-        }
-
-        int cmd;
+int SensorAK8975::readRegisters(int reg, uint8_t* data, int len)
+{
+    char buf[5];
+    if (len < 1 || len > 4) {
+        return -EINVAL;
+    }
+    buf[0] = len;
+    buf[1] = reg;
+    if (ioctl(dev_fd, ECS_IOCTL_READ, buf) < 0) {
+        return -errno;
+    }
+    memcpy(data, &buf[1], len);
+    return 0;
+}
 
-        switch (what)
-        {
-            case Accelerometer: cmd = ECS_IOCTL_APP_SET_AFLAG;  break;
-            case MagneticField: cmd = ECS_IOCTL_APP_SET_MVFLAG; break;
-            case Orientation:   cmd = ECS_IOCTL_APP_SET_MFLAG;  break;
-            case Temperature:   cmd = ECS_IOCTL_APP_SET_TFLAG;  break;
-        }
+/*
+ * Per-axis sensitivity adjustment from the fuse ROM:
+ *   Hadj = H * ((ASA - 128) * 0.5 / 128 + 1)
+ */
+int SensorAK8975::readSensitivity()
+{
+    uint8_t asa[3];
+    int err = writeRegister(AK8975_REG_CNTL, AK8975_MODE_FUSE_ACCESS);
+    if (!err) {
+        err = readRegisters(AK8975_FUSE_ASAX, asa, 3);
+        writeRegister(AK8975_REG_CNTL, AK8975_MODE_POWER_DOWN);
+    }
+    if (err) {
+        ALOGE(TAG ": couldn't read the fuse ROM (%s)", strerror(-err));
+        return err;
+    }
+    for (int i = 0 ; i < 3; i++) {
+        mSensitivity[i] = AK8975_RAW_TO_UT * ((asa[i] - 128) * 0.5f / 128.0f + 1.0f);
+    }
+    ALOGD(TAG ": ASA %d %d %d", asa[0], asa[1], asa[2]);
+    return 0;
+}
 
-        short flags = newState;
+int SensorAK8975::startMeasurement()
+{
+    int err = writeRegister(AK8975_REG_CNTL, AK8975_MODE_SNG_MEASURE);
+    ALOGE_IF(err, TAG ": couldn't start a measurement (%s)", strerror(-err));
+    mMeasuring = !err;
+    return err;
+}
 
-        err = ioctl(dev_fd, cmd, &flags);
-        err = err < 0 ? -errno : 0;
+/*
+ * Fetch the measurement started on the previous tick, in uT and in the
+ * Android coordinate system.
+ */
+int SensorAK8975::readMeasurement(float* m)
+{
+    uint8_t buf[RBUFF_SIZE];
+    mMeasuring = false;
+    if (ioctl(dev_fd, ECS_IOCTL_GETDATA, buf) < 0) {
+        return -errno;
+    }
+    // ST1, HXL, HXH, HYL, HYH, HZL, HZH, ST2
+    if (!(buf[0] & AK8975_ST1_DRDY) || (buf[7] & (AK8975_ST2_DERR | AK8975_ST2_HOFL))) {
+        return -EAGAIN;
+    }
+    int16_t const x = int16_t(buf[1] | (buf[2] << 8));
+    int16_t const y = int16_t(buf[3] | (buf[4] << 8));
+    int16_t const z = int16_t(buf[5] | (buf[6] << 8));
+    m[0] = x * mSensitivity[0] * (AK8975_CONVERT_M_X < 0 ? -1.0f : 1.0f);
+    m[1] = y * mSensitivity[1] * (AK8975_CONVERT_M_Y < 0 ? -1.0f : 1.0f);
+    m[2] = z * mSensitivity[2] * (AK8975_CONVERT_M_Z < 0 ? -1.0f : 1.0f);
+    return 0;
+}
 
-        ALOGE_IF(err, TAG ": ECS_IOCTL_APP_SET_XXX failed (%s)", strerror(-err));
+int SensorAK8975::enable(int32_t handle, int en)
+{
+    int what;
 
-        if (!err) {
-            mEnabled &= ~(1 << what);
-            mEnabled |= (uint32_t(flags) << what);
-            err = updateDelay();
-        }
+    switch (handle) {
+        case ID_M: what = MagneticField; break;
+        case ID_O: what = Orientation; break;
+        default: return -EINVAL;
+    }
 
-        if (!mEnabled) {
-            close_device();
-        }
+    int newState = en ? 1 : 0;
+    if ((uint32_t(newState) << what) == (mEnabled & (1 << what))) {
+        return 0;
+    }
+    if (newState && (dev_fd < 0 || mTimerFd < 0)) {
+        return -ENODEV;
+    }
 
-        if (what == Temperature && newState) {
-            mHasPendingEvent = true;
+    uint32_t previous = mEnabled;
+    mEnabled &= ~(1 << what);
+    mEnabled |= (uint32_t(newState) << what);
+
+    if (!previous && mEnabled) {
+        mMeasuring = false;
+        // no decay for the time spent disabled
+        mCalibrationTime = 0;
+        startMeasurement();
+    } else if (previous && !mEnabled) {
+        mPendingMask = 0;
+        mHaveAccel = false;
+        if (mCalibrationDirty) {
+            saveCalibration();
         }
     }
-
-    return err;
+    return updateDelay();
 }
 
 int SensorAK8975::setDelay(int32_t handle, int64_t ns)
@@ -131,10 +251,8 @@ int SensorAK8975::setDelay(int32_t handle, int64_t ns)
 
     switch (handle)
     {
-        case SENSOR_TYPE_ACCELEROMETER:       what = Accelerometer; break;
-        case SENSOR_TYPE_MAGNETIC_FIELD:      what = MagneticField; break;
-        case SENSOR_TYPE_ORIENTATION:         what = Orientation; break;
-        case SENSOR_TYPE_AMBIENT_TEMPERATURE: what = Temperature; break;
+        case ID_M: what = MagneticField; break;
+        case ID_O: what = Orientation; break;
         default: return -EINVAL;
     }
 
@@ -148,173 +266,265 @@ int SensorAK8975::setDelay(int32_t handle, int64_t ns)
 
 int SensorAK8975::updateDelay()
 {
-    if (mEnabled) {
-        uint64_t wanted = -1LLU;
+    resetTimestamps();
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
 
+    if (mEnabled) {
+        int64_t wanted = 0x7fffffffffffffffLL;
         for (int i = 0 ; i < numSensors; i++) {
-            if (mEnabled & (1 << i)) {
-                uint64_t ns = mDelays[i];
-                wanted = wanted < ns ? wanted : ns;
+            if ((mEnabled & (1 << i)) && mDelays[i] < wanted) {
+                wanted = mDelays[i];
             }
         }
-
-        short delay = int64_t(wanted) / 1000000;
-
-        if (ioctl(dev_fd, ECS_IOCTL_APP_SET_DELAY, &delay) < 0) {
-            return -errno;
+        if (wanted < AK8975_MIN_DELAY) {
+            wanted = AK8975_MIN_DELAY;
         }
+        spec.it_value.tv_sec = wanted / 1000000000LL;
+        spec.it_value.tv_nsec = wanted % 1000000000LL;
+        spec.it_interval = spec.it_value;
     }
 
+    if (timerfd_settime(mTimerFd, 0, &spec, NULL) < 0) {
+        return -errno;
+    }
     return 0;
 }
 
+uint32_t SensorAK8975::inputs() const
+{
+    return (mEnabled & (1 << Orientation)) ? (1 << ID_A) : 0;
+}
+
+void SensorAK8975::processAccel(sensors_event_t const& event)
+{
+    mAccel[0] = event.acceleration.x;
+    mAccel[1] = event.acceleration.y;
+    mAccel[2] = event.acceleration.z;
+    mHaveAccel = true;
+}
+
 bool SensorAK8975::hasPendingEvents() const
 {
-    return mHasPendingEvent;
+    return mPendingMask != 0;
 }
 
-int SensorAK8975::readEvents(sensors_event_t* data, int count)
+void SensorAK8975::calibrate(float const* m, int64_t time)
 {
-    if (count < 1) {
-        return -EINVAL;
+    if (mCalibrationValid && calibrationStatus() >= SENSOR_STATUS_ACCURACY_MEDIUM) {
+        // a converged box predicts the field magnitude: a magnet or a
+        // speaker nearby is kept out of the estimate
+        float radius = 0, field = 0;
+        for (int i = 0 ; i < 3; i++) {
+            float v = (m[i] - mOffset[i]) * mScale[i];
+            field += v * v;
+            radius += (mMax[i] - mMin[i]) * (1.0f / 6.0f);
+        }
+        field = sqrtf(field);
+        if (fabsf(field - radius) > CAL_FIELD_TOLERANCE * radius) {
+            if (++mRejected < CAL_REJECT_RESET) {
+                return;
+            }
+            ALOGD(TAG ": field moved off the calibration, starting over");
+            mCalibrationValid = false;
+        }
     }
+    mRejected = 0;
 
-    if (mHasPendingEvent) {
-        mHasPendingEvent = false;
-        mPendingEvents[Temperature].timestamp = getTimestamp();
-        *data = mPendingEvents[Temperature];
-        return 1;
+    if (!mCalibrationValid) {
+        for (int i = 0 ; i < 3; i++) {
+            mMin[i] = mMax[i] = m[i];
+        }
+        mCalibrationValid = true;
+    } else {
+        // extremes that are not seen again fade out, so a transient
+        // let in before convergence does not stay for good
+        float decay = 0;
+        if (mCalibrationTime) {
+            decay = float(time - mCalibrationTime) / CAL_DECAY_NS;
+            if (decay > 1.0f)
+                decay = 1.0f;
+        }
+        for (int i = 0 ; i < 3; i++) {
+            if (m[i] < mMin[i])
+                mMin[i] = m[i];
+            if (m[i] > mMax[i])
+                mMax[i] = m[i];
+            mMin[i] += (m[i] - mMin[i]) * decay;
+            mMax[i] += (m[i] - mMax[i]) * decay;
+        }
     }
+    mCalibrationTime = time;
+    mCalibrationDirty = true;
+    updateOffsets();
+
+    int status = calibrationStatus();
+    if (status > mSavedStatus) {
+        // save as soon as the calibration gets better
+        saveCalibration();
+    }
+}
 
-    ssize_t n = mInputReader.fill(data_fd);
-    if (n < 0) {
-        return n;
+void SensorAK8975::updateOffsets()
+{
+    float radius = 0;
+    for (int i = 0 ; i < 3; i++) {
+        mOffset[i] = (mMax[i] + mMin[i]) * 0.5f;
+        radius += (mMax[i] - mMin[i]) * (1.0f / 6.0f);
+    }
+    for (int i = 0 ; i < 3; i++) {
+        float half = (mMax[i] - mMin[i]) * 0.5f;
+        mScale[i] = half > 1.0f ? radius / half : 1.0f;
     }
+}
 
-    int numEventReceived = 0;
-    input_event const* event;
-
-    while (count && mInputReader.readEvent(&event)) {
-        if (event->type == EV_ABS) {
-            processEvent(event->code, event->value);
-            mInputReader.next();
-        } else if (event->type == EV_SYN) {
-            int64_t time = timevalToNano(event->time);
-            for (int j = 0 ; count && mPendingMask && j < numSensors ; j++) {
-                if (mPendingMask & (1 << j)) {
-                    mPendingMask &= ~(1 << j);
-                    mPendingEvents[j].timestamp = time;
-                    if (mEnabled & (1 << j)) {
-                        *data++ = mPendingEvents[j];
-                        count--;
-                        numEventReceived++;
-                    }
-                }
-            }
-            if (!mPendingMask) {
-                mInputReader.next();
-            }
-        } else {
-            ALOGE(TAG ": unknown event (type=0x%x, code=0x%x, value=0x%x)",
-                event->type, event->code, event->value);
-            mInputReader.next();
-        }
+int SensorAK8975::calibrationStatus() const
+{
+    if (!mCalibrationValid)
+        return SENSOR_STATUS_UNRELIABLE;
+    float span = mMax[0] - mMin[0];
+    float widest = span;
+    for (int i = 1 ; i < 3; i++) {
+        if (mMax[i] - mMin[i] < span)
+            span = mMax[i] - mMin[i];
+        if (mMax[i] - mMin[i] > widest)
+            widest = mMax[i] - mMin[i];
     }
+    if (widest > CAL_MAX_SPAN)
+        return SENSOR_STATUS_ACCURACY_LOW;  // holds a transient, decaying
+    if (span >= CAL_SPAN_HIGH)
+        return SENSOR_STATUS_ACCURACY_HIGH;
+    if (span >= CAL_SPAN_MEDIUM)
+        return SENSOR_STATUS_ACCURACY_MEDIUM;
+    if (span > 0)
+        return SENSOR_STATUS_ACCURACY_LOW;
+    return SENSOR_STATUS_UNRELIABLE;
+}
 
-    return numEventReceived;
+void SensorAK8975::loadCalibration()
+{
+    FILE* fp = fopen(CAL_FILE, "r");
+    if (fp == NULL) {
+        return;
+    }
+    float m[6];
+    int nr = fscanf(fp, "%f %f %f %f %f %f",
+            &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]);
+    fclose(fp);
+    if (nr != 6) {
+        ALOGW(TAG ": ignoring bad calibration file " CAL_FILE);
+        return;
+    }
+    for (int i = 0 ; i < 3; i++) {
+        mMin[i] = m[i];
+        mMax[i] = m[i + 3];
+    }
+    mCalibrationValid = true;
+    mSavedStatus = calibrationStatus();
+    updateOffsets();
+    ALOGD(TAG ": calibration loaded, status %d", mSavedStatus);
 }
 
-/**
- *
- * Sensors data conversion
- *
- * Please read:
- *   http://developer.android.com/reference/android/hardware/SensorEvent.html
- *
+void SensorAK8975::saveCalibration()
+{
+    if (calibrationStatus() < SENSOR_STATUS_ACCURACY_MEDIUM) {
+        // only a converged box is worth keeping across boots
+        return;
+    }
+    FILE* fp = fopen(CAL_FILE ".tmp", "w");
+    if (fp == NULL) {
+        ALOGE(TAG ": couldn't save the calibration (%s)", strerror(errno));
+        return;
+    }
+    fprintf(fp, "%f %f %f %f %f %f\n",
+            mMin[0], mMin[1], mMin[2], mMax[0], mMax[1], mMax[2]);
+    fclose(fp);
+    if (rename(CAL_FILE ".tmp", CAL_FILE) < 0) {
+        ALOGE(TAG ": couldn't save the calibration (%s)", strerror(errno));
+        return;
+    }
+    mSavedStatus = calibrationStatus();
+    mCalibrationDirty = false;
+}
+
+/*
+ * Legacy orientation from gravity and the calibrated field:
+ *   azimuth 0..360, 0 = North, 90 = East
+ *   pitch -180..180, positive when the z axis moves toward the y axis
+ *   roll -90..90, positive when the x axis moves toward the z axis
  */
-void SensorAK8975::processEvent(int code, int value)
+void SensorAK8975::computeOrientation(int64_t time)
 {
-    int status;
-    double converted;
+    float const* m = mPendingEvents[MagneticField].data;
+    float A[3] = { mAccel[0], mAccel[1], mAccel[2] };
+    float const g = sqrtf(A[0]*A[0] + A[1]*A[1] + A[2]*A[2]);
+    if (g < 0.1f * GRAVITY_EARTH)
+        return;     // free fall
+    A[0] /= g; A[1] /= g; A[2] /= g;
+
+    // East = m x Up, North = Up x East
+    float H[3] = { m[1]*A[2] - m[2]*A[1], m[2]*A[0] - m[0]*A[2], m[0]*A[1] - m[1]*A[0] };
+    float const h = sqrtf(H[0]*H[0] + H[1]*H[1] + H[2]*H[2]);
+    if (h < 0.1f)
+        return;
+    H[0] /= h; H[1] /= h; H[2] /= h;
+    float const M1 = A[2]*H[0] - A[0]*H[2];
+
+    float azimuth = atan2f(H[1], M1) * sRadToDeg;
+    if (azimuth < 0)
+        azimuth += 360.0f;
+    float roll = asinf(A[0] > 1.0f ? 1.0f : (A[0] < -1.0f ? -1.0f : A[0])) * sRadToDeg;
+
+    sensors_event_t& o(mPendingEvents[Orientation]);
+    o.orientation.azimuth = azimuth;
+    o.orientation.pitch = atan2f(-A[1], A[2]) * sRadToDeg;
+    o.orientation.roll = roll;
+    o.orientation.status = mPendingEvents[MagneticField].magnetic.status;
+    o.timestamp = time;
+    mPendingMask |= 1 << Orientation;
+}
 
-    switch (code)
-    {
-        case ABS_X:
-            mPendingMask |= 1 << Accelerometer;
-            mPendingEvents[Accelerometer].acceleration.x = value * AK8975_CONVERT_A_X;
-            ALOGV(TAG ": acceleration X event value=0x%x (%.1f)", value, (value * AK8975_CONVERT_A_X));
-            break;
-        case ABS_Y:
-            mPendingMask |= 1 << Accelerometer;
-            mPendingEvents[Accelerometer].acceleration.y = value * AK8975_CONVERT_A_Y;
-            ALOGV(TAG ": acceleration Y event value=0x%x (%.1f)", value, (value * AK8975_CONVERT_A_Y));
-            break;
-        case ABS_Z:
-            mPendingMask |= 1 << Accelerometer;
-            mPendingEvents[Accelerometer].acceleration.z = value * AK8975_CONVERT_A_Z;
-            ALOGV(TAG ": acceleration Z event value=0x%x (%.1f)", value, (value * AK8975_CONVERT_A_Z));
-            break;
-        case ABS_WHEEL:
-            mPendingMask |= 1 << Accelerometer;
-            status = value & AK8975_SENSOR_STATE_MASK;
-            ALOGV(TAG ": acceleration WHEEL (value=0x%x)", value);
-            mPendingEvents[Accelerometer].acceleration.status = uint8_t(status);
-            break;
-
-
-        case ABS_HAT0X:
-            mPendingMask |= 1 << MagneticField;
-            mPendingEvents[MagneticField].magnetic.x = value * AK8975_CONVERT_M_X;
-            break;
-        case ABS_HAT0Y:
-            mPendingMask |= 1 << MagneticField;
-            mPendingEvents[MagneticField].magnetic.y = value * AK8975_CONVERT_M_Y;
-            break;
-        case ABS_BRAKE:
+int SensorAK8975::readEvents(sensors_event_t* data, int count)
+{
+    if (count < 1) {
+        return -EINVAL;
+    }
+
+    uint64_t expirations;
+    if (read(mTimerFd, &expirations, sizeof(expirations)) == sizeof(expirations) && mEnabled) {
+        float raw[3];
+        int err = mMeasuring ? readMeasurement(raw) : -EAGAIN;
+        startMeasurement();
+
+        if (!err && fabsf(raw[0]) < CAL_MAX_FIELD && fabsf(raw[1]) < CAL_MAX_FIELD &&
+                fabsf(raw[2]) < CAL_MAX_FIELD) {
+            int64_t const time = sampleTimestamp();
+            calibrate(raw, time);
+            sensors_event_t& mag(mPendingEvents[MagneticField]);
+            mag.magnetic.x = (raw[0] - mOffset[0]) * mScale[0];
+            mag.magnetic.y = (raw[1] - mOffset[1]) * mScale[1];
+            mag.magnetic.z = (raw[2] - mOffset[2]) * mScale[2];
+            mag.magnetic.status = calibrationStatus();
+            mag.timestamp = time;
             mPendingMask |= 1 << MagneticField;
-            mPendingEvents[MagneticField].magnetic.z = value * AK8975_CONVERT_M_Z;
-            break;
-
-
-        case ABS_RX:
-            mPendingMask |= 1 << Orientation;
-            // 0 to 359°:  0=North, 90=East, 180=South, 270=West (like a compass)
-            converted = value * AK8975_CONVERT_O_A; //0 to 0x59FF -> x/64
-            if (converted > 359.98f) converted = 0;
-            mPendingEvents[Orientation].orientation.azimuth = converted;
-            ALOGV(TAG ": orientation X event value=0x%x (%.1f)", value, converted);;
-            break;
-        case ABS_RY:
-            mPendingMask |= 1 << Orientation;
-            // -180 to 180°: lcd on upside or downside (0° on a flat table)
-            converted = value * AK8975_CONVERT_O_P;
-            mPendingEvents[Orientation].orientation.pitch = converted;
-            ALOGV(TAG ": orientation Y event value=0x%x (%.1f)", value, converted);
-            break;
-        case ABS_RZ:
-            mPendingMask |= 1 << Orientation;
-            // -90 to 90°: rotation used for screen rotate, should be -90 on landscape
-            converted = value * AK8975_CONVERT_O_R;
-            if (converted > 90.0f) converted  = 90.0f;
-            if (converted < -90.0f) converted = -90.0f;
-            mPendingEvents[Orientation].orientation.roll = converted;
-            ALOGV(TAG ": orientation Z event value=0x%x (%.1f)", value, converted);
-            break;
-        case ABS_RUDDER:
-            mPendingMask |= 1 << Orientation;
-            // seems always 3 (SENSOR_STATUS_ACCURACY_HIGH)
-            status = value & AK8975_SENSOR_STATE_MASK;
-            ALOGV(TAG ": orientation RUDDER (value=0x%x)", value);
-            mPendingEvents[Orientation].orientation.status = uint8_t(status);
-            break;
-
-        case ABS_THROTTLE:
-            mPendingMask |= 1 << Temperature;
-            mPendingEvents[Temperature].temperature = value;
-            break;
-
-        default:
-            ALOGE(TAG ": unknown event (code=0x%x, value=0x%x)", code, value);
-            break;
+            if ((mEnabled & (1 << Orientation)) && mHaveAccel) {
+                computeOrientation(time);
+            }
+        }
+    }
+
+    int numEventReceived = 0;
+    for (int j = 0 ; count && mPendingMask && j < numSensors ; j++) {
+        if (mPendingMask & (1 << j)) {
+            mPendingMask &= ~(1 << j);
+            if (mEnabled & (1 << j)) {
+                *data++ = mPendingEvents[j];
+                count--;
+                numEventReceived++;
+            }
+        }
     }
+
+    return numEventReceived;
 }
@@ -13,9 +13,9 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
- 
-#ifndef ANDROID_AKM_SENSOR_H
-#define ANDROID_AKM_SENSOR_H
+
+#ifndef ANDROID_AK8975_SENSOR_H
+#define ANDROID_AK8975_SENSOR_H
 
 #include <stdint.h>
 #include <errno.h>
@@ -25,12 +25,16 @@
 
 #include "sensors.h"
 #include "SensorBase.h"
-#include "InputEventReader.h"
 
 /*****************************************************************************/
 
-struct input_event;
-
+/*
+ * Native AK8975 driver, used instead of AkmSensor + libakm.so when
+ * hw.sensor.libakm.disable is set. Single measurements are triggered from
+ * a timerfd straight through /dev/akm8975, calibrated in process, and
+ * combined with the accelerometer (fed by the poll context) into a tilt
+ * compensated orientation.
+ */
 class SensorAK8975 : public SensorBase
 {
 public:
@@ -39,30 +43,60 @@ public:
 
     enum
     {
-        Accelerometer   = 0,
-        MagneticField   = 1,
-        Orientation     = 2,
-        Temperature     = 3,
+        MagneticField   = 0,
+        Orientation     = 1,
         numSensors
     };
 
     virtual int setDelay(int32_t handle, int64_t ns);
     virtual int enable(int32_t handle, int enabled);
     virtual bool hasPendingEvents() const;
+    virtual int getFd() const;
     virtual int readEvents(sensors_event_t* data, int count);
-    void processEvent(int code, int value);
+
+    void processAccel(sensors_event_t const& event);
+    // (1<<ID_x) mask of the other sensors this one needs running
+    uint32_t inputs() const;
 
 private:
+    int writeRegister(int reg, int value);
+    int readRegisters(int reg, uint8_t* data, int len);
+    int readSensitivity();
+    int startMeasurement();
+    int readMeasurement(float* m);
     int updateDelay();
 
+    void calibrate(float const* m, int64_t time);
+    void updateOffsets();
+    int calibrationStatus() const;
+    void loadCalibration();
+    void saveCalibration();
+    void computeOrientation(int64_t time);
+
     uint32_t mEnabled;
-    bool mHasPendingEvent;
     uint32_t mPendingMask;
-    InputEventCircularReader mInputReader;
     sensors_event_t mPendingEvents[numSensors];
-    uint64_t mDelays[numSensors];
+    int64_t mDelays[numSensors];
+    int mTimerFd;
+    bool mMeasuring;
+
+    float mSensitivity[3];
+    // hard iron box: valid once it holds a sample, shrinks back over
+    // CAL_DECAY_NS from mCalibrationTime
+    bool mCalibrationValid;
+    float mMin[3];
+    float mMax[3];
+    float mOffset[3];
+    float mScale[3];
+    int64_t mCalibrationTime;
+    int mRejected;
+    int mSavedStatus;
+    bool mCalibrationDirty;
+
+    float mAccel[3];
+    bool mHaveAccel;
 };
 
 /*****************************************************************************/
 
-#endif  // ANDROID_AKM_SENSOR_H
+#endif  // ANDROID_AK8975_SENSOR_H
@@ -32,6 +32,10 @@
 
 #define TAG "[AKM] "
 
+/* up to 10 axes (accel, orientation + status, magnetic) and SYN per
+ * report, room for 4 reports */
+#define INPUT_READER_SIZE (11 * 4)
+
 /*****************************************************************************/
 
 int (*akm_is_sensor_enabled)(uint32_t sensor_type);
@@ -55,7 +59,7 @@ AkmSensor::AkmSensor()
 : SensorBase(NULL, NULL),
       mEnabled(0),
       mPendingMask(0),
-      mInputReader(32)
+      mInputReader(INPUT_READER_SIZE)
 {
     char prop[PROPERTY_VALUE_MAX];
     bool loadlibakm = true;
@@ -182,6 +186,7 @@ int AkmSensor::enable(int32_t handle, int en)
 
         ALOGE_IF(err, TAG "Could not change sensor state (%s)", strerror(-err));
         if (!err) {
+            resetTimestamps();
             mEnabled &= ~(1<<what);
             mEnabled |= (uint32_t(flags)<<what);
         }
@@ -240,33 +245,37 @@ int AkmSensor::readEvents(sensors_event_t* data, int count)
 
     int numEventReceived = 0;
     input_event const* event;
-
-    while (count && mInputReader.readEvent(&event)) {
-        int type = event->type;
-        if (type == EV_REL) {
-            processEvent(event->code, event->value);
-            mInputReader.next();
-        } else if (type == EV_SYN) {
-            int64_t time = timevalToNano(event->time);
-            for (int j=0 ; count && mPendingMask && j<numSensors ; j++) {
-                if (mPendingMask & (1<<j)) {
-                    mPendingMask &= ~(1<<j);
-                    mPendingEvents[j].timestamp = time;
-                    if (mEnabled & (1<<j)) {
-                        *data++ = mPendingEvents[j];
-                        count--;
-                        numEventReceived++;
+    ssize_t avail;
+
+    while (count && (avail = mInputReader.readEvents(&event)) > 0) {
+        ssize_t i;
+        for (i=0 ; count && i<avail ; i++, event++) {
+            int type = event->type;
+            if (type == EV_REL) {
+                processEvent(event->code, event->value);
+            } else if (type == EV_SYN) {
+                int64_t time = eventTimestamp(event->time);
+                for (int j=0 ; count && mPendingMask && j<numSensors ; j++) {
+                    if (mPendingMask & (1<<j)) {
+                        mPendingMask &= ~(1<<j);
+                        mPendingEvents[j].timestamp = time;
+                        if (mEnabled & (1<<j)) {
+                            *data++ = mPendingEvents[j];
+                            count--;
+                            numEventReceived++;
+                        }
                     }
                 }
+                if (mPendingMask) {
+                    // out of room, keep the SYN for the next call
+                    break;
+                }
+            } else {
+                ALOGE(TAG "unknown event (type=%d, code=%d)",
+                        type, event->code);
             }
-            if (!mPendingMask) {
-                mInputReader.next();
-            }
-        } else {
-            ALOGE(TAG "unknown event (type=%d, code=%d)",
-                    type, event->code);
-            mInputReader.next();
         }
+        mInputReader.next(i);
     }
     return numEventReceived;
 }
@@ -17,36 +17,52 @@ LOCAL_PATH := $(call my-dir)
 
 ifneq ($(TARGET_SIMULATOR),true)
 
-# HAL module implemenation, not prelinked, and stored in
-# hw/<SENSORS_HARDWARE_MODULE_ID>.<ro.product.board>.so
-include $(CLEAR_VARS)
-
-LOCAL_MODULE := sensors.$(TARGET_BOOTLOADER_BOARD_NAME)
-
-LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
-
-LOCAL_MODULE_TAGS := optional
-
-LOCAL_CFLAGS := -DLOG_TAG=\"Sensors\"
-LOCAL_SRC_FILES := \
+sensors_src_files := \
 	sensors.cpp \
 	SensorBase.cpp \
 	InputEventReader.cpp \
+	BatchBuffer.cpp \
+	SensorEventQueue.cpp \
+	SensorFusion.cpp \
 	LightSensor.cpp \
 	ProximitySensor.cpp \
 	KXTFSensor.cpp \
 
-LOCAL_SRC_FILES += \
+sensors_src_files += \
 	GyroSensor.cpp \
 	AkmSensor.cpp \
 	NctSensor.cpp \
+	AK8975Sensor.cpp \
 
-#	AK8975Sensor.cpp \
+# HAL module implemenation, not prelinked, and stored in
+# hw/<SENSORS_HARDWARE_MODULE_ID>.<ro.product.board>.so
+include $(CLEAR_VARS)
 
+LOCAL_MODULE := sensors.$(TARGET_BOOTLOADER_BOARD_NAME)
 
-LOCAL_SHARED_LIBRARIES := liblog libcutils libdl
+LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
+
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_CFLAGS := -DLOG_TAG=\"Sensors\"
+LOCAL_SRC_FILES := $(sensors_src_files)
+
+LOCAL_SHARED_LIBRARIES := liblog libcutils libutils libdl
 LOCAL_PRELINK_MODULE := false
 
 include $(BUILD_SHARED_LIBRARY)
 
+# sensors_bench: the HAL linked into a standalone benchmark, see sensors_bench.cpp
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := sensors_bench
+
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := $(sensors_src_files) sensors_bench.cpp
+
+LOCAL_SHARED_LIBRARIES := liblog libcutils libutils libdl
+
+include $(BUILD_EXECUTABLE)
+
 endif # !TARGET_SIMULATOR
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include <hardware/sensors.h>
+
+#include "BatchBuffer.h"
+
+/*****************************************************************************/
+
+BatchBuffer::BatchBuffer(size_t numEvents)
+    : mBuffer(new sensors_event_t[numEvents]),
+      mSize(numEvents),
+      mHead(0),
+      mCount(0),
+      mLatency(0),
+      mDeadline(0)
+{
+}
+
+BatchBuffer::~BatchBuffer()
+{
+    delete [] mBuffer;
+}
+
+bool BatchBuffer::push(sensors_event_t const& event, int64_t now)
+{
+    bool overrun = false;
+    if (mCount == mSize) {
+        // drop the oldest sample, the caller drains before this happens
+        mHead = (mHead + 1) % mSize;
+        mCount--;
+        overrun = true;
+    }
+    if (mCount == 0) {
+        mDeadline = now + mLatency;
+    }
+    mBuffer[(mHead + mCount) % mSize] = event;
+    mCount++;
+    return !overrun;
+}
+
+size_t BatchBuffer::drain(sensors_event_t* data, size_t count)
+{
+    size_t n = count < mCount ? count : mCount;
+    size_t first = mSize - mHead;
+    if (first > n)
+        first = n;
+    memcpy(data, mBuffer + mHead, first * sizeof(sensors_event_t));
+    memcpy(data + first, mBuffer, (n - first) * sizeof(sensors_event_t));
+    mHead = (mHead + n) % mSize;
+    mCount -= n;
+    return n;
+}
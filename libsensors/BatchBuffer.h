@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_BATCH_BUFFER_H
+#define ANDROID_BATCH_BUFFER_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+/*****************************************************************************/
+
+struct sensors_event_t;
+
+/*
+ * Software FIFO holding the samples of one sensor until its max report
+ * latency expires. The deadline is taken from the arrival time of the
+ * oldest queued sample (CLOCK_MONOTONIC), not from the event timestamp.
+ */
+class BatchBuffer
+{
+    sensors_event_t* const mBuffer;
+    const size_t mSize;
+    size_t mHead;
+    size_t mCount;
+    int64_t mLatency;
+    int64_t mDeadline;
+
+public:
+    BatchBuffer(size_t numEvents);
+    ~BatchBuffer();
+
+    void setLatency(int64_t ns) { mLatency = ns; }
+    int64_t latency() const { return mLatency; }
+
+    bool empty() const { return mCount == 0; }
+    bool full() const { return mCount == mSize; }
+    int64_t deadline() const { return mCount ? mDeadline : -1; }
+
+    // returns false if the buffer was full, the oldest sample is dropped
+    bool push(sensors_event_t const& event, int64_t now);
+    size_t drain(sensors_event_t* data, size_t count);
+};
+
+/*****************************************************************************/
+
+#endif  // ANDROID_BATCH_BUFFER_H
@@ -23,7 +23,9 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/select.h>
+#include <sys/timerfd.h>
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 #include "GyroSensor.h"
 
@@ -34,22 +36,86 @@
 
 #define TAG "[MPU] "
 
+/* X, Y, Z and SYN per sample, room for 8 samples */
+#define INPUT_READER_SIZE (4 * 8)
+
+/*
+ * FIFO burst mode (GYRO_FIFO_PROPERTY): the gyro samples go to the MPU3050
+ * FIFO at the output data rate programmed in SMPLRT_DIV, and a timerfd
+ * wakes us up to read them in one I2C burst through /dev/mpu every
+ * GYRO_FIFO_BURST_PROPERTY ms, or sooner so that the FIFO stays below
+ * half full. The input events of the driver are not used in this mode.
+ */
+#define GYRO_FIFO_PROPERTY          "hw.sensor.gyro.fifo"
+#define GYRO_FIFO_BURST_PROPERTY    "hw.sensor.gyro.fifo_ms"
+#define GYRO_FIFO_BURST_DEFAULT     "200"
+#define GYRO_FIFO_BURST_SAMPLES     (GYRO_FIFO_MAX_SAMPLES / 2)
+/* every burst read leaves a 2 byte footer in the FIFO, it comes out first
+ * on the next read */
+#define GYRO_FIFO_FOOTER            2
+/* internal sample rate with the 42Hz low pass filter */
+#define GYRO_INTERNAL_RATE_NS       1000000LL
+/* the measured sample period is trusted within 5% of the programmed one,
+ * once enough samples went by to average the read jitter out */
+#define GYRO_ODR_TOLERANCE          20
+#define GYRO_ODR_MIN_SAMPLES        50
+/* the driver polls its registers for the input events, slow it down */
+#define GYRO_FIFO_INPUT_DELAY_MS    1000
+/* the FIFO holds raw register counts, not the scaled values of the input
+ * events: 16.4 LSB per dps at the +/-2000 dps (RANGE_GYRO) programmed in
+ * startFifo() */
+#define GYRO_FIFO_FS                BITS_FS_2000DPS
+
 /*****************************************************************************/
 
 GyroSensor::GyroSensor()
     : SensorBase("/dev/mpu", "mpu-accel"),
       mEnabled(0),
-      mInputReader(6),
+      mInputReader(INPUT_READER_SIZE),
       mHasPendingEvent(false),
       mEnabledTime(0),
       mDelay_ns(IGNORE_EVENT_TIME),
-      mInitialTestDone(false)
+      mInitialTestDone(false),
+      mFifoMode(false),
+      mTimerFd(-1),
+      mOdrNs(0),
+      mFifoScale(0),
+      mPeriodNs(0),
+      mAnchorNs(0),
+      mFifoSamples(0),
+      mLastTimestamp(0),
+      mBurstNs(0),
+      mFifoFooter(false),
+      mFifoHead(0),
+      mFifoQueued(0)
 {
     mPendingEvent.version = sizeof(sensors_event_t);
     mPendingEvent.sensor = ID_GY;
     mPendingEvent.type = SENSOR_TYPE_GYROSCOPE;
     memset(mPendingEvent.data, 0, sizeof(mPendingEvent.data));
 
+    char value[PROPERTY_VALUE_MAX];
+    property_get(GYRO_FIFO_PROPERTY, value, "0");
+    if (atoi(value)) {
+        unsigned char id;
+        open_device();
+        mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (dev_fd >= 0 && mTimerFd >= 0 &&
+                !mpuRead(MPUREG_WHO_AM_I, &id, 1)) {
+            property_get(GYRO_FIFO_BURST_PROPERTY, value, GYRO_FIFO_BURST_DEFAULT);
+            mBurstNs = atoi(value) * 1000000LL;
+            mFifoMode = true;
+            ALOGI(TAG "FIFO burst mode, device id 0x%02x", id);
+        } else {
+            ALOGW(TAG "FIFO burst mode unavailable, using the input events");
+            close_device();
+            if (mTimerFd >= 0) {
+                close(mTimerFd);
+                mTimerFd = -1;
+            }
+        }
+    }
+
     if (data_fd) {
         strcpy(input_sysfs_path, "/sys/class/input/");
         strcat(input_sysfs_path, input_name);
@@ -63,6 +129,182 @@ GyroSensor::~GyroSensor() {
     if (mEnabled) {
         enable(0, 0);
     }
+    if (mTimerFd >= 0) {
+        close(mTimerFd);
+    }
+}
+
+int GyroSensor::getFd() const {
+    return mFifoMode ? mTimerFd : SensorBase::getFd();
+}
+
+int GyroSensor::mpuRead(int reg, unsigned char* buf, int len)
+{
+    struct mpu_read_write msg;
+    msg.address = reg;
+    msg.length = len;
+    msg.data = buf;
+    if (ioctl(dev_fd, MPU_READ_REGISTER, &msg) < 0) {
+        int err = errno;
+        ALOGE(TAG "read of register 0x%02x failed (%s)", reg, strerror(err));
+        return -err;
+    }
+    return 0;
+}
+
+int GyroSensor::mpuWrite(int reg, unsigned char value)
+{
+    // the driver sends the buffer as is: register address first
+    unsigned char buf[2] = { (unsigned char)reg, value };
+    struct mpu_read_write msg;
+    msg.address = reg;
+    msg.length = sizeof(buf);
+    msg.data = buf;
+    if (ioctl(dev_fd, MPU_WRITE_REGISTER, &msg) < 0) {
+        int err = errno;
+        ALOGE(TAG "write of register 0x%02x failed (%s)", reg, strerror(err));
+        return -err;
+    }
+    return 0;
+}
+
+/*
+ * Program the output data rate from mDelay_ns, send the gyro axes to the
+ * FIFO and reset it. The sample timestamps count from the reset.
+ */
+int GyroSensor::startFifo()
+{
+    unsigned char dlpf, ctrl;
+    if (mpuRead(MPUREG_DLPF_FS_SYNC, &dlpf, 1) || mpuRead(MPUREG_USER_CTRL, &ctrl, 1))
+        return -EIO;
+
+    int64_t divider = mDelay_ns / GYRO_INTERNAL_RATE_NS - 1;
+    if (divider < 0)
+        divider = 0;
+    if (divider > 255)
+        divider = 255;
+    mOdrNs = (divider + 1) * GYRO_INTERNAL_RATE_NS;
+
+    dlpf = GYRO_FIFO_FS | BITS_EXT_SYNC_NONE | BITS_DLPF_CFG_42HZ;
+    ctrl = (ctrl & ~(BIT_DMP_EN | BIT_FIFO_EN)) | BIT_FIFO_RST;
+    if (mpuWrite(MPUREG_SMPLRT_DIV, divider) ||
+            mpuWrite(MPUREG_DLPF_FS_SYNC, dlpf) ||
+            mpuWrite(MPUREG_FIFO_EN1, BIT_GYRO_XOUT | BIT_GYRO_YOUT | BIT_GYRO_ZOUT) ||
+            mpuWrite(MPUREG_FIFO_EN2, 0) ||
+            mpuWrite(MPUREG_USER_CTRL, ctrl) ||
+            mpuWrite(MPUREG_USER_CTRL, (ctrl & ~BIT_FIFO_RST) | BIT_FIFO_EN)) {
+        return -EIO;
+    }
+
+    // LSB per dps for FS_SEL 250, 500, 1000 and 2000 dps
+    static const float lsbPerDps[4] = { 131.0f, 65.5f, 32.8f, 16.4f };
+    mFifoScale = ((float)M_PI / 180.0f) / lsbPerDps[(dlpf & BITS_FS_MASK) >> 3];
+
+    mAnchorNs = getTimestamp();
+    mPeriodNs = mOdrNs;
+    mFifoSamples = 0;
+    mFifoFooter = false;
+    mFifoQueued = 0;
+    ALOGV(TAG "FIFO started, %lld us per sample, %f rad/s per LSB",
+            mOdrNs / 1000, mFifoScale);
+    return armTimer();
+}
+
+void GyroSensor::stopFifo()
+{
+    unsigned char ctrl;
+    if (!mpuRead(MPUREG_USER_CTRL, &ctrl, 1)) {
+        mpuWrite(MPUREG_USER_CTRL, ctrl & ~BIT_FIFO_EN);
+    }
+    mpuWrite(MPUREG_FIFO_EN1, 0);
+    mFifoQueued = 0;
+    armTimer();
+}
+
+int GyroSensor::armTimer()
+{
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (mEnabled) {
+        int64_t ns = mOdrNs * GYRO_FIFO_BURST_SAMPLES;
+        if (mBurstNs > 0 && mBurstNs < ns)
+            ns = mBurstNs;
+        if (ns < mOdrNs)
+            ns = mOdrNs;
+        spec.it_value.tv_sec = ns / 1000000000LL;
+        spec.it_value.tv_nsec = ns % 1000000000LL;
+        spec.it_interval = spec.it_value;
+    }
+    if (timerfd_settime(mTimerFd, 0, &spec, NULL) < 0) {
+        int err = errno;
+        ALOGE(TAG "%s: timerfd_settime failed (%s)", __FUNCTION__, strerror(err));
+        return -err;
+    }
+    return 0;
+}
+
+/*
+ * Read the FIFO in one burst and queue its samples. The newest sample was
+ * taken less than a period before the FIFO count was read, so the period
+ * is measured as the time since the reset over the samples counted since:
+ * the error is below one period over the whole run. Sample k after the
+ * reset is stamped mAnchorNs + k * mPeriodNs.
+ */
+int GyroSensor::readFifo()
+{
+    unsigned char buf[GYRO_FIFO_FOOTER + GYRO_FIFO_MAX_SAMPLES * GYRO_FIFO_PACKET];
+    unsigned char cnt[2];
+
+    if (mpuRead(MPUREG_FIFO_COUNTH, cnt, sizeof(cnt)))
+        return -EIO;
+    int64_t const now = getTimestamp();
+    int count = ((cnt[0] & 0x03) << 8) | cnt[1];
+
+    if (count >= FIFO_HW_SIZE - GYRO_FIFO_PACKET) {
+        ALOGW(TAG "FIFO overflow, %d samples lost", count / GYRO_FIFO_PACKET);
+        return startFifo();
+    }
+
+    int const footer = mFifoFooter ? GYRO_FIFO_FOOTER : 0;
+    int n = (count - footer) / GYRO_FIFO_PACKET;
+    if (n <= 0)
+        return 0;
+    if (mpuRead(MPUREG_FIFO_R_W, buf, footer + n * GYRO_FIFO_PACKET))
+        return -EIO;
+    mFifoFooter = true;
+
+    mFifoSamples += n;
+    if (mFifoSamples >= GYRO_ODR_MIN_SAMPLES) {
+        int64_t period = (now - mAnchorNs) / mFifoSamples;
+        int64_t const tolerance = mOdrNs / GYRO_ODR_TOLERANCE;
+        if (period < mOdrNs - tolerance)
+            period = mOdrNs - tolerance;
+        if (period > mOdrNs + tolerance)
+            period = mOdrNs + tolerance;
+        mPeriodNs = period;
+    }
+
+    unsigned char const* p = buf + footer;
+    for (int i=0 ; i<n ; i++, p += GYRO_FIFO_PACKET) {
+        int64_t ts = mAnchorNs + (mFifoSamples - n + i + 1) * mPeriodNs;
+        if (ts > now)
+            ts = now;
+        if (ts <= mLastTimestamp)
+            ts = mLastTimestamp + 1;
+        mLastTimestamp = ts;
+        if (ts < mEnabledTime)
+            continue;   // still settling after enable
+
+        sensors_event_t& ev(mFifoEvents[(mFifoHead + mFifoQueued) % GYRO_FIFO_MAX_SAMPLES]);
+        ev = mPendingEvent;
+        ev.timestamp = ts;
+        // same axis signs as CONVERT_GYRO_* on the input events
+        ev.data[0] = int16_t((p[0] << 8) | p[1]) * mFifoScale;
+        ev.data[1] = int16_t((p[2] << 8) | p[3]) * -mFifoScale;
+        ev.data[2] = int16_t((p[4] << 8) | p[5]) * mFifoScale;
+        mFifoQueued++;
+    }
+    return 0;
 }
 
 int GyroSensor::setInitialState() {
@@ -185,6 +427,7 @@ int GyroSensor::enable(int32_t, int en)
 //              sec_power(flags);
                 buf[0] = '1';
                 mEnabledTime = getTimestamp() + mDelay_ns;
+                resetTimestamps();
             } else {
                 buf[0] = '0';
             }
@@ -193,6 +436,13 @@ int GyroSensor::enable(int32_t, int en)
             mEnabled = flags;
             sec_power(flags);
             setInitialState();
+            if (mFifoMode) {
+                if (flags) {
+                    setDelay(0, mDelay_ns);
+                } else {
+                    stopFifo();
+                }
+            }
             return 0;
         }
         ALOGE(TAG "%s enable failed, err %d", __FUNCTION__, errno);
@@ -202,7 +452,7 @@ int GyroSensor::enable(int32_t, int en)
 }
 
 bool GyroSensor::hasPendingEvents() const {
-    return mHasPendingEvent;
+    return mHasPendingEvent || mFifoQueued > 0;
 }
 
 int GyroSensor::setDelay(int32_t handle, int64_t delay_ns)
@@ -210,16 +460,22 @@ int GyroSensor::setDelay(int32_t handle, int64_t delay_ns)
     int fd;
 
     mDelay_ns = delay_ns;
+    resetTimestamps();
 
     strcpy(&input_sysfs_path[input_sysfs_path_len], "poll_delay");
     fd = open(input_sysfs_path, O_RDWR);
     if (fd >= 0) {
         char buf[80];
-        sprintf(buf, "%lld", delay_ns / 1000000);
+        int64_t const input_delay_ms = mFifoMode ? GYRO_FIFO_INPUT_DELAY_MS :
+                                                   delay_ns / 1000000;
+        sprintf(buf, "%lld", input_delay_ms);
         write(fd, buf, strlen(buf)+1);
         close(fd);
 
         ALOGV(TAG "%s: %lld ms", __FUNCTION__, delay_ns / 1000000);
+        if (mFifoMode && mEnabled) {
+            return startFifo();
+        }
         return 0;
     }
 
@@ -234,11 +490,26 @@ int GyroSensor::readEvents(sensors_event_t* data, int count)
 
     if (mHasPendingEvent) {
         mHasPendingEvent = false;
-        mPendingEvent.timestamp = getTimestamp();
+        mPendingEvent.timestamp = sampleTimestamp();
         *data = mPendingEvent;
         return mEnabled ? 1 : 0;
     }
 
+    if (mFifoMode) {
+        uint64_t expirations;
+        if (read(mTimerFd, &expirations, sizeof(expirations)) == sizeof(expirations) &&
+                mEnabled && mFifoQueued == 0) {
+            readFifo();
+        }
+        int numEventReceived = 0;
+        for ( ; count && mFifoQueued ; count--, numEventReceived++) {
+            *data++ = mFifoEvents[mFifoHead];
+            mFifoHead = (mFifoHead + 1) % GYRO_FIFO_MAX_SAMPLES;
+            mFifoQueued--;
+        }
+        return numEventReceived;
+    }
+
     ssize_t n = mInputReader.fill(data_fd);
     if (n < 0)
         return n;
@@ -265,7 +536,7 @@ again:
                 ALOGW(TAG "unhandled EV_REL code %d", event->code);
             }
         } else if (type == EV_SYN) {
-            mPendingEvent.timestamp = timevalToNano(event->time);
+            mPendingEvent.timestamp = eventTimestamp(event->time);
             if (mEnabled) {
                 if (mPendingEvent.timestamp >= mEnabledTime) {
                     *data++ = mPendingEvent;
@@ -30,6 +30,10 @@
 
 struct input_event;
 
+/* gyro X, Y and Z, 16 bit big endian, per FIFO sample */
+#define GYRO_FIFO_PACKET        6
+#define GYRO_FIFO_MAX_SAMPLES   (512 / GYRO_FIFO_PACKET)
+
 class GyroSensor : public SensorBase {
     int mEnabled;
     InputEventCircularReader mInputReader;
@@ -41,7 +45,28 @@ class GyroSensor : public SensorBase {
     int64_t mDelay_ns;
     bool mInitialTestDone;
 
+    // FIFO burst mode, see readFifo()
+    bool mFifoMode;
+    int mTimerFd;
+    int64_t mOdrNs;             // sample period programmed in SMPLRT_DIV
+    float mFifoScale;           // rad/s per count at the programmed FS_SEL
+    int64_t mPeriodNs;          // sample period measured since mAnchorNs
+    int64_t mAnchorNs;          // time of the last FIFO reset
+    int64_t mFifoSamples;       // samples read since
+    int64_t mLastTimestamp;
+    int64_t mBurstNs;
+    bool mFifoFooter;
+    sensors_event_t mFifoEvents[GYRO_FIFO_MAX_SAMPLES];
+    int mFifoHead;
+    int mFifoQueued;
+
     int setInitialState();
+    int mpuRead(int reg, unsigned char* buf, int len);
+    int mpuWrite(int reg, unsigned char value);
+    int startFifo();
+    void stopFifo();
+    int armTimer();
+    int readFifo();
 protected:
     int sec_power(int en);
     int sec_runtest();
@@ -51,6 +76,7 @@ public:
     virtual ~GyroSensor();
     virtual int readEvents(sensors_event_t* data, int count);
     virtual bool hasPendingEvents() const;
+    virtual int getFd() const;
     virtual int setDelay(int32_t handle, int64_t ns);
     virtual int enable(int32_t handle, int enabled);
 };
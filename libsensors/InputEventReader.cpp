@@ -21,6 +21,7 @@
 
 #include <sys/cdefs.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <linux/input.h>
 
@@ -33,11 +34,11 @@
 struct input_event;
 
 InputEventCircularReader::InputEventCircularReader(size_t numEvents)
-    : mBuffer(new input_event[numEvents * 2]),
-      mBufferEnd(mBuffer + numEvents),
-      mHead(mBuffer),
-      mCurr(mBuffer),
-      mFreeSpace(numEvents)
+    : mBuffer(new input_event[numEvents]),
+      mSize(numEvents),
+      mHead(0),
+      mCurr(0),
+      mAvailable(0)
 {
 }
 
@@ -48,41 +49,57 @@ InputEventCircularReader::~InputEventCircularReader()
 
 ssize_t InputEventCircularReader::fill(int fd)
 {
-    size_t numEventsRead = 0;
-    if (mFreeSpace) {
-        const ssize_t nread = read(fd, mHead, mFreeSpace * sizeof(input_event));
-        if (nread<0 || nread % sizeof(input_event)) {
-            // we got a partial event!!
-            return nread<0 ? -errno : -EINVAL;
-        }
-
-        numEventsRead = nread / sizeof(input_event);
-        if (numEventsRead) {
-            mHead += numEventsRead;
-            mFreeSpace -= numEventsRead;
-            if (mHead > mBufferEnd) {
-                size_t s = mHead - mBufferEnd;
-                memcpy(mBuffer, mBufferEnd, s * sizeof(input_event));
-                mHead = mBuffer + s;
-            }
-        }
+    size_t freeSpace = mSize - mAvailable;
+    if (!freeSpace)
+        return 0;
+
+    // the free space is [mHead, end) followed by [0, mCurr) when wrapped
+    struct iovec iov[2];
+    size_t first = mSize - mHead;
+    if (first > freeSpace)
+        first = freeSpace;
+    iov[0].iov_base = mBuffer + mHead;
+    iov[0].iov_len = first * sizeof(input_event);
+    iov[1].iov_base = mBuffer;
+    iov[1].iov_len = (freeSpace - first) * sizeof(input_event);
+
+    const ssize_t nread = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+    if (nread<0 || nread % sizeof(input_event)) {
+        if (nread<0 && errno == EAGAIN)
+            return 0;
+        // we got a partial event!!
+        return nread<0 ? -errno : -EINVAL;
     }
 
+    size_t numEventsRead = nread / sizeof(input_event);
+    mHead = (mHead + numEventsRead) % mSize;
+    mAvailable += numEventsRead;
     return numEventsRead;
 }
 
 ssize_t InputEventCircularReader::readEvent(input_event const** events)
 {
-    *events = mCurr;
-    ssize_t available = (mBufferEnd - mBuffer) - mFreeSpace;
-    return available ? 1 : 0;
+    *events = mBuffer + mCurr;
+    return mAvailable ? 1 : 0;
+}
+
+ssize_t InputEventCircularReader::readEvents(input_event const** events)
+{
+    *events = mBuffer + mCurr;
+    size_t contiguous = mSize - mCurr;
+    return mAvailable < contiguous ? mAvailable : contiguous;
 }
 
 void InputEventCircularReader::next()
 {
-    mCurr++;
-    mFreeSpace++;
-    if (mCurr >= mBufferEnd) {
-        mCurr = mBuffer;
+    mAvailable--;
+    if (++mCurr >= mSize) {
+        mCurr = 0;
     }
 }
+
+void InputEventCircularReader::next(size_t numEvents)
+{
+    mAvailable -= numEvents;
+    mCurr = (mCurr + numEvents) % mSize;
+}
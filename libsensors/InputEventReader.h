@@ -26,20 +26,31 @@
 
 struct input_event;
 
+/*
+ * Ring of input events read straight from an evdev fd. fill() reads into
+ * both free segments of the ring with a single readv(), so nothing is ever
+ * copied around; readEvents() hands out the longest contiguous run of
+ * unread events so drivers can decode them in a tight loop.
+ *
+ * The fd must be non-blocking (see SensorBase::openInput).
+ */
 class InputEventCircularReader
 {
     struct input_event* const mBuffer;
-    struct input_event* const mBufferEnd;
-    struct input_event* mHead;
-    struct input_event* mCurr;
-    ssize_t mFreeSpace;
+    const size_t mSize;
+    size_t mHead;
+    size_t mCurr;
+    size_t mAvailable;
 
 public:
     InputEventCircularReader(size_t numEvents);
     ~InputEventCircularReader();
     ssize_t fill(int fd);
     ssize_t readEvent(input_event const** events);
+    ssize_t readEvents(input_event const** events);
     void next();
+    void next(size_t numEvents);
+    size_t capacity() const { return mSize; }
 };
 
 /*****************************************************************************/
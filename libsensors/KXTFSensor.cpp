@@ -32,9 +32,11 @@
 
 #include "KXTFSensor.h"
 
-#define FETCH_FULL_EVENT_BEFORE_RETURN 1
 #define IGNORE_EVENT_TIME 350000000
 
+/* X, Y, Z and SYN per sample, room for 8 samples */
+#define INPUT_READER_SIZE (4 * 8)
+
 #define TAG "[KXT] "
 
 /*****************************************************************************/
@@ -42,20 +44,18 @@
 KXTFSensor::KXTFSensor()
     : SensorBase(NULL, "accelerometer_sensor"),
       mEnabled(0),
-      mInputReader(4),
+      mInputReader(INPUT_READER_SIZE),
       mHasPendingEvent(false),
-      mEnabledTime(0)
+      mEnabledTime(0),
+      mDropping(false)
 {
     mPendingEvent.version = sizeof(sensors_event_t);
     mPendingEvent.sensor = ID_A;
     mPendingEvent.type = SENSOR_TYPE_ACCELEROMETER;
     memset(mPendingEvent.data, 0, sizeof(mPendingEvent.data));
+    memset(mFrame, 0, sizeof(mFrame));
 
-    if (data_fd) {
-        strcpy(input_sysfs_path, "/sys/class/input/");
-        strcat(input_sysfs_path, input_name); /* eventN */
-        strcat(input_sysfs_path, "/device/");
-        input_sysfs_path_len = strlen(input_sysfs_path);
+    if (data_fd >= 0) {
         enable(0, 1);
     }
 }
@@ -95,6 +95,7 @@ int KXTFSensor::setInitialState()
             mPendingEvent.data[0] = value * CONVERT_A_X;
             value = absinfo_z.value;
             mPendingEvent.data[2] = value * CONVERT_A_Z;
+            memcpy(mFrame, mPendingEvent.data, sizeof(mFrame));
             mHasPendingEvent = true;
         }
     }
@@ -112,23 +113,11 @@ int KXTFSensor::enable(int32_t, int en)
 {
     int flags = en ? 1 : 0;
     if (flags != mEnabled) {
-        int fd;
-        strcpy(&input_sysfs_path[input_sysfs_path_len], "enable");
-
-        ALOGV(TAG "%s(%d) %s", __FUNCTION__, en, input_sysfs_path);
-        fd = open(input_sysfs_path, O_RDWR);
-        if (fd >= 0) {
-            char buf[2];
-            int err;
-            buf[1] = 0;
+        ALOGV(TAG "%s(%d) %s", __FUNCTION__, en, input_name);
+        if (!writeSysfsControl(SYSFS_ENABLE, flags)) {
             if (flags) {
-                buf[0] = '1';
                 mEnabledTime = getTimestamp() + IGNORE_EVENT_TIME;
-            } else {
-                buf[0] = '0';
             }
-            err = write(fd, buf, sizeof(buf));
-            close(fd);
             mEnabled = flags;
             setInitialState();
             return 0;
@@ -145,17 +134,7 @@ bool KXTFSensor::hasPendingEvents() const {
 
 int KXTFSensor::setDelay(int32_t handle, int64_t delay_ns)
 {
-    int fd;
-    strcpy(&input_sysfs_path[input_sysfs_path_len], "poll_delay");
-    fd = open(input_sysfs_path, O_RDWR);
-    if (fd >= 0) {
-        char buf[80];
-        sprintf(buf, "%lld", delay_ns);
-        write(fd, buf, strlen(buf)+1);
-        close(fd);
-        return 0;
-    }
-    return -1;
+    return writeSysfsControl(SYSFS_POLL_DELAY, delay_ns);
 }
 
 int KXTFSensor::readEvents(sensors_event_t* data, int count)
@@ -165,7 +144,7 @@ int KXTFSensor::readEvents(sensors_event_t* data, int count)
 
     if (mHasPendingEvent) {
         mHasPendingEvent = false;
-        mPendingEvent.timestamp = getTimestamp();
+        mPendingEvent.timestamp = sampleTimestamp();
         *data = mPendingEvent;
         return mEnabled ? 1 : 0;
     }
@@ -174,56 +153,62 @@ int KXTFSensor::readEvents(sensors_event_t* data, int count)
     if (n < 0)
         return n;
 
+    /* A frame is a run of EV_REL axes closed by SYN_REPORT. The axes
+       decoded so far live in mPendingEvent, so a frame split across two
+       reads simply completes on the next POLLIN. */
     int numEventReceived = 0;
     input_event const* event;
-
-    int timeout = 128;
-#if FETCH_FULL_EVENT_BEFORE_RETURN
-again:
-#endif
-    while (count && mInputReader.readEvent(&event)) {
-        int type = event->type;
-        if (type == EV_REL) {
-            float value = event->value;
-            if (event->code == EVENT_TYPE_ACCEL_X) {
-                mPendingEvent.data[1] = value * KXTF9_CONVERT_A_Y; /* X/Y inversed */
-            } else if (event->code == EVENT_TYPE_ACCEL_Y) {
-                mPendingEvent.data[0] = value * KXTF9_CONVERT_A_X;
-            } else if (event->code == EVENT_TYPE_ACCEL_Z) {
-                mPendingEvent.data[2] = value * KXTF9_CONVERT_A_Z;
-            }
-        } else if (type == EV_SYN) {
-            mPendingEvent.timestamp = timevalToNano(event->time);
-            if (mEnabled) {
-                if (mPendingEvent.timestamp >= mEnabledTime) {
-                    *data++ = mPendingEvent;
-                    numEventReceived++;
+    ssize_t avail;
+
+    while (count && (avail = mInputReader.readEvents(&event)) > 0) {
+        ssize_t i;
+        for (i=0 ; count && i<avail ; i++, event++) {
+            int type = event->type;
+            if (type == EV_REL) {
+                float value = event->value;
+                if (mDropping) {
+                    continue;
+                }
+                if (event->code == EVENT_TYPE_ACCEL_X) {
+                    mPendingEvent.data[1] = value * KXTF9_CONVERT_A_Y; /* X/Y inversed */
+                } else if (event->code == EVENT_TYPE_ACCEL_Y) {
+                    mPendingEvent.data[0] = value * KXTF9_CONVERT_A_X;
+                } else if (event->code == EVENT_TYPE_ACCEL_Z) {
+                    mPendingEvent.data[2] = value * KXTF9_CONVERT_A_Z;
+                }
+            } else if (type == EV_SYN) {
+                if (event->code != SYN_REPORT) {
+                    /* SYN_DROPPED: the axes of the frame in progress are
+                       garbage, and so is everything up to the next
+                       SYN_REPORT */
+                    memcpy(mPendingEvent.data, mFrame, sizeof(mFrame));
+                    mDropping = true;
+                    continue;
+                }
+                if (mDropping) {
+                    mDropping = false;
+                    continue;
+                }
+                /* evdev drops unchanged EV_REL axes, the missing ones
+                   keep the value of the previous frame */
+                memcpy(mFrame, mPendingEvent.data, sizeof(mFrame));
+                ALOGV(TAG "%s: frame %f %f %f", __FUNCTION__,
+                        mPendingEvent.data[0], mPendingEvent.data[1],
+                        mPendingEvent.data[2]);
+                mPendingEvent.timestamp = eventTimestamp(event->time);
+                if (mEnabled) {
+                    if (mPendingEvent.timestamp >= mEnabledTime) {
+                        *data++ = mPendingEvent;
+                        numEventReceived++;
+                    }
+                    count--;
                 }
-                count--;
+            } else {
+                ALOGE(TAG "%s: unknown event (type=%d, code=%d)",
+                        __FUNCTION__, type, event->code);
             }
-        } else {
-            ALOGE(TAG "%s: unknown event (type=%d, code=%d)",
-                    __FUNCTION__, type, event->code);
         }
-        mInputReader.next();
-    }
-
-#if FETCH_FULL_EVENT_BEFORE_RETURN
-    usleep(10000);
-
-    /* if we didn't read a complete event, see if we can fill and
-       try again instead of returning with nothing and redoing poll. */
-    if (numEventReceived == 0 && mEnabled == 1 && --timeout) {
-        n = mInputReader.fill(data_fd);
-        if (n)
-            goto again;
-    }
-#endif
-
-    if (mHasPendingEvent) {
-        ALOGV(TAG "%s: %d %d %d -> %f %f %f", __FUNCTION__,
-                absinfo_x.value, absinfo_y.value, absinfo_z.value,
-                mPendingEvent.data[0], mPendingEvent.data[1], mPendingEvent.data[2]);
+        mInputReader.next(i);
     }
 
     return numEventReceived;
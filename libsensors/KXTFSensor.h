@@ -35,10 +35,13 @@ class KXTFSensor : public SensorBase {
     InputEventCircularReader mInputReader;
     sensors_event_t mPendingEvent;
     bool mHasPendingEvent;
-    char input_sysfs_path[PATH_MAX];
-    int input_sysfs_path_len;
     int64_t mEnabledTime;
 
+    // last complete frame, and events skipped up to the next SYN_REPORT
+    // after a SYN_DROPPED
+    float mFrame[3];
+    bool mDropping;
+
     int setInitialState();
 
 public:
@@ -17,6 +17,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <math.h>
+#include <stdlib.h>
 #include <poll.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -27,29 +28,57 @@
 // #define LOG_NDEBUG 0
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 #include "LightSensor.h"
 
 #define TAG "[Light] "
 
+/* value and SYN per sample, room for 4 samples */
+#define INPUT_READER_SIZE (2 * 4)
+
+/* on-change reporting: a sample is reported once it leaves a band of
+ * LIGHT_HYSTERESIS_PROPERTY percent around the last reported value, at
+ * least LIGHT_MIN_DELTA lux wide. 0 reports every sample. */
+#define LIGHT_HYSTERESIS_PROPERTY   "hw.sensor.light.hysteresis"
+#define LIGHT_HYSTERESIS_DEFAULT    "10"
+#define LIGHT_MIN_DELTA             1.0f
+
+/* while the samples stay in the band the driver poll delay doubles every
+ * LIGHT_STABLE_SAMPLES samples, up to LIGHT_MAX_POLL_PROPERTY ms; it goes
+ * back to the requested delay on the first change */
+#define LIGHT_MAX_POLL_PROPERTY     "hw.sensor.light.max_poll_ms"
+#define LIGHT_MAX_POLL_DEFAULT      "2000"
+#define LIGHT_STABLE_SAMPLES        4
+
+#define LIGHT_VALUE_UNKNOWN         (-1.0f)
+
 /*****************************************************************************/
 
 LightSensor::LightSensor()
     : SensorBase(NULL, "light_sensor"),
       mEnabled(0),
-      mInputReader(4),
-      mHasPendingEvent(false)
+      mInputReader(INPUT_READER_SIZE),
+      mHasPendingEvent(false),
+      mUserDelay(0),
+      mPollDelay(0),
+      mLastReported(LIGHT_VALUE_UNKNOWN),
+      mStableCount(0)
 {
     mPendingEvent.version = sizeof(sensors_event_t);
     mPendingEvent.sensor = ID_L;
     mPendingEvent.type = SENSOR_TYPE_LIGHT;
     memset(mPendingEvent.data, 0, sizeof(mPendingEvent.data));
+    // reported on change, the intervals vary
+    ts_periodic = false;
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get(LIGHT_HYSTERESIS_PROPERTY, value, LIGHT_HYSTERESIS_DEFAULT);
+    mHysteresis = atoi(value) / 100.0f;
+    property_get(LIGHT_MAX_POLL_PROPERTY, value, LIGHT_MAX_POLL_DEFAULT);
+    mMaxPollDelay = atoi(value) * 1000000LL;
 
-    if (data_fd) {
-        strcpy(input_sysfs_path, "/sys/class/input/");
-        strcat(input_sysfs_path, input_name); /* eventN */
-        strcat(input_sysfs_path, "/device/");
-        input_sysfs_path_len = strlen(input_sysfs_path);
+    if (data_fd >= 0) {
         enable(0, 1);
     }
 }
@@ -74,38 +103,67 @@ int LightSensor::setInitialState() {
 
 int LightSensor::setDelay(int32_t handle, int64_t ns)
 {
-    int fd;
-    strcpy(&input_sysfs_path[input_sysfs_path_len], "poll_delay");
-    fd = open(input_sysfs_path, O_RDWR);
-    if (fd >= 0) {
-        char buf[80];
-        sprintf(buf, "%lld", ns);
-        write(fd, buf, strlen(buf)+1);
-        close(fd);
-        return 0;
+    mUserDelay = ns;
+    mPollDelay = ns;
+    mStableCount = 0;
+    return writeSysfsControl(SYSFS_POLL_DELAY, ns);
+}
+
+/*
+ * Program the driver poll delay, kept between the delay the framework
+ * asked for and the max poll delay. Nothing is adapted before the first
+ * setDelay(), the driver default is unknown.
+ */
+void LightSensor::adaptPollDelay(int64_t ns)
+{
+    if (mUserDelay <= 0)
+        return;
+    if (ns > mMaxPollDelay)
+        ns = mMaxPollDelay;
+    if (ns < mUserDelay)
+        ns = mUserDelay;
+    if (ns != mPollDelay && !writeSysfsControl(SYSFS_POLL_DELAY, ns)) {
+        ALOGV(TAG "poll delay %lld ms", ns / 1000000LL);
+        mPollDelay = ns;
+    }
+}
+
+/*
+ * On-change filter, true if the sample must be reported. Also slows the
+ * driver down while the readings are stable and speeds it up on change.
+ */
+bool LightSensor::reportSample(float lux)
+{
+    if (mHysteresis <= 0)
+        return true;
+
+    if (mLastReported != LIGHT_VALUE_UNKNOWN) {
+        float band = mLastReported * mHysteresis;
+        if (band < LIGHT_MIN_DELTA)
+            band = LIGHT_MIN_DELTA;
+        if (fabsf(lux - mLastReported) < band) {
+            if (++mStableCount % LIGHT_STABLE_SAMPLES == 0) {
+                adaptPollDelay(mPollDelay * 2);
+            }
+            return false;
+        }
     }
-    return -1;
+    mLastReported = lux;
+    mStableCount = 0;
+    adaptPollDelay(mUserDelay);
+    return true;
 }
 
 int LightSensor::enable(int32_t handle, int en)
 {
     int flags = en ? 1 : 0;
     if (flags != mEnabled) {
-        int fd;
-        strcpy(&input_sysfs_path[input_sysfs_path_len], "enable");
-        fd = open(input_sysfs_path, O_RDWR);
-        if (fd >= 0) {
-            char buf[2];
-            int err;
-            buf[1] = 0;
-            if (flags) {
-                buf[0] = '1';
-            } else {
-                buf[0] = '0';
-            }
-            err = write(fd, buf, sizeof(buf));
-            close(fd);
+        if (!writeSysfsControl(SYSFS_ENABLE, flags)) {
             mEnabled = flags;
+            // the first sample after enable is always reported
+            mLastReported = LIGHT_VALUE_UNKNOWN;
+            mStableCount = 0;
+            adaptPollDelay(mUserDelay);
             /*if (mEnabled) {
                 setInitialState();
             }*/
@@ -127,7 +185,7 @@ int LightSensor::readEvents(sensors_event_t* data, int count)
 
     if (mHasPendingEvent) {
         mHasPendingEvent = false;
-        mPendingEvent.timestamp = getTimestamp();
+        mPendingEvent.timestamp = sampleTimestamp();
         *data = mPendingEvent;
         return mEnabled ? 1 : 0;
     }
@@ -138,29 +196,33 @@ int LightSensor::readEvents(sensors_event_t* data, int count)
 
     int numEventReceived = 0;
     input_event const* event;
-
-    while (count && mInputReader.readEvent(&event)) {
-        int type = event->type;
-        if (type == EV_REL) {
-            if (event->code == EVENT_TYPE_LIGHT) {
-                if (event->value != -1) {
-                    ALOGV(TAG "event (value=%d)", event->value);
-                    // FIXME: not sure why we're getting -1 sometimes
-                    mPendingEvent.light = event->value;
+    ssize_t avail;
+
+    while (count && (avail = mInputReader.readEvents(&event)) > 0) {
+        ssize_t i;
+        for (i=0 ; count && i<avail ; i++, event++) {
+            int type = event->type;
+            if (type == EV_REL) {
+                if (event->code == EVENT_TYPE_LIGHT) {
+                    if (event->value != -1) {
+                        ALOGV(TAG "event (value=%d)", event->value);
+                        // FIXME: not sure why we're getting -1 sometimes
+                        mPendingEvent.light = event->value;
+                    }
                 }
+            } else if (type == EV_SYN) {
+                mPendingEvent.timestamp = eventTimestamp(event->time);
+                if (mEnabled && reportSample(mPendingEvent.light)) {
+                    *data++ = mPendingEvent;
+                    count--;
+                    numEventReceived++;
+                }
+            } else {
+                ALOGE(TAG "unknown event (type=0x%x, code=0x%x)",
+                        type, event->code);
             }
-        } else if (type == EV_SYN) {
-            mPendingEvent.timestamp = timevalToNano(event->time);
-            if (mEnabled) {
-                *data++ = mPendingEvent;
-                count--;
-                numEventReceived++;
-            }
-        } else {
-            ALOGE(TAG "unknown event (type=0x%x, code=0x%x)",
-                    type, event->code);
         }
-        mInputReader.next();
+        mInputReader.next(i);
     }
 
     return numEventReceived;
@@ -35,11 +35,19 @@ class LightSensor : public SensorBase {
     InputEventCircularReader mInputReader;
     sensors_event_t mPendingEvent;
     bool mHasPendingEvent;
-    char input_sysfs_path[PATH_MAX];
-    int input_sysfs_path_len;
+
+    // on-change filter and adaptive poll delay, see reportSample()
+    float mHysteresis;
+    int64_t mUserDelay;
+    int64_t mPollDelay;
+    int64_t mMaxPollDelay;
+    float mLastReported;
+    int mStableCount;
 
     float indexToValue(size_t index) const;
     //int setInitialState();
+    bool reportSample(float lux);
+    void adaptPollDelay(int64_t ns);
 
 public:
             LightSensor();
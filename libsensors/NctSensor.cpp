@@ -21,6 +21,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/select.h>
+#include <sys/timerfd.h>
 
 //#define LOG_NDEBUG 0
 
@@ -30,20 +31,33 @@
 
 #define TAG "[NCT] "
 
+/* the hwmon node has no interrupt, it is sampled from a timerfd which
+ * doubles as the fd of this sensor in the poll loop */
+#define NCT_MIN_DELAY       500000000LL
+#define NCT_VALUE_UNKNOWN   (-0x7fffffff - 1)
+
 /*****************************************************************************/
 
 NctSensor::NctSensor()
     : SensorBase(NCT_DEVICE_NAME, NULL),
       mEnabled(0),
-      mInputReader(4),
+      mTimerFd(-1),
+      mDelay(NCT_MIN_DELAY),
+      mLastValue(NCT_VALUE_UNKNOWN),
       mHasPendingEvent(false)
 {
     mPendingEvent.version = sizeof(sensors_event_t);
     mPendingEvent.sensor = ID_T;
     mPendingEvent.type = SENSOR_TYPE_TEMPERATURE;
     memset(mPendingEvent.data, 0, sizeof(mPendingEvent.data));
+    // reported on change, the intervals vary
+    ts_periodic = false;
+
+    mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    ALOGE_IF(mTimerFd<0, TAG "couldn't create timerfd (%s)", strerror(errno));
 
-    if (getFd()) {
+    open_device();
+    if (dev_fd >= 0) {
         enable(0, 1);
     }
 }
@@ -52,59 +66,87 @@ NctSensor::~NctSensor() {
     if (mEnabled) {
         enable(0, 0);
     }
+    if (mTimerFd >= 0) {
+        close(mTimerFd);
+    }
 }
 
-int NctSensor::readSysFsValue(void) {
-    struct input_absinfo absinfo;
-    int fd = getFd();
+int NctSensor::getFd() const {
+    return mTimerFd;
+}
 
-    if (!mEnabled) {
+/*
+ * Sample the hwmon node, queue an event if the value changed.
+ */
+int NctSensor::readSysFsValue(void) {
+    if (!mEnabled || dev_fd < 0) {
         return 0;
     }
 
-    if (fd > 0) {
-        close_device();
-        open_device();
+    char buf[8] = "";
+    if (pread(dev_fd, &buf[0], sizeof(buf) - 1, 0) <= 0) {
+        int err = errno;
+        ALOGE(TAG "%s: read failed (%s)", __FUNCTION__, strerror(err));
+        return -err;
     }
 
-    fd = getFd();
-    if (fd > 0) {
-        char buf[8] = "";
-        read(fd, &buf[0], sizeof(buf));
-
-        int nr = sscanf(buf, "%d", &absinfo.value);
-        if (nr >= 0) {
-            ALOGV(TAG "%s read=%d", __FUNCTION__, absinfo.value);
-            mPendingEvent.timestamp = getTimestamp();
-            mPendingEvent.data[0] = convertTemperature(absinfo.value);
-            mHasPendingEvent = true;
-        }
+    int value;
+    int nr = sscanf(buf, "%d", &value);
+    if (nr == 1 && value != mLastValue) {
+        ALOGV(TAG "%s read=%d", __FUNCTION__, value);
+        mLastValue = value;
+        mPendingEvent.timestamp = sampleTimestamp();
+        mPendingEvent.data[0] = convertTemperature(value);
+        mHasPendingEvent = true;
     }
 
     return 0;
 }
 
+int NctSensor::armTimer() {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (mEnabled) {
+        spec.it_value.tv_sec = mDelay / 1000000000LL;
+        spec.it_value.tv_nsec = mDelay % 1000000000LL;
+        spec.it_interval = spec.it_value;
+    }
+    if (timerfd_settime(mTimerFd, 0, &spec, NULL) < 0) {
+        int err = errno;
+        ALOGE(TAG "%s: timerfd_settime failed (%s)", __FUNCTION__, strerror(err));
+        return -err;
+    }
+    return 0;
+}
+
 int NctSensor::enable(int32_t, int en) {
     int flags = en ? 1 : 0;
 
     ALOGV(TAG "%s(%d)", __FUNCTION__, en);
 
-    if (!mEnabled) {
-        open_device();
-    } else {
-        close_device();
-    }
-
     if (flags != mEnabled) {
+        if (flags && (dev_fd < 0 || mTimerFd < 0)) {
+            ALOGW(TAG "unable to enable the sensor");
+            return -EIO;
+        }
         mEnabled = flags;
+        // always report the current value right after enabling
+        mLastValue = NCT_VALUE_UNKNOWN;
+        mHasPendingEvent = false;
+        readSysFsValue();
+        armTimer();
+    }
+    return 0;
+}
+
+int NctSensor::setDelay(int32_t, int64_t ns) {
+    if (ns < NCT_MIN_DELAY) {
+        ns = NCT_MIN_DELAY;
+    }
+    if (ns != mDelay) {
+        mDelay = ns;
         if (mEnabled) {
-            if (getFd() > 0)
-                readSysFsValue();
-            else {
-                mEnabled = false;
-                ALOGW(TAG "unable to enable the sensor");
-                return -EIO;
-            }
+            return armTimer();
         }
     }
     return 0;
@@ -119,19 +161,23 @@ int NctSensor::readEvents(sensors_event_t* data, int count)
     if (count < 1)
         return -EINVAL;
 
-    int numRecords = 0;
+    uint64_t expirations;
+    if (read(mTimerFd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+        // one sample per wakeup, no matter how many periods went by
+        readSysFsValue();
+    }
 
-    readSysFsValue();
+    if (!mHasPendingEvent) {
+        return 0;
+    }
 
-    while (count) {
-        ALOGV(TAG "%s has pending data", __FUNCTION__);
-        if (mEnabled) {
-                *data++ = mPendingEvent;
-                numRecords++;
-        }
-        count--;
+    ALOGV(TAG "%s has pending data", __FUNCTION__);
+    mHasPendingEvent = false;
+    if (!mEnabled) {
+        return 0;
     }
-    return mEnabled ? numRecords : 0;
+    *data = mPendingEvent;
+    return 1;
 }
 
 float NctSensor::convertTemperature(int value) const
@@ -24,21 +24,20 @@
 
 #include "sensors.h"
 #include "SensorBase.h"
-#include "InputEventReader.h"
 
 /*****************************************************************************/
 
-struct input_event;
-
 class NctSensor : public SensorBase {
     int mEnabled;
-    int64_t mEnabledTime;
+    int mTimerFd;
+    int64_t mDelay;
+    int mLastValue;
 
-    InputEventCircularReader mInputReader;
     sensors_event_t mPendingEvent;
     bool mHasPendingEvent;
 
     int readSysFsValue();
+    int armTimer();
     float convertTemperature(int value) const;
 
 public:
@@ -46,6 +45,8 @@ public:
     virtual ~NctSensor();
     virtual int readEvents(sensors_event_t* data, int count);
     virtual bool hasPendingEvents() const;
+    virtual int getFd() const;
+    virtual int setDelay(int32_t handle, int64_t ns);
     virtual int enable(int32_t handle, int enabled);
 };
 
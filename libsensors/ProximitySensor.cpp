@@ -17,6 +17,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <math.h>
+#include <stdlib.h>
 #include <poll.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -25,27 +26,43 @@
 #include <linux/capella_cm3602.h>
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 #include "ProximitySensor.h"
 
+/* distance and SYN per sample, room for 4 samples */
+#define INPUT_READER_SIZE (2 * 4)
+
+/* on-change reporting: a sample is reported when the distance moved by
+ * more than PROXIMITY_THRESHOLD_PROPERTY cm since the last report (by
+ * default any change). The driver is interrupt driven, there is no poll
+ * rate to adapt. */
+#define PROXIMITY_THRESHOLD_PROPERTY    "hw.sensor.proximity.threshold_cm"
+#define PROXIMITY_THRESHOLD_DEFAULT     "0"
+
+#define PROXIMITY_VALUE_UNKNOWN         (-1.0f)
+
 /*****************************************************************************/
 
 ProximitySensor::ProximitySensor()
     : SensorBase(CM_DEVICE_NAME, "proximity_sensor"),
       mEnabled(0),
-      mInputReader(4),
-      mHasPendingEvent(false)
+      mInputReader(INPUT_READER_SIZE),
+      mHasPendingEvent(false),
+      mLastReported(PROXIMITY_VALUE_UNKNOWN)
 {
     mPendingEvent.version = sizeof(sensors_event_t);
     mPendingEvent.sensor = ID_P;
     mPendingEvent.type = SENSOR_TYPE_PROXIMITY;
     memset(mPendingEvent.data, 0, sizeof(mPendingEvent.data));
+    // reported on change, the intervals vary
+    ts_periodic = false;
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get(PROXIMITY_THRESHOLD_PROPERTY, value, PROXIMITY_THRESHOLD_DEFAULT);
+    mThreshold = atof(value);
 
-    if (data_fd) {
-        strcpy(input_sysfs_path, "/sys/class/input/");
-        strcat(input_sysfs_path, input_name);
-        strcat(input_sysfs_path, "/device/");
-        input_sysfs_path_len = strlen(input_sysfs_path);
+    if (data_fd >= 0) {
         enable(0, 1);
     }
 }
@@ -69,20 +86,9 @@ int ProximitySensor::setInitialState() {
 int ProximitySensor::enable(int32_t, int en) {
     int flags = en ? 1 : 0;
     if (flags != mEnabled) {
-        int fd;
-        strcpy(&input_sysfs_path[input_sysfs_path_len], "enable");
-        fd = open(input_sysfs_path, O_RDWR);
-        if (fd >= 0) {
-            char buf[2];
-            buf[1] = 0;
-            if (flags) {
-                buf[0] = '1';
-            } else {
-                buf[0] = '0';
-            }
-            write(fd, buf, sizeof(buf));
-            close(fd);
+        if (!writeSysfsControl(SYSFS_ENABLE, flags)) {
             mEnabled = flags;
+            mLastReported = PROXIMITY_VALUE_UNKNOWN;
             setInitialState();
             return 0;
         }
@@ -102,9 +108,12 @@ int ProximitySensor::readEvents(sensors_event_t* data, int count)
 
     if (mHasPendingEvent) {
         mHasPendingEvent = false;
-        mPendingEvent.timestamp = getTimestamp();
+        mPendingEvent.timestamp = sampleTimestamp();
         *data = mPendingEvent;
-        return mEnabled ? 1 : 0;
+        if (!mEnabled)
+            return 0;
+        mLastReported = mPendingEvent.distance;
+        return 1;
     }
 
     ssize_t n = mInputReader.fill(data_fd);
@@ -113,31 +122,46 @@ int ProximitySensor::readEvents(sensors_event_t* data, int count)
 
     int numEventReceived = 0;
     input_event const* event;
-
-    while (count && mInputReader.readEvent(&event)) {
-        int type = event->type;
-        if (type == EV_ABS) {
-            if (event->code == EVENT_TYPE_PROXIMITY) {
-                // FIXME: not sure why we're getting -1 sometimes
-                mPendingEvent.distance = indexToValue(event->value);
-            }
-        } else if (type == EV_SYN) {
-            mPendingEvent.timestamp = timevalToNano(event->time);
-            if (mEnabled) {
-                *data++ = mPendingEvent;
-                count--;
-                numEventReceived++;
+    ssize_t avail;
+
+    while (count && (avail = mInputReader.readEvents(&event)) > 0) {
+        ssize_t i;
+        for (i=0 ; count && i<avail ; i++, event++) {
+            int type = event->type;
+            if (type == EV_ABS) {
+                if (event->code == EVENT_TYPE_PROXIMITY) {
+                    // FIXME: not sure why we're getting -1 sometimes
+                    mPendingEvent.distance = indexToValue(event->value);
+                }
+            } else if (type == EV_SYN) {
+                mPendingEvent.timestamp = eventTimestamp(event->time);
+                if (mEnabled && reportSample(mPendingEvent.distance)) {
+                    *data++ = mPendingEvent;
+                    count--;
+                    numEventReceived++;
+                }
+            } else {
+                ALOGE("ProximitySensor: unknown event (type=%d, code=%d)",
+                        type, event->code);
             }
-        } else {
-            ALOGE("ProximitySensor: unknown event (type=%d, code=%d)",
-                    type, event->code);
         }
-        mInputReader.next();
+        mInputReader.next(i);
     }
 
     return numEventReceived;
 }
 
+/* on-change filter, true if the sample must be reported */
+bool ProximitySensor::reportSample(float distance)
+{
+    if (mLastReported != PROXIMITY_VALUE_UNKNOWN &&
+            fabsf(distance - mLastReported) <= mThreshold) {
+        return false;
+    }
+    mLastReported = distance;
+    return true;
+}
+
 float ProximitySensor::indexToValue(size_t index) const
 {
     return index * PROXIMITY_THRESHOLD_CM;
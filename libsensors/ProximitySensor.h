@@ -35,11 +35,14 @@ class ProximitySensor : public SensorBase {
     InputEventCircularReader mInputReader;
     sensors_event_t mPendingEvent;
     bool mHasPendingEvent;
-    char input_sysfs_path[PATH_MAX];
-    int input_sysfs_path_len;
+
+    // on-change filter, see reportSample()
+    float mThreshold;
+    float mLastReported;
 
     int setInitialState();
     float indexToValue(size_t index) const;
+    bool reportSample(float distance);
 
 public:
             ProximitySensor();
@@ -18,11 +18,15 @@
 #include <errno.h>
 #include <math.h>
 #include <poll.h>
+#include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 #include <linux/input.h>
 
@@ -30,18 +34,51 @@
 
 /*****************************************************************************/
 
+#define SYSFS_VALUE_UNKNOWN     (-1LL - 0x7fffffffffffffffLL)
+
+/* 0 turns the smoothing of the periodic sample timestamps off, they are
+ * still aligned to CLOCK_MONOTONIC and kept increasing */
+#define TIMESTAMP_FILTER_PROPERTY   "hw.sensor.timestamp_filter"
+
+enum {
+    TS_CLOCK_UNKNOWN,
+    TS_CLOCK_MONOTONIC,
+    TS_CLOCK_REALTIME,
+};
+
+static const char* const sSysfsControlNames[] = {
+    "enable",
+    "poll_delay",
+};
+
 SensorBase::SensorBase(
         const char* dev_name,
         const char* data_name)
     : dev_name(dev_name), data_name(data_name),
-      dev_fd(-1), data_fd(-1)
+      dev_fd(-1), data_fd(-1), input_replayed(false),
+      ts_periodic(true), ts_smooth(true), ts_clock(TS_CLOCK_UNKNOWN), ts_last(0)
 {
+    char value[PROPERTY_VALUE_MAX];
+    property_get(TIMESTAMP_FILTER_PROPERTY, value, "1");
+    ts_smooth = atoi(value) != 0;
+    resetTimestamps();
+
+    input_name[0] = '\0';
+    for (int i=0 ; i<numSysfsControls ; i++) {
+        sysfs_fd[i] = -1;
+        sysfs_value[i] = SYSFS_VALUE_UNKNOWN;
+    }
     if (data_name) {
         data_fd = openInput(data_name);
     }
 }
 
 SensorBase::~SensorBase() {
+    for (int i=0 ; i<numSysfsControls ; i++) {
+        if (sysfs_fd[i] >= 0) {
+            close(sysfs_fd[i]);
+        }
+    }
     if (data_fd >= 0) {
         close(data_fd);
     }
@@ -88,41 +125,366 @@ int64_t SensorBase::getTimestamp() {
     return int64_t(t.tv_sec)*1000000000LL + t.tv_nsec;
 }
 
-int SensorBase::openInput(const char* inputName) {
-    int fd = -1;
-    const char *dirname = "/dev/input";
+static int64_t clockNow(clockid_t clock) {
+    struct timespec t;
+    t.tv_sec = t.tv_nsec = 0;
+    clock_gettime(clock, &t);
+    return int64_t(t.tv_sec)*1000000000LL + t.tv_nsec;
+}
+
+/*
+ * Timestamp model. The evdev event times of this kernel are
+ * CLOCK_REALTIME (newer kernels, and the sensors_bench replay, use
+ * CLOCK_MONOTONIC), while the timer driven drivers stamp their samples
+ * when they read them: everything is moved to CLOCK_MONOTONIC first, the
+ * clock of the events being told apart on the first one.
+ *
+ * The samples of the periodic sensors then go through a first order
+ * loop: the period, averaged over the intervals, predicts the next
+ * timestamp, which is pulled towards the measured one. The scheduling
+ * delays of the kernel work queues and of the reads only ever make a
+ * sample look late, so the loop follows the early samples closely and the
+ * late ones slowly, tracking the lower edge of the jitter. An interval outside of [period/2, 2*period] is a gap or a
+ * rate change: the model restarts from the measured time, and the period
+ * is measured again after OUTLIER_RESEED outliers in a row. The result is
+ * never in the future and always increases.
+ */
+#define PERIOD_GAIN         32
+#define EARLY_GAIN          2
+#define LATE_GAIN           16
+#define OUTLIER_RESEED      4
+
+void SensorBase::resetTimestamps() {
+    ts_period = 0;
+    ts_raw = 0;
+    ts_outliers = 0;
+    // ts_last stays, the timestamps keep increasing across a restart
+}
+
+int64_t SensorBase::eventTimestamp(timeval const& t) {
+    int64_t raw = timevalToNano(t);
+    int64_t const now = getTimestamp();
+    if (ts_clock != TS_CLOCK_MONOTONIC) {
+        int64_t const realtime = clockNow(CLOCK_REALTIME);
+        if (ts_clock == TS_CLOCK_UNKNOWN) {
+            ts_clock = llabs(now - raw) <= llabs(realtime - raw) ?
+                    TS_CLOCK_MONOTONIC : TS_CLOCK_REALTIME;
+        }
+        if (ts_clock == TS_CLOCK_REALTIME) {
+            raw += now - realtime;
+        }
+    }
+    return correctTimestamp(raw, now);
+}
+
+int64_t SensorBase::sampleTimestamp() {
+    int64_t const now = getTimestamp();
+    return correctTimestamp(now, now);
+}
+
+int64_t SensorBase::correctTimestamp(int64_t raw, int64_t now) {
+    if (raw > now) {
+        raw = now;
+    }
+    int64_t t = raw;
+    if (ts_raw && ts_periodic) {
+        int64_t const delta = raw - ts_raw;
+        if (!ts_period) {
+            // first interval, unless the requested poll delay is known
+            ts_period = sysfs_value[SYSFS_POLL_DELAY] > 0 ?
+                    sysfs_value[SYSFS_POLL_DELAY] : delta;
+        }
+        if (delta > 0 && delta >= ts_period/2 && delta <= ts_period*2) {
+            ts_outliers = 0;
+            ts_period += (delta - ts_period) / PERIOD_GAIN;
+            if (ts_smooth) {
+                int64_t const predicted = ts_last + ts_period;
+                int64_t const error = raw - predicted;
+                t = predicted + error / (error < 0 ? EARLY_GAIN : LATE_GAIN);
+            }
+        } else if (delta > 0 && ++ts_outliers >= OUTLIER_RESEED) {
+            ts_outliers = 0;
+            ts_period = delta;
+        }
+    }
+    ts_raw = raw;
+
+    if (t > now) {
+        t = now;
+    }
+    if (t <= ts_last) {
+        t = ts_last + 1;
+    }
+    ts_last = t;
+    return t;
+}
+
+/*
+ * Write a value to one of the input device sysfs controls. The node is
+ * opened on first use and kept open, and nothing is written if the
+ * control already holds this value. The value goes out as a NUL
+ * terminated decimal string, which is what the kernel drivers expect.
+ */
+int SensorBase::writeSysfsControl(int control, int64_t value) {
+    if (control < 0 || control >= numSysfsControls) {
+        return -EINVAL;
+    }
+    if (sysfs_value[control] != value) {
+        // the sample stream restarts, or changes rate
+        resetTimestamps();
+    }
+    if (input_replayed) {
+        sysfs_value[control] = value;
+        return 0;
+    }
+    if (sysfs_fd[control] >= 0 && sysfs_value[control] == value) {
+        return 0;
+    }
+    if (sysfs_fd[control] < 0) {
+        char path[PATH_MAX];
+        if (!input_name[0]) {
+            return -1;
+        }
+        snprintf(path, sizeof(path), "/sys/class/input/%s/device/%s",
+                input_name, sSysfsControlNames[control]);
+        sysfs_fd[control] = open(path, O_RDWR);
+        if (sysfs_fd[control] < 0) {
+            ALOGE("Couldn't open %s (%s)", path, strerror(errno));
+            return -1;
+        }
+    }
+    char buf[24];
+    int len = snprintf(buf, sizeof(buf), "%lld", value);
+    if (pwrite(sysfs_fd[control], buf, len + 1, 0) < 0) {
+        ALOGE("Couldn't write %s to %s/%s (%s)", buf, input_name,
+                sSysfsControlNames[control], strerror(errno));
+        sysfs_value[control] = SYSFS_VALUE_UNKNOWN;
+        return -1;
+    }
+    sysfs_value[control] = value;
+    return 0;
+}
+
+/*
+ * Input device registry: /dev/input is scanned once for all the drivers,
+ * every node is opened and named with EVIOCGNAME a single time, and the
+ * fds are handed out to openInput() callers. The nodes that were claimed
+ * are remembered in INPUT_CACHE_FILE, checked against the device number
+ * and the name on the next start, so the scan can usually be skipped.
+ *
+ * Only used while the drivers are being constructed, from one thread.
+ */
+#define INPUT_DIR           "/dev/input"
+#define INPUT_CACHE_FILE    "/data/misc/sensors/input_nodes"
+#define MAX_INPUT_DEVICES   32
+
+struct input_device_t {
+    char    name[80];
+    char    node[32];
+    dev_t   rdev;
+    int     fd;         // -1 once claimed or closed
+    bool    claimed;
+};
+
+static input_device_t sInputDevices[MAX_INPUT_DEVICES];
+static int sNumInputDevices;
+static bool sInputCacheDirty;
+
+#define MAX_INPUT_OVERRIDES 8
+
+struct input_override_t {
+    const char* name;
+    int         fd;     // -1 once handed out
+};
+
+static input_override_t sInputOverrides[MAX_INPUT_OVERRIDES];
+static int sNumInputOverrides;
+
+static int getInputName(int fd, char* name, size_t size) {
+    if (ioctl(fd, EVIOCGNAME(size - 1), name) < 1) {
+        name[0] = '\0';
+        return -1;
+    }
+    name[size - 1] = '\0';
+    return 0;
+}
+
+static input_device_t* findInputDevice(const char* inputName) {
+    for (int i=0 ; i<sNumInputDevices ; i++) {
+        if (!sInputDevices[i].claimed && !strcmp(sInputDevices[i].name, inputName)) {
+            return &sInputDevices[i];
+        }
+    }
+    return NULL;
+}
+
+static bool knownInputNode(const char* node) {
+    for (int i=0 ; i<sNumInputDevices ; i++) {
+        if (!strcmp(sInputDevices[i].node, node)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* open and name the nodes not seen yet, uinput devices can show up late */
+static void scanInputDevices() {
     char devname[PATH_MAX];
-    char *filename;
-    DIR *dir;
+    DIR *dir = opendir(INPUT_DIR);
+    if (dir == NULL)
+        return;
     struct dirent *de;
-    dir = opendir(dirname);
-    if(dir == NULL)
-        return -1;
-    strcpy(devname, dirname);
-    filename = devname + strlen(devname);
-    *filename++ = '/';
-    while((de = readdir(dir))) {
-        if(de->d_name[0] == '.' &&
-                (de->d_name[1] == '\0' ||
-                        (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+    while ((de = readdir(dir)) && sNumInputDevices < MAX_INPUT_DEVICES) {
+        if (strncmp(de->d_name, "event", 5) || knownInputNode(de->d_name))
+            continue;
+        snprintf(devname, sizeof(devname), INPUT_DIR "/%s", de->d_name);
+        // non-blocking: the readers fill() with readv() until EAGAIN
+        int fd = open(devname, O_RDONLY | O_NONBLOCK);
+        if (fd < 0)
+            continue;
+        input_device_t& dev(sInputDevices[sNumInputDevices]);
+        struct stat st;
+        if (getInputName(fd, dev.name, sizeof(dev.name)) < 0 || fstat(fd, &st) < 0) {
+            close(fd);
             continue;
-        strcpy(filename, de->d_name);
-        fd = open(devname, O_RDONLY);
-        if (fd>=0) {
-            char name[80];
-            if (ioctl(fd, EVIOCGNAME(sizeof(name) - 1), &name) < 1) {
-                name[0] = '\0';
+        }
+        strlcpy(dev.node, de->d_name, sizeof(dev.node));
+        dev.rdev = st.st_rdev;
+        dev.fd = fd;
+        dev.claimed = false;
+        sNumInputDevices++;
+    }
+    closedir(dir);
+}
+
+/* remember a node opened from the cache so it is written back */
+static void claimInputNode(const char* node, const char* name, dev_t rdev) {
+    for (int i=0 ; i<sNumInputDevices ; i++) {
+        input_device_t& dev(sInputDevices[i]);
+        if (!strcmp(dev.node, node)) {
+            if (dev.fd >= 0) {
+                close(dev.fd);
+                dev.fd = -1;
             }
-            if (!strcmp(name, inputName)) {
-                strcpy(input_name, filename);
-                break;
-            } else {
-                close(fd);
-                fd = -1;
+            dev.claimed = true;
+            return;
+        }
+    }
+    if (sNumInputDevices < MAX_INPUT_DEVICES) {
+        input_device_t& dev(sInputDevices[sNumInputDevices++]);
+        strlcpy(dev.name, name, sizeof(dev.name));
+        strlcpy(dev.node, node, sizeof(dev.node));
+        dev.rdev = rdev;
+        dev.fd = -1;
+        dev.claimed = true;
+    }
+}
+
+/* try the node recorded for this name in the cache file */
+static int openCachedInput(const char* inputName, char* node, size_t size) {
+    FILE* fp = fopen(INPUT_CACHE_FILE, "r");
+    if (fp == NULL)
+        return -1;
+
+    char line[160];
+    int fd = -1;
+    while (fd < 0 && fgets(line, sizeof(line), fp)) {
+        char cachedNode[32];
+        unsigned long rdev;
+        int pos = 0;
+        if (sscanf(line, "%31s %lu %n", cachedNode, &rdev, &pos) < 2 || !pos)
+            continue;
+        char* name = line + pos;
+        name[strcspn(name, "\n")] = '\0';
+        if (strcmp(name, inputName) || strchr(cachedNode, '/'))
+            continue;
+
+        char devname[PATH_MAX];
+        snprintf(devname, sizeof(devname), INPUT_DIR "/%s", cachedNode);
+        fd = open(devname, O_RDONLY | O_NONBLOCK);
+        if (fd < 0)
+            break;
+        struct stat st;
+        char actual[80];
+        if (fstat(fd, &st) < 0 || st.st_rdev != dev_t(rdev) ||
+                getInputName(fd, actual, sizeof(actual)) < 0 || strcmp(actual, inputName)) {
+            // stale entry
+            close(fd);
+            fd = -1;
+            break;
+        }
+        strlcpy(node, cachedNode, size);
+        claimInputNode(cachedNode, inputName, st.st_rdev);
+    }
+    fclose(fp);
+    return fd;
+}
+
+/*
+ * Called by the poll context once all the drivers are constructed: close
+ * the nodes nobody asked for, and persist the ones that were claimed.
+ */
+void SensorBase::releaseInputRegistry() {
+    if (sInputCacheDirty) {
+        FILE* fp = fopen(INPUT_CACHE_FILE ".tmp", "w");
+        if (fp != NULL) {
+            for (int i=0 ; i<sNumInputDevices ; i++) {
+                input_device_t const& dev(sInputDevices[i]);
+                if (dev.claimed) {
+                    fprintf(fp, "%s %lu %s\n", dev.node,
+                            (unsigned long)dev.rdev, dev.name);
+                }
             }
+            fclose(fp);
+            rename(INPUT_CACHE_FILE ".tmp", INPUT_CACHE_FILE);
         }
+        sInputCacheDirty = false;
+    }
+    for (int i=0 ; i<sNumInputDevices ; i++) {
+        if (sInputDevices[i].fd >= 0) {
+            close(sInputDevices[i].fd);
+        }
+    }
+    sNumInputDevices = 0;
+}
+
+void SensorBase::setInputOverride(const char* inputName, int fd) {
+    if (sNumInputOverrides < MAX_INPUT_OVERRIDES) {
+        sInputOverrides[sNumInputOverrides].name = inputName;
+        sInputOverrides[sNumInputOverrides].fd = fd;
+        sNumInputOverrides++;
+    }
+}
+
+int SensorBase::openInput(const char* inputName) {
+    for (int i=0 ; i<sNumInputOverrides ; i++) {
+        input_override_t& o(sInputOverrides[i]);
+        if (o.fd >= 0 && !strcmp(o.name, inputName)) {
+            int fd = o.fd;
+            o.fd = -1;
+            strlcpy(input_name, "replay", sizeof(input_name));
+            input_replayed = true;
+            return fd;
+        }
+    }
+
+    int fd = openCachedInput(inputName, input_name, sizeof(input_name));
+    if (fd >= 0) {
+        return fd;
+    }
+
+    input_device_t* dev = findInputDevice(inputName);
+    if (dev == NULL) {
+        scanInputDevices();
+        dev = findInputDevice(inputName);
+    }
+    if (dev != NULL) {
+        fd = dev->fd;
+        dev->fd = -1;
+        dev->claimed = true;
+        strcpy(input_name, dev->node);
+        sInputCacheDirty = true;
     }
-    closedir(dir);
     ALOGE_IF(fd<0, "couldn't find '%s' input device", inputName);
     return fd;
 }
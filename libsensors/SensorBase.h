@@ -35,9 +35,37 @@ protected:
     int         dev_fd;
     int         data_fd;
 
+    // control nodes in /sys/class/input/<input_name>/device/
+    enum {
+        SYSFS_ENABLE        = 0,
+        SYSFS_POLL_DELAY,
+        numSysfsControls,
+    };
+    int         sysfs_fd[numSysfsControls];
+    int64_t     sysfs_value[numSysfsControls];
+    // data_fd is a sensors_bench replay stream, there are no sysfs controls
+    bool        input_replayed;
+
+    // timestamp model, see correctTimestamp(). ts_periodic is cleared by
+    // the on-change drivers: their samples are aligned but not smoothed
+    bool        ts_periodic;
+    bool        ts_smooth;
+    int         ts_clock;
+    int64_t     ts_period;
+    int64_t     ts_raw;
+    int64_t     ts_last;
+    int         ts_outliers;
+
     int openInput(const char* inputName);
+    int writeSysfsControl(int control, int64_t value);
     static int64_t getTimestamp();
 
+    // CLOCK_MONOTONIC timestamp of a sample, from the evdev event time or
+    // taken now by the timer driven drivers
+    int64_t eventTimestamp(timeval const& t);
+    int64_t sampleTimestamp();
+    int64_t correctTimestamp(int64_t raw, int64_t now);
+    void resetTimestamps();
 
     static int64_t timevalToNano(timeval const& t) {
         return t.tv_sec*1000000000LL + t.tv_usec*1000;
@@ -47,6 +75,11 @@ protected:
     int close_device();
 
 public:
+    static void releaseInputRegistry();
+    // sensors_bench replay mode: the next openInput(inputName) gets fd
+    // instead of the input device, must be set before the drivers exist
+    static void setInputOverride(const char* inputName, int fd);
+
             SensorBase(
                     const char* dev_name,
                     const char* data_name);
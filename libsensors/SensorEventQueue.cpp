@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include <cutils/atomic.h>
+#include <hardware/sensors.h>
+
+#include "SensorEventQueue.h"
+
+/*****************************************************************************/
+
+SensorEventQueue::SensorEventQueue(size_t numEvents)
+    : mHead(0),
+      mTail(0)
+{
+    size_t size = 1;
+    while (size < numEvents)
+        size <<= 1;
+    mBuffer = new sensors_event_t[size];
+    mMask = size - 1;
+}
+
+SensorEventQueue::~SensorEventQueue()
+{
+    delete [] mBuffer;
+}
+
+/*
+ * mHead and mTail are free running counters, only their difference
+ * matters. The release store publishes the slot contents (or frees the
+ * slot) before the other side can observe the new counter.
+ */
+
+size_t SensorEventQueue::room() const
+{
+    uint32_t tail = android_atomic_acquire_load(&mTail);
+    return mMask + 1 - (uint32_t(mHead) - tail);
+}
+
+bool SensorEventQueue::push(sensors_event_t const& event)
+{
+    if (!room())
+        return false;
+    uint32_t head = mHead;
+    mBuffer[head & mMask] = event;
+    android_atomic_release_store(head + 1, &mHead);
+    return true;
+}
+
+size_t SensorEventQueue::available() const
+{
+    uint32_t head = android_atomic_acquire_load(&mHead);
+    return head - uint32_t(mTail);
+}
+
+sensors_event_t const* SensorEventQueue::front() const
+{
+    return &mBuffer[uint32_t(mTail) & mMask];
+}
+
+void SensorEventQueue::pop()
+{
+    android_atomic_release_store(uint32_t(mTail) + 1, &mTail);
+}
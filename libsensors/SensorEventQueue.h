@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SENSOR_EVENT_QUEUE_H
+#define ANDROID_SENSOR_EVENT_QUEUE_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+/*****************************************************************************/
+
+struct sensors_event_t;
+
+/*
+ * Lock-free single producer / single consumer ring of sensor events.
+ * push() must only be called from the producer thread, front()/pop()
+ * only from the consumer thread. The size is rounded up to a power of 2.
+ */
+class SensorEventQueue
+{
+    sensors_event_t* mBuffer;
+    uint32_t mMask;
+    volatile int32_t mHead;     // written by the producer
+    volatile int32_t mTail;     // written by the consumer
+
+public:
+    SensorEventQueue(size_t numEvents);
+    ~SensorEventQueue();
+
+    // producer side
+    size_t room() const;
+    bool push(sensors_event_t const& event);
+
+    // consumer side
+    size_t available() const;
+    sensors_event_t const* front() const;
+    void pop();
+};
+
+/*****************************************************************************/
+
+#endif  // ANDROID_SENSOR_EVENT_QUEUE_H
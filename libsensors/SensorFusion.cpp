@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include "SensorFusion.h"
+
+#define TAG "[Fusion] "
+
+/* Time constant of the gravity low-pass filter. Without a gyroscope the
+ * attitude is blended towards the accel/mag measurement with the same
+ * constant, with one it only corrects the gyro drift. */
+#define GRAVITY_TAU         0.20f
+#define GYRO_CORRECTION_TAU 2.0f
+
+/* don't integrate across gaps, e.g. after the gyro was off */
+#define MAX_DT              0.2f
+
+/*****************************************************************************/
+
+static inline float dot3(float const* a, float const* b) {
+    return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+static inline void cross3(float* r, float const* a, float const* b) {
+    r[0] = a[1]*b[2] - a[2]*b[1];
+    r[1] = a[2]*b[0] - a[0]*b[2];
+    r[2] = a[0]*b[1] - a[1]*b[0];
+}
+
+static inline bool normalize3(float* v) {
+    float n = sqrtf(dot3(v, v));
+    if (n < 1e-6f)
+        return false;
+    n = 1.0f / n;
+    v[0] *= n; v[1] *= n; v[2] *= n;
+    return true;
+}
+
+static inline void normalize4(float* q) {
+    float n = 1.0f / sqrtf(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+    q[0] *= n; q[1] *= n; q[2] *= n; q[3] *= n;
+}
+
+/* q = {x, y, z, w}, nlerp towards m by k, on the shortest arc */
+static void blend4(float* q, float const* m, float k) {
+    float d = q[0]*m[0] + q[1]*m[1] + q[2]*m[2] + q[3]*m[3];
+    float s = d < 0 ? -k : k;
+    for (int i=0 ; i<4 ; i++)
+        q[i] = q[i]*(1.0f - k) + m[i]*s;
+    normalize4(q);
+}
+
+/*****************************************************************************/
+
+SensorFusion::SensorFusion()
+    : SensorBase(NULL, NULL),
+      mEnabled(0),
+      mPendingMask(0),
+      mHaveGravity(false),
+      mHaveMagnetic(false),
+      mHaveQuat(false),
+      mAccelTime(0),
+      mGyroTime(0)
+{
+    memset(mPendingEvents, 0, sizeof(mPendingEvents));
+
+    mPendingEvents[RotationVector].version = sizeof(sensors_event_t);
+    mPendingEvents[RotationVector].sensor = ID_RV;
+    mPendingEvents[RotationVector].type = SENSOR_TYPE_ROTATION_VECTOR;
+
+    mPendingEvents[Gravity].version = sizeof(sensors_event_t);
+    mPendingEvents[Gravity].sensor = ID_GR;
+    mPendingEvents[Gravity].type = SENSOR_TYPE_GRAVITY;
+    mPendingEvents[Gravity].acceleration.status = SENSOR_STATUS_ACCURACY_HIGH;
+
+    mPendingEvents[LinearAcceleration].version = sizeof(sensors_event_t);
+    mPendingEvents[LinearAcceleration].sensor = ID_LA;
+    mPendingEvents[LinearAcceleration].type = SENSOR_TYPE_LINEAR_ACCELERATION;
+    mPendingEvents[LinearAcceleration].acceleration.status = SENSOR_STATUS_ACCURACY_HIGH;
+}
+
+SensorFusion::~SensorFusion()
+{
+}
+
+int SensorFusion::enable(int32_t handle, int en)
+{
+    int what = -1;
+
+    switch (handle) {
+        case ID_RV: what = RotationVector;     break;
+        case ID_GR: what = Gravity;            break;
+        case ID_LA: what = LinearAcceleration; break;
+    }
+
+    if (uint32_t(what) >= numSensors)
+        return -EINVAL;
+
+    ALOGV(TAG "%s(%d,%d)", __FUNCTION__, handle, en);
+
+    uint32_t previous = mEnabled;
+    if (en)
+        mEnabled |= 1<<what;
+    else
+        mEnabled &= ~(1<<what);
+
+    if (!previous && mEnabled) {
+        // start over, the inputs were possibly off for a long time
+        mHaveGravity = mHaveMagnetic = mHaveQuat = false;
+        mAccelTime = mGyroTime = 0;
+    } else if (!(previous & (1<<RotationVector)) && (mEnabled & (1<<RotationVector))) {
+        // the magnetic field and the gyro only run for the rotation vector
+        mHaveMagnetic = mHaveQuat = false;
+        mGyroTime = 0;
+    }
+    mPendingMask &= mEnabled;
+    return 0;
+}
+
+uint32_t SensorFusion::inputs() const
+{
+    if (!mEnabled)
+        return 0;
+    // gravity and linear acceleration only low pass the accelerometer
+    uint32_t mask = 1<<ID_A;
+    if (mEnabled & (1<<RotationVector))
+        mask |= (1<<ID_M) | (1<<ID_GY);
+    return mask;
+}
+
+bool SensorFusion::hasPendingEvents() const
+{
+    return mPendingMask != 0;
+}
+
+int SensorFusion::readEvents(sensors_event_t* data, int count)
+{
+    if (count < 1)
+        return -EINVAL;
+
+    int numEventReceived = 0;
+    for (int j=0 ; count && mPendingMask && j<numSensors ; j++) {
+        if (mPendingMask & (1<<j)) {
+            mPendingMask &= ~(1<<j);
+            *data++ = mPendingEvents[j];
+            count--;
+            numEventReceived++;
+        }
+    }
+    return numEventReceived;
+}
+
+void SensorFusion::process(sensors_event_t const& event)
+{
+    if (!mEnabled)
+        return;
+
+    switch (event.sensor) {
+        case ID_A:
+            processAccel(event);
+            break;
+        case ID_M:
+            mMagnetic[0] = event.magnetic.x;
+            mMagnetic[1] = event.magnetic.y;
+            mMagnetic[2] = event.magnetic.z;
+            mHaveMagnetic = true;
+            break;
+        case ID_GY:
+            processGyro(event);
+            break;
+    }
+}
+
+/*
+ * Attitude from gravity and the magnetic field, same convention as
+ * SensorManager.getRotationMatrix(): the rows of R are East, North and
+ * Up in device coordinates. Returns the device->world quaternion.
+ */
+bool SensorFusion::measureAttitude(float* q) const
+{
+    if (!mHaveGravity || !mHaveMagnetic)
+        return false;
+
+    float A[3] = { mGravity[0], mGravity[1], mGravity[2] };
+    float H[3], M[3];
+    cross3(H, mMagnetic, A);
+    if (!normalize3(H) || !normalize3(A))
+        return false;   // free fall, or next to a magnet
+    cross3(M, A, H);
+
+    float const tr = H[0] + M[1] + A[2];
+    if (tr > 0) {
+        float s = 0.5f / sqrtf(tr + 1.0f);
+        q[3] = 0.25f / s;
+        q[0] = (A[1] - M[2]) * s;
+        q[1] = (H[2] - A[0]) * s;
+        q[2] = (M[0] - H[1]) * s;
+    } else if (H[0] > M[1] && H[0] > A[2]) {
+        float s = 2.0f * sqrtf(1.0f + H[0] - M[1] - A[2]);
+        q[3] = (A[1] - M[2]) / s;
+        q[0] = 0.25f * s;
+        q[1] = (H[1] + M[0]) / s;
+        q[2] = (H[2] + A[0]) / s;
+    } else if (M[1] > A[2]) {
+        float s = 2.0f * sqrtf(1.0f + M[1] - H[0] - A[2]);
+        q[3] = (H[2] - A[0]) / s;
+        q[0] = (H[1] + M[0]) / s;
+        q[1] = 0.25f * s;
+        q[2] = (M[2] + A[1]) / s;
+    } else {
+        float s = 2.0f * sqrtf(1.0f + A[2] - H[0] - M[1]);
+        q[3] = (M[0] - H[1]) / s;
+        q[0] = (H[2] + A[0]) / s;
+        q[1] = (M[2] + A[1]) / s;
+        q[2] = 0.25f * s;
+    }
+    normalize4(q);
+    return true;
+}
+
+void SensorFusion::processAccel(sensors_event_t const& event)
+{
+    float const a[3] = {
+        event.acceleration.x, event.acceleration.y, event.acceleration.z
+    };
+
+    float dt = mAccelTime ? (event.timestamp - mAccelTime) * 1e-9f : 0;
+    mAccelTime = event.timestamp;
+
+    if (!mHaveGravity || dt <= 0 || dt > MAX_DT) {
+        mGravity[0] = a[0];
+        mGravity[1] = a[1];
+        mGravity[2] = a[2];
+        mHaveGravity = true;
+    } else {
+        float const k = dt / (GRAVITY_TAU + dt);
+        for (int i=0 ; i<3 ; i++)
+            mGravity[i] += k * (a[i] - mGravity[i]);
+    }
+
+    float m[4];
+    if (measureAttitude(m)) {
+        if (!mHaveQuat || dt <= 0 || dt > MAX_DT) {
+            memcpy(mQuat, m, sizeof(mQuat));
+            mHaveQuat = true;
+        } else {
+            // with a gyro the measurement only slowly corrects the drift
+            float tau = mGyroTime ? GYRO_CORRECTION_TAU : GRAVITY_TAU;
+            blend4(mQuat, m, dt / (tau + dt));
+        }
+    }
+
+    sensors_event_t& la(mPendingEvents[LinearAcceleration]);
+    la.acceleration.x = a[0] - mGravity[0];
+    la.acceleration.y = a[1] - mGravity[1];
+    la.acceleration.z = a[2] - mGravity[2];
+
+    publish(event.timestamp);
+}
+
+/*
+ * Integrate the body rates into the attitude: dq/dt = 1/2 q * (w, 0)
+ */
+void SensorFusion::processGyro(sensors_event_t const& event)
+{
+    float dt = mGyroTime ? (event.timestamp - mGyroTime) * 1e-9f : 0;
+    mGyroTime = event.timestamp;
+    if (!mHaveQuat || dt <= 0 || dt > MAX_DT)
+        return;
+
+    float const wx = event.gyro.x * 0.5f * dt;
+    float const wy = event.gyro.y * 0.5f * dt;
+    float const wz = event.gyro.z * 0.5f * dt;
+    float const x = mQuat[0], y = mQuat[1], z = mQuat[2], w = mQuat[3];
+
+    mQuat[0] = x + ( w*wx + y*wz - z*wy);
+    mQuat[1] = y + ( w*wy + z*wx - x*wz);
+    mQuat[2] = z + ( w*wz + x*wy - y*wx);
+    mQuat[3] = w + (-x*wx - y*wy - z*wz);
+    normalize4(mQuat);
+}
+
+void SensorFusion::publish(int64_t time)
+{
+    if (mEnabled & (1<<Gravity)) {
+        sensors_event_t& g(mPendingEvents[Gravity]);
+        float n = sqrtf(dot3(mGravity, mGravity));
+        float s = n > 1e-6f ? GRAVITY_EARTH / n : 0;
+        g.acceleration.x = mGravity[0] * s;
+        g.acceleration.y = mGravity[1] * s;
+        g.acceleration.z = mGravity[2] * s;
+        g.timestamp = time;
+        mPendingMask |= 1<<Gravity;
+    }
+    if (mEnabled & (1<<LinearAcceleration)) {
+        mPendingEvents[LinearAcceleration].timestamp = time;
+        mPendingMask |= 1<<LinearAcceleration;
+    }
+    if ((mEnabled & (1<<RotationVector)) && mHaveQuat) {
+        sensors_event_t& rv(mPendingEvents[RotationVector]);
+        // w >= 0 so data[0..2] alone define the rotation
+        float s = mQuat[3] < 0 ? -1.0f : 1.0f;
+        rv.data[0] = mQuat[0] * s;
+        rv.data[1] = mQuat[1] * s;
+        rv.data[2] = mQuat[2] * s;
+        rv.data[3] = mQuat[3] * s;
+        rv.timestamp = time;
+        mPendingMask |= 1<<RotationVector;
+    }
+}
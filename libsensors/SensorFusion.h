@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SENSOR_FUSION_H
+#define ANDROID_SENSOR_FUSION_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include "sensors.h"
+#include "SensorBase.h"
+
+/*****************************************************************************/
+
+/*
+ * Rotation vector, gravity and linear acceleration computed from the
+ * accelerometer, magnetic field and (when present) gyroscope events. It
+ * has no fd of its own: the poll context feeds it the physical events
+ * with process() and collects the results with readEvents().
+ */
+class SensorFusion : public SensorBase {
+public:
+            SensorFusion();
+    virtual ~SensorFusion();
+
+    enum {
+        RotationVector      = 0,
+        Gravity             = 1,
+        LinearAcceleration  = 2,
+        numSensors
+    };
+
+    virtual int readEvents(sensors_event_t* data, int count);
+    virtual bool hasPendingEvents() const;
+    virtual int enable(int32_t handle, int enabled);
+
+    void process(sensors_event_t const& event);
+    // (1<<ID_x) mask of the physical sensors the enabled outputs need
+    uint32_t inputs() const;
+
+private:
+    uint32_t mEnabled;
+    uint32_t mPendingMask;
+    sensors_event_t mPendingEvents[numSensors];
+
+    float mGravity[3];
+    float mMagnetic[3];
+    float mQuat[4];
+    bool mHaveGravity;
+    bool mHaveMagnetic;
+    bool mHaveQuat;
+    int64_t mAccelTime;
+    int64_t mGyroTime;
+
+    void processAccel(sensors_event_t const& event);
+    void processGyro(sensors_event_t const& event);
+    bool measureAttitude(float* q) const;
+    void publish(int64_t time);
+};
+
+/*****************************************************************************/
+
+#endif  // ANDROID_SENSOR_FUSION_H
@@ -16,6 +16,9 @@
 
 #define LOG_TAG "Sensors"
 //#define LOG_NDEBUG 0
+// JB 4.1 has no HAL trace tag: the sensors trace under the "gfx" category,
+// next to the SurfaceFlinger frames they feed
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 
 #include <hardware/sensors.h>
 #include <fcntl.h>
@@ -25,11 +28,16 @@
 #include <poll.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <linux/input.h>
 
 #include <utils/Atomic.h>
 #include <utils/Log.h>
+#include <utils/Trace.h>
+
+#include <cutils/properties.h>
 
 #include "sensors.h"
 
@@ -37,16 +45,50 @@
 #include "ProximitySensor.h"
 
 #include "AkmSensor.h"      /* akm8975 */
+#include "AK8975Sensor.h"   /* akm8975 without libakm */
 
 #include "KXTFSensor.h" 
 #include "GyroSensor.h"
 #include "NctSensor.h"
+#include "SensorFusion.h"
+
+#include "BatchBuffer.h"
+#include "SensorEventQueue.h"
 
 /*****************************************************************************/
 
+/* systrace through the Tracer of the JB 4.1 utils/Trace.h, toggled at
+ * runtime by debug.atrace.tags.enableflags */
+#define TRACE_BEGIN(name)   android::Tracer::traceBegin(ATRACE_TAG, name)
+#define TRACE_END()         android::Tracer::traceEnd(ATRACE_TAG)
+
 #define DELAY_OUT_TIME 0x7FFFFFFF
 
-#define LIGHT_SENSOR_POLLTIME    2000000000
+/* software batching: samples kept per sensor, and the max report latency
+ * applied when the framework has no batch() call (ms, 0 = disabled) */
+#define BATCH_BUFFER_SIZE        512
+#define BATCH_LATENCY_PROPERTY   "hw.sensor.batch_latency"
+
+/* optional mode where every driver is drained by its own reader thread
+ * into a lock-free queue, pollEvents() only merges the queues */
+#define READER_THREADS_PROPERTY  "hw.sensor.reader_threads"
+#define READER_QUEUE_SIZE        256
+#define READER_CHUNK_SIZE        16
+
+/* rate the fusion inputs run at, at least, unless the sensor advertises a
+ * longer minDelay: see fusionDelay() */
+#define FUSION_DELAY             20000000LL
+
+/* in-call policy: while the audio HAL is in call (CALL_STATE_FILE) and the
+ * proximity sensor is covered, the sensors of the table are slowed down to
+ * the given delay or suspended. The property holds the table as a list of
+ * <sensor>:<ms|off> entries, "1" selects CALL_POLICY_DEFAULT and "0" or
+ * unset disables the policy. */
+#define CALL_POLICY_PROPERTY     "hw.sensor.call_policy"
+#define CALL_POLICY_DEFAULT      "accel:200,magnetic:off,orientation:off,gyro:off," \
+                                 "light:off,temperature:off,rotation:off,gravity:off,linear:off"
+#define CALL_POLICY_SUSPEND      (-1LL)
+#define CALL_STATE_FILE          "/data/misc/audio/call_state"
 
 
 #define SENSORS_ACCELERATION     (1<<ID_A)
@@ -64,6 +106,9 @@
 #define SENSORS_ORIENTATION_HANDLE      (SENSORS_HANDLE_BASE + SENSOR_TYPE_ORIENTATION)
 #define SENSORS_GYROSCOPE_HANDLE        (SENSORS_HANDLE_BASE + SENSOR_TYPE_GYROSCOPE)
 #define SENSORS_TEMPERATURE_HANDLE      (SENSORS_HANDLE_BASE + SENSOR_TYPE_TEMPERATURE)
+#define SENSORS_ROTATION_VECTOR_HANDLE  (SENSORS_HANDLE_BASE + SENSOR_TYPE_ROTATION_VECTOR)
+#define SENSORS_GRAVITY_HANDLE          (SENSORS_HANDLE_BASE + SENSOR_TYPE_GRAVITY)
+#define SENSORS_LINEAR_ACCEL_HANDLE     (SENSORS_HANDLE_BASE + SENSOR_TYPE_LINEAR_ACCELERATION)
 
 #define AKM_FTRACE 0
 #define AKM_DEBUG 0
@@ -75,6 +120,7 @@
 #define USE_KXT
 //#define USE_MPU
 #define USE_NCT
+#define USE_FUSION
 
 /*****************************************************************************/
 
@@ -114,6 +160,20 @@ static struct sensor_t sSensorList[] = {
       1, SENSORS_TEMPERATURE_HANDLE,
           SENSOR_TYPE_TEMPERATURE, 127.0f, 1.0f, 0.240f, 500000, { }
     },
+#endif
+#ifdef USE_FUSION
+    { "Rotation Vector sensor", "AOSP",
+      1, SENSORS_ROTATION_VECTOR_HANDLE,
+          SENSOR_TYPE_ROTATION_VECTOR, 1.0f, 1.0f / (1<<24), 0.23f + 6.8f, 50000, { }
+    },
+    { "Gravity sensor", "AOSP",
+      1, SENSORS_GRAVITY_HANDLE,
+          SENSOR_TYPE_GRAVITY, GRAVITY_EARTH, KXTF9_CONVERT_A, 0.23f, 50000, { }
+    },
+    { "Linear Acceleration sensor", "AOSP",
+      1, SENSORS_LINEAR_ACCEL_HANDLE,
+          SENSOR_TYPE_LINEAR_ACCELERATION, RANGE_A, KXTF9_CONVERT_A, 0.23f, 50000, { }
+    },
 #endif
     { "CM3663 Proximity sensor", "Capella Microsystems",
       1, SENSORS_PROXIMITY_HANDLE,
@@ -153,13 +213,19 @@ struct sensors_module_t HAL_MODULE_INFO_SYM = {
 };
 
 struct sensors_poll_context_t {
+#ifdef SENSORS_DEVICE_API_VERSION_1_0
+    struct sensors_poll_device_1 device; // must be first
+#else
     struct sensors_poll_device_t device; // must be first
+#endif
 
         sensors_poll_context_t();
         ~sensors_poll_context_t();
     int activate(int handle, int enabled);
     int setDelay(int handle, int64_t ns);
     int pollEvents(sensors_event_t* data, int count);
+    int batch(int handle, int flags, int64_t period_ns, int64_t timeout);
+    int flush(int handle);
 
 private:
     enum {
@@ -178,10 +244,103 @@ private:
     };
 
     static const size_t wake = numFds - 1;
-    static const char WAKE_MESSAGE = 'W';
-    struct pollfd mPollFds[numFds];
-    int mWritePipeFd;
+    int mEpollFd;
+    int mWakeFd;
+    // one bit per driver: its fd was reported readable and not drained
+    // yet, or it has pending events of its own
+    uint32_t mReadyMask;
     SensorBase* mSensors[numSensorDrivers];
+    // systrace section and counter names of the drivers, see readDrivers()
+    static const char* const sTraceRead[numSensorDrivers];
+    static const char* const sTraceCount[numSensorDrivers];
+
+    // batched sensors, see handleToBatch()
+    enum {
+        batchAccel      = 0,
+        batchMagnetic,
+        batchOrientation,
+        numBatchBuffers,
+    };
+
+    // protects the batch buffers, pollEvents() runs on its own thread
+    pthread_mutex_t mBatchLock;
+    BatchBuffer* mBatch[numBatchBuffers];
+    volatile int32_t mFlushMask;
+
+    // per-driver reader threads, only used when mThreaded is set
+    struct ReaderThread {
+        sensors_poll_context_t* ctx;
+        SensorBase* sensor;
+        int driver;
+        SensorEventQueue* queue;
+        pthread_t thread;
+        bool started;           // thread is valid, to be joined
+        int ctlFd;
+        volatile int32_t exitPending;
+        int32_t overruns;
+    };
+    bool mThreaded;
+    ReaderThread mReaders[numSensorDrivers];
+
+    void startReaders();
+    void stopReaders();
+    static void* readerLoop(void* arg);
+    int readDrivers(sensors_event_t* data, int count);
+    int dequeueEvents(sensors_event_t* data, int count);
+
+    // virtual sensors, fed from the physical events in pollEvents()
+    enum { numHandles = 32 };
+    SensorFusion* mFusion;
+    SensorAK8975* mCompass;     // native compass, NULL with libakm
+    uint32_t mUserEnabled;
+    int64_t mUserDelay[numHandles];
+
+    uint32_t inputs() const;
+    void updateFusionInputs(uint32_t previous);
+    int fuseEvents(sensors_event_t* data, int nb, int count);
+
+    // in-call policy, see applyCallPolicy(). mControlLock serializes the
+    // driver controls of activate() and setDelay() with the poll thread, and
+    // the fusion and compass state and mUserEnabled they change with the
+    // events fed to them in pollEvents()
+    pthread_mutex_t mControlLock;
+    int64_t mPolicyDelay[numHandles];   // 0: no rule
+    bool mPolicyEnabled;
+    bool mPolicyEngaged;
+    bool mProximityNear;
+    float mProximityRange;
+    uint32_t mSuspendMask;              // (1<<handle) held while engaged
+
+    int activate_l(int handle, int enabled);
+    int setDelay_l(int handle, int64_t ns);
+    void loadCallPolicy();
+    void trackProximity(sensors_event_t const* data, int nb);
+    void applyCallPolicy(bool engage);
+    int64_t policyDelay(int handle, int64_t ns) const;
+    int64_t driverDelay(int handle) const;
+    int suspendEvents(sensors_event_t* data, int nb);
+
+    static bool isFusionHandle(int handle) {
+        return handle == ID_RV || handle == ID_GR || handle == ID_LA;
+    }
+
+    void registerFds();
+    void wakeUp();
+    int batchEvents(sensors_event_t* data, int count, int64_t now);
+    int drainBatches(sensors_event_t* data, int count, int64_t now);
+    int batchTimeout(int64_t now);
+
+    static int handleToBatch(int handle) {
+        switch (handle) {
+            case ID_A:
+                return batchAccel;
+            case ID_M:
+                return batchMagnetic;
+            case ID_O:
+                return batchOrientation;
+        }
+        return -EINVAL;
+    }
 
     int handleToDriver(int handle) const {
         switch (handle) {
@@ -209,123 +368,884 @@ private:
 
 /*****************************************************************************/
 
+/*
+ * readEvents() of the drivers runs in a systrace section and the number of
+ * events returned goes to a counter, so that sensor latency can be lined up
+ * with the scheduler. Enabled at runtime with the "gfx" atrace category.
+ */
+const char* const sensors_poll_context_t::sTraceRead[numSensorDrivers] = {
+    "light readEvents",
+#ifdef USE_MPU
+    "mpu readEvents",
+#endif
+    "kxt readEvents",
+    "akm readEvents",
+#ifdef USE_NCT
+    "nct readEvents",
+#endif
+    "proximity readEvents",
+};
+
+const char* const sensors_poll_context_t::sTraceCount[numSensorDrivers] = {
+    "light events",
+#ifdef USE_MPU
+    "mpu events",
+#endif
+    "kxt events",
+    "akm events",
+#ifdef USE_NCT
+    "nct events",
+#endif
+    "proximity events",
+};
+
 sensors_poll_context_t::sensors_poll_context_t()
 {
     mSensors[light] = new LightSensor();
-    mPollFds[light].fd = mSensors[light]->getFd();
-    mPollFds[light].events = POLLIN;
-    mPollFds[light].revents = 0;
-
 #ifdef USE_MPU
     mSensors[mpu] = new GyroSensor();
-    mPollFds[mpu].fd = mSensors[mpu]->getFd();
-    mPollFds[mpu].events = POLLIN;
-    mPollFds[mpu].revents = 0;
 #endif
-
     mSensors[kxt] = new KXTFSensor();
-    mPollFds[kxt].fd = mSensors[kxt]->getFd();
-    mPollFds[kxt].events = POLLIN;
-    mPollFds[kxt].revents = 0;
-
-    mSensors[akm] = new AkmSensor();
-    mPollFds[akm].fd = mSensors[akm]->getFd();
-    mPollFds[akm].events = POLLIN;
-    mPollFds[akm].revents = 0;
-
+    char value[PROPERTY_VALUE_MAX];
+    property_get("hw.sensor.libakm.disable", value, "0");
+    if (!strcmp(value, "true") || !strncmp(value, "1", 1)) {
+        ALOGI("libakm disabled, using the native AK8975 driver");
+        mCompass = new SensorAK8975();
+        mSensors[akm] = mCompass;
+    } else {
+        mCompass = NULL;
+        mSensors[akm] = new AkmSensor();
+    }
 #ifdef USE_NCT
     mSensors[nct] = new NctSensor();
-    mPollFds[nct].fd = mSensors[nct]->getFd();
-    mPollFds[nct].events = POLLIN;
-    mPollFds[nct].revents = 0;
 #endif
-
     mSensors[proximity] = new ProximitySensor();
-    mPollFds[proximity].fd = mSensors[proximity]->getFd();
-    mPollFds[proximity].events = POLLIN;
-    mPollFds[proximity].revents = 0;
 
-    int wakeFds[2];
-    int result = pipe(wakeFds);
-    ALOGE_IF(result<0, "error creating wake pipe (%s)", strerror(errno));
-    fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
-    fcntl(wakeFds[1], F_SETFL, O_NONBLOCK);
-    mWritePipeFd = wakeFds[1];
+    SensorBase::releaseInputRegistry();
+
+    mFusion = new SensorFusion();
+    mUserEnabled = 0;
+    for (int i=0 ; i<numHandles ; i++) {
+        mUserDelay[i] = FUSION_DELAY;
+    }
+    pthread_mutex_init(&mControlLock, NULL);
+    loadCallPolicy();
+
+    mEpollFd = epoll_create(numFds);
+    ALOGE_IF(mEpollFd<0, "error creating epoll fd (%s)", strerror(errno));
 
-    mPollFds[wake].fd = wakeFds[0];
-    mPollFds[wake].events = POLLIN;
-    mPollFds[wake].revents = 0;
+    mWakeFd = eventfd(0, EFD_NONBLOCK);
+    ALOGE_IF(mWakeFd<0, "error creating wake eventfd (%s)", strerror(errno));
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = wake;
+    int result = epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeFd, &ev);
+    ALOGE_IF(result<0, "error adding wake fd to epoll (%s)", strerror(errno));
+
+    property_get(READER_THREADS_PROPERTY, value, "0");
+    mThreaded = atoi(value) != 0;
+
+    mReadyMask = 0;
+    if (mThreaded) {
+        startReaders();
+    } else {
+        registerFds();
+    }
+
+    property_get(BATCH_LATENCY_PROPERTY, value, "0");
+    int64_t latency = atoi(value) * 1000000LL;
+    ALOGI_IF(latency > 0, "batching enabled, max report latency %lld ms",
+            latency / 1000000LL);
+
+    pthread_mutex_init(&mBatchLock, NULL);
+    mFlushMask = 0;
+    for (int i=0 ; i<numBatchBuffers ; i++) {
+        mBatch[i] = new BatchBuffer(BATCH_BUFFER_SIZE);
+        mBatch[i]->setLatency(latency);
+    }
 }
 
 sensors_poll_context_t::~sensors_poll_context_t() {
+    if (mThreaded) {
+        stopReaders();
+    }
     for (int i=0 ; i<numSensorDrivers ; i++) {
         delete mSensors[i];
     }
-    close(mPollFds[wake].fd);
-    close(mWritePipeFd);
+    delete mFusion;
+    for (int i=0 ; i<numBatchBuffers ; i++) {
+        delete mBatch[i];
+    }
+    pthread_mutex_destroy(&mBatchLock);
+    pthread_mutex_destroy(&mControlLock);
+    close(mWakeFd);
+    close(mEpollFd);
+}
+
+static int64_t monotonicNow()
+{
+    struct timespec t;
+    t.tv_sec = t.tv_nsec = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return int64_t(t.tv_sec)*1000000000LL + t.tv_nsec;
+}
+
+/*
+ * Delay a physical sensor runs at for the fusion: FUSION_DELAY, or the
+ * minDelay of the sensor when it does not go that fast.
+ */
+static int64_t fusionDelay(int handle)
+{
+    for (size_t i=0 ; i<ARRAY_SIZE(sSensorList) ; i++) {
+        if (sSensorList[i].handle == handle &&
+                sSensorList[i].minDelay * 1000LL > FUSION_DELAY) {
+            return sSensorList[i].minDelay * 1000LL;
+        }
+    }
+    return FUSION_DELAY;
+}
+
+void sensors_poll_context_t::startReaders()
+{
+    for (int i=0 ; i<numSensorDrivers ; i++) {
+        ReaderThread& r(mReaders[i]);
+        r.ctx = this;
+        r.sensor = mSensors[i];
+        r.driver = i;
+        r.queue = new SensorEventQueue(READER_QUEUE_SIZE);
+        r.ctlFd = eventfd(0, EFD_NONBLOCK);
+        r.exitPending = 0;
+        r.overruns = 0;
+        int err = pthread_create(&r.thread, NULL, readerLoop, &r);
+        ALOGE_IF(err, "error creating reader thread %d (%s)", i, strerror(err));
+        r.started = !err;
+    }
+    ALOGI("reader threads enabled");
+}
+
+void sensors_poll_context_t::stopReaders()
+{
+    for (int i=0 ; i<numSensorDrivers ; i++) {
+        ReaderThread& r(mReaders[i]);
+        if (r.started) {
+            android_atomic_release_store(1, &r.exitPending);
+            eventfd_write(r.ctlFd, 1);
+            pthread_join(r.thread, NULL);
+            r.started = false;
+        }
+        close(r.ctlFd);
+        delete r.queue;
+    }
+}
+
+/*
+ * Body of a reader thread: wait for the driver fd (or for the control
+ * eventfd, the fd of some drivers changes on enable), read the events out
+ * and queue them for pollEvents(). The driver is only ever read from this
+ * thread, exactly like pollEvents() does in the default mode.
+ */
+void* sensors_poll_context_t::readerLoop(void* arg)
+{
+    ReaderThread* const r(static_cast<ReaderThread*>(arg));
+    SensorBase* const sensor(r->sensor);
+    sensors_event_t buffer[READER_CHUNK_SIZE];
+
+    while (!android_atomic_acquire_load(&r->exitPending)) {
+        struct pollfd fds[2];
+        fds[0].fd = sensor->getFd();
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = r->ctlFd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        int n = poll(fds, 2, sensor->hasPendingEvents() ? 0 : -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("reader poll() failed (%s)", strerror(errno));
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            eventfd_t value;
+            eventfd_read(r->ctlFd, &value);
+        }
+        if (!(fds[0].revents & (POLLIN | POLLERR | POLLHUP)) &&
+                !sensor->hasPendingEvents()) {
+            continue;
+        }
+
+        TRACE_BEGIN(sTraceRead[r->driver]);
+        int nb = sensor->readEvents(buffer, READER_CHUNK_SIZE);
+        TRACE_END();
+        ATRACE_INT(sTraceCount[r->driver], nb);
+        int queued = 0;
+        for (int i=0 ; i<nb ; i++) {
+            if (r->queue->push(buffer[i])) {
+                queued++;
+            } else if (!r->overruns++) {
+                // the poll thread is not keeping up, drop the newest
+                ALOGW("reader queue overrun");
+            }
+        }
+        if (queued) {
+            r->ctx->wakeUp();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Default mode: service the drivers which are ready, or have leftovers
+ * from the last epoll_wait(), straight from this thread.
+ */
+int sensors_poll_context_t::readDrivers(sensors_event_t* data, int count)
+{
+    int nbEvents = 0;
+    uint32_t mask = mReadyMask;
+    while (count && mask) {
+        int i = __builtin_ctz(mask);
+        mask &= ~(1<<i);
+        SensorBase* const sensor(mSensors[i]);
+        ALOGV("read sensor %d", i);
+        TRACE_BEGIN(sTraceRead[i]);
+        int nb = sensor->readEvents(data, count);
+        TRACE_END();
+        ATRACE_INT(sTraceCount[i], nb);
+        if (nb < count && !sensor->hasPendingEvents()) {
+            // no more data for this sensor
+            mReadyMask &= ~(1<<i);
+        }
+        if (nb < 0) {
+            continue;
+        }
+        count -= nb;
+        nbEvents += nb;
+        data += nb;
+    }
+    return nbEvents;
+}
+
+/*
+ * Threaded mode: merge the reader queues by timestamp.
+ */
+int sensors_poll_context_t::dequeueEvents(sensors_event_t* data, int count)
+{
+    int nbEvents = 0;
+    while (nbEvents < count) {
+        SensorEventQueue* next = NULL;
+        for (int i=0 ; i<numSensorDrivers ; i++) {
+            SensorEventQueue* const queue(mReaders[i].queue);
+            if (queue->available() &&
+                    (!next || queue->front()->timestamp < next->front()->timestamp)) {
+                next = queue;
+            }
+        }
+        if (!next)
+            break;
+        data[nbEvents++] = *next->front();
+        next->pop();
+    }
+    return nbEvents;
+}
+
+void sensors_poll_context_t::wakeUp()
+{
+    int result = eventfd_write(mWakeFd, 1);
+    ALOGE_IF(result<0, "error sending wake event (%s)", strerror(errno));
+}
+
+/*
+ * (Re)register the driver fds with epoll and pick up drivers which have
+ * pending events. Some drivers only open their device while enabled, so
+ * this runs again on every wake-up; EEXIST just means the fd is already
+ * being watched. Only called from the poll thread and the constructor.
+ */
+void sensors_poll_context_t::registerFds()
+{
+    for (int i=0 ; i<numSensorDrivers ; i++) {
+        SensorBase* const sensor(mSensors[i]);
+        int fd = sensor->getFd();
+        if (fd >= 0) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u32 = i;
+            if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST) {
+                ALOGE("error adding sensor %d fd to epoll (%s)", i, strerror(errno));
+            }
+        }
+        if (sensor->hasPendingEvents()) {
+            mReadyMask |= 1<<i;
+        }
+    }
 }
 
 int sensors_poll_context_t::activate(int handle, int enabled) {
+    pthread_mutex_lock(&mControlLock);
+    int err = activate_l(handle, enabled);
+    pthread_mutex_unlock(&mControlLock);
+    return err;
+}
+
+int sensors_poll_context_t::activate_l(int handle, int enabled) {
+    if (isFusionHandle(handle)) {
+        if (enabled) {
+            mUserEnabled |= 1<<handle;
+        } else {
+            mUserEnabled &= ~(1<<handle);
+        }
+        if (enabled && (mSuspendMask & (1<<handle))) {
+            // held until the in-call policy lets go
+            return 0;
+        }
+        uint32_t previous = inputs();
+        int err = mFusion->enable(handle, enabled);
+        if (!err) {
+            updateFusionInputs(previous);
+        }
+        return err;
+    }
+
     int index = handleToDriver(handle);
     if (index < 0) return index;
-    int err =  mSensors[index]->enable(handle, enabled);
-    if (enabled && !err) {
-        const char wakeMessage(WAKE_MESSAGE);
-        int result = write(mWritePipeFd, &wakeMessage, 1);
-        ALOGE_IF(result<0, "error sending wake message (%s)", strerror(errno));
+    if (enabled) {
+        mUserEnabled |= 1<<handle;
+    } else {
+        mUserEnabled &= ~(1<<handle);
+    }
+
+    uint32_t previous = inputs();
+    int err = 0;
+    if (!enabled && (previous & (1<<handle))) {
+        // still feeding the fusion, keep it running at the fusion rate
+        mSensors[index]->setDelay(handle, policyDelay(handle, fusionDelay(handle)));
+    } else if ((mSuspendMask & (1<<handle)) && !(previous & (1<<handle))) {
+        // stopped by the in-call policy, started again when it lets go
+    } else {
+        err = mSensors[index]->enable(handle, enabled);
+        if (!err && enabled && mPolicyEngaged && mPolicyDelay[handle] > 0) {
+            mSensors[index]->setDelay(handle, driverDelay(handle));
+        }
+    }
+    if (handle == ID_P && !enabled) {
+        mProximityNear = false;
+        if (mPolicyEngaged) {
+            applyCallPolicy(false);
+        }
+    }
+    if (!err && mCompass && index == akm) {
+        // the compass orientation may need the accelerometer
+        updateFusionInputs(previous);
+    }
+    if (!enabled && handleToBatch(handle) >= 0) {
+        // hand out what was batched before the sensor went away
+        flush(handle);
+    } else if (enabled && !err) {
+        if (mThreaded) {
+            eventfd_write(mReaders[index].ctlFd, 1);
+        } else {
+            wakeUp();
+        }
     }
     return err;
 }
 
 int sensors_poll_context_t::setDelay(int handle, int64_t ns) {
+    pthread_mutex_lock(&mControlLock);
+    int err = setDelay_l(handle, ns);
+    pthread_mutex_unlock(&mControlLock);
+    return err;
+}
+
+int sensors_poll_context_t::setDelay_l(int handle, int64_t ns) {
 
+    if (isFusionHandle(handle)) {
+        // the fusion runs at the rate of its inputs
+        return 0;
+    }
     int index = handleToDriver(handle);
     if (index < 0) return index;
-    return mSensors[index]->setDelay(handle, ns);
+    mUserDelay[handle] = ns;
+    if ((inputs() & (1<<handle)) && ns > fusionDelay(handle)) {
+        ns = fusionDelay(handle);
+    }
+    return mSensors[index]->setDelay(handle, policyDelay(handle, ns));
+}
+
+/*
+ * (1<<ID_x) mask of the physical sensors needed by the fusion and by the
+ * native compass orientation.
+ */
+uint32_t sensors_poll_context_t::inputs() const
+{
+    uint32_t mask = mFusion->inputs();
+    if (mCompass) {
+        mask |= mCompass->inputs();
+    }
+    return mask;
+}
+
+/*
+ * Start or stop the physical sensors the fusion needs. A sensor enabled
+ * for the fusion only is not reported to the framework, see fuseEvents().
+ */
+void sensors_poll_context_t::updateFusionInputs(uint32_t previous)
+{
+    static const int handles[] = { ID_A, ID_M, ID_GY };
+    uint32_t const current = inputs();
+
+    for (size_t i=0 ; i<ARRAY_SIZE(handles) ; i++) {
+        int const handle = handles[i];
+        int const index = handleToDriver(handle);
+        if (index < 0)
+            continue;   // no such sensor in this build
+        uint32_t const bit = 1<<handle;
+        // a sensor suspended by the in-call policy only runs for the fusion
+        bool const user = mUserEnabled & ~mSuspendMask & bit;
+        if ((current & bit) && !(previous & bit)) {
+            if (!user) {
+                mSensors[index]->enable(handle, 1);
+            }
+            int64_t const fusion = fusionDelay(handle);
+            int64_t ns = user ? mUserDelay[handle] : fusion;
+            mSensors[index]->setDelay(handle,
+                    policyDelay(handle, ns > fusion ? fusion : ns));
+            if (mThreaded) {
+                eventfd_write(mReaders[index].ctlFd, 1);
+            } else {
+                wakeUp();
+            }
+        } else if (!(current & bit) && (previous & bit)) {
+            if (user) {
+                mSensors[index]->setDelay(handle, policyDelay(handle, mUserDelay[handle]));
+            } else {
+                mSensors[index]->enable(handle, 0);
+            }
+        }
+    }
+}
+
+static const struct {
+    const char* name;
+    int handle;
+} sPolicyNames[] = {
+    { "accel",          ID_A  },
+    { "magnetic",       ID_M  },
+    { "orientation",    ID_O  },
+    { "gyro",           ID_GY },
+    { "light",          ID_L  },
+    { "temperature",    ID_T  },
+    { "rotation",       ID_RV },
+    { "gravity",        ID_GR },
+    { "linear",         ID_LA },
+};
+
+void sensors_poll_context_t::loadCallPolicy()
+{
+    mPolicyEnabled = false;
+    mPolicyEngaged = false;
+    mProximityNear = false;
+    mSuspendMask = 0;
+    for (int i=0 ; i<numHandles ; i++) {
+        mPolicyDelay[i] = 0;
+    }
+    mProximityRange = 0;
+    for (size_t i=0 ; i<ARRAY_SIZE(sSensorList) ; i++) {
+        if (sSensorList[i].type == SENSOR_TYPE_PROXIMITY) {
+            mProximityRange = sSensorList[i].maxRange;
+        }
+    }
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get(CALL_POLICY_PROPERTY, value, "0");
+    if (!strcmp(value, "0")) {
+        return;
+    }
+    char table[sizeof(CALL_POLICY_DEFAULT) > PROPERTY_VALUE_MAX ?
+            sizeof(CALL_POLICY_DEFAULT) : PROPERTY_VALUE_MAX];
+    strlcpy(table, strcmp(value, "1") ? value : CALL_POLICY_DEFAULT, sizeof(table));
+    ALOGI("in-call sensor policy: %s", table);
+
+    char* save;
+    for (char* entry = strtok_r(table, ",", &save) ; entry ;
+            entry = strtok_r(NULL, ",", &save)) {
+        char* rule = strchr(entry, ':');
+        if (rule) {
+            *rule++ = '\0';
+        }
+        int handle = -1;
+        for (size_t i=0 ; i<ARRAY_SIZE(sPolicyNames) ; i++) {
+            if (!strcmp(entry, sPolicyNames[i].name)) {
+                handle = sPolicyNames[i].handle;
+            }
+        }
+        if (handle < 0 || !rule) {
+            ALOGW("in-call sensor policy: bad entry '%s'", entry);
+            continue;
+        }
+        if (!strcmp(rule, "off")) {
+            mPolicyDelay[handle] = CALL_POLICY_SUSPEND;
+        } else if (atoi(rule) > 0) {
+            mPolicyDelay[handle] = atoi(rule) * 1000000LL;
+        }
+        mPolicyEnabled |= mPolicyDelay[handle] != 0;
+    }
+}
+
+static bool inCall()
+{
+    char state = '0';
+    int fd = open(CALL_STATE_FILE, O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &state, 1) != 1) {
+            state = '0';
+        }
+        close(fd);
+    }
+    return state == '1';
+}
+
+/*
+ * Watch the proximity events going out: the call state is only looked at
+ * when the sensor gets covered, the policy lets go as soon as it is not.
+ */
+void sensors_poll_context_t::trackProximity(sensors_event_t const* data, int nb)
+{
+    for (int i=0 ; i<nb ; i++) {
+        if (data[i].sensor != ID_P)
+            continue;
+        bool const near = data[i].distance < mProximityRange;
+        if (near == mProximityNear)
+            continue;
+        pthread_mutex_lock(&mControlLock);
+        mProximityNear = near;
+        bool const engage = near && inCall();
+        if (engage != mPolicyEngaged) {
+            applyCallPolicy(engage);
+        }
+        pthread_mutex_unlock(&mControlLock);
+    }
+}
+
+/*
+ * Slow down or stop the sensors of the policy table, or bring them back to
+ * what the framework and the fusion asked for. A suspended sensor the
+ * fusion needs keeps running for it, its own events are dropped by
+ * suspendEvents(). Called with mControlLock held.
+ */
+void sensors_poll_context_t::applyCallPolicy(bool engage)
+{
+    static const int handles[] = { ID_A, ID_M, ID_O, ID_GY, ID_L, ID_T };
+    static const int virtuals[] = { ID_RV, ID_GR, ID_LA };
+
+    ALOGI("in-call sensor policy %s", engage ? "engaged" : "released");
+    mPolicyEngaged = engage;
+    mSuspendMask = 0;
+    if (engage) {
+        for (int i=0 ; i<numHandles ; i++) {
+            if (mPolicyDelay[i] == CALL_POLICY_SUSPEND) {
+                mSuspendMask |= 1<<i;
+            }
+        }
+        for (size_t i=0 ; i<ARRAY_SIZE(virtuals) ; i++) {
+            int const handle = virtuals[i];
+            if ((mSuspendMask & mUserEnabled) & (1<<handle)) {
+                uint32_t previous = inputs();
+                mFusion->enable(handle, 0);
+                updateFusionInputs(previous);
+            }
+        }
+    }
+
+    uint32_t const needed = inputs();
+    for (size_t i=0 ; i<ARRAY_SIZE(handles) ; i++) {
+        int const handle = handles[i];
+        int const index = handleToDriver(handle);
+        uint32_t const bit = 1<<handle;
+        if (index < 0 || !mPolicyDelay[handle])
+            continue;
+        if (mPolicyDelay[handle] == CALL_POLICY_SUSPEND &&
+                (mUserEnabled & bit) && !(needed & bit)) {
+            mSensors[index]->enable(handle, !engage);
+            if (!engage) {
+                mSensors[index]->setDelay(handle, mUserDelay[handle]);
+                if (mThreaded) {
+                    eventfd_write(mReaders[index].ctlFd, 1);
+                } else {
+                    wakeUp();
+                }
+            }
+        } else if ((mUserEnabled | needed) & bit) {
+            mSensors[index]->setDelay(handle, driverDelay(handle));
+        }
+    }
+
+    if (!engage) {
+        for (size_t i=0 ; i<ARRAY_SIZE(virtuals) ; i++) {
+            int const handle = virtuals[i];
+            if ((mPolicyDelay[handle] == CALL_POLICY_SUSPEND) && (mUserEnabled & (1<<handle))) {
+                uint32_t previous = inputs();
+                mFusion->enable(handle, 1);
+                updateFusionInputs(previous);
+            }
+        }
+    }
+}
+
+int64_t sensors_poll_context_t::policyDelay(int handle, int64_t ns) const
+{
+    if (mPolicyEngaged && mPolicyDelay[handle] > ns) {
+        return mPolicyDelay[handle];
+    }
+    return ns;
+}
+
+/*
+ * Delay the driver of a physical sensor runs at for the framework, the
+ * fusion and the in-call policy.
+ */
+int64_t sensors_poll_context_t::driverDelay(int handle) const
+{
+    int64_t const fusion = fusionDelay(handle);
+    int64_t ns = (mUserEnabled & ~mSuspendMask & (1<<handle)) ? mUserDelay[handle] : fusion;
+    if ((inputs() & (1<<handle)) && ns > fusion) {
+        ns = fusion;
+    }
+    return policyDelay(handle, ns);
+}
+
+/*
+ * Drop the events of the sensors suspended by the in-call policy, returns
+ * the new number of events at data.
+ */
+int sensors_poll_context_t::suspendEvents(sensors_event_t* data, int nb)
+{
+    int kept = 0;
+    for (int i=0 ; i<nb ; i++) {
+        if (mSuspendMask & (1<<data[i].sensor))
+            continue;
+        if (kept != i)
+            data[kept] = data[i];
+        kept++;
+    }
+    return kept;
+}
+
+/*
+ * Feed the nb physical events at data to the fusion, drop the ones the
+ * framework did not ask for, and append what the fusion produced as far
+ * as count allows. Returns the new number of events at data. Called with
+ * mControlLock held.
+ */
+int sensors_poll_context_t::fuseEvents(sensors_event_t* data, int nb, int count)
+{
+    uint32_t const needed = inputs();
+    if (!needed)
+        return nb;
+
+    int kept = 0;
+    for (int i=0 ; i<nb ; i++) {
+        uint32_t const bit = 1<<data[i].sensor;
+        if (needed & bit) {
+            mFusion->process(data[i]);
+            if (mCompass && data[i].sensor == ID_A) {
+                mCompass->processAccel(data[i]);
+            }
+            if (!(mUserEnabled & bit))
+                continue;
+        }
+        if (kept != i)
+            data[kept] = data[i];
+        kept++;
+    }
+    if (kept < count && mFusion->hasPendingEvents()) {
+        kept += mFusion->readEvents(data + kept, count - kept);
+    }
+    return kept;
+}
+
+/*
+ * There is no hardware FIFO behind any of these sensors, batching is done
+ * in software: the samples still wake up the CPU, but the framework is
+ * only woken up once per max report latency.
+ */
+int sensors_poll_context_t::batch(int handle, int flags, int64_t period_ns, int64_t timeout)
+{
+    if (handleToDriver(handle) < 0 && !isFusionHandle(handle)) return -EINVAL;
+    int b = handleToBatch(handle);
+    if (b < 0 && timeout > 0) return -EINVAL;
+#ifdef SENSORS_BATCH_DRY_RUN
+    if (flags & SENSORS_BATCH_DRY_RUN) return 0;
+#endif
+    int err = setDelay(handle, period_ns);
+    if (b >= 0) {
+        pthread_mutex_lock(&mBatchLock);
+        int64_t previous = mBatch[b]->latency();
+        mBatch[b]->setLatency(timeout);
+        pthread_mutex_unlock(&mBatchLock);
+        if (timeout < previous) {
+            // the queued samples may be due earlier now
+            flush(handle);
+        }
+    }
+    return err;
+}
+
+int sensors_poll_context_t::flush(int handle)
+{
+    int b = handleToBatch(handle);
+    if (b < 0) return -EINVAL;
+    android_atomic_or(1<<b, &mFlushMask);
+    wakeUp();
+    return 0;
+}
+
+/*
+ * Move the events of batched sensors into their buffers, the remaining
+ * events are packed at the start of data. Returns the remaining count.
+ */
+int sensors_poll_context_t::batchEvents(sensors_event_t* data, int count, int64_t now)
+{
+    int kept = 0;
+    pthread_mutex_lock(&mBatchLock);
+    for (int i=0 ; i<count ; i++) {
+        int b = handleToBatch(data[i].sensor);
+        if (b >= 0 && mBatch[b]->latency() > 0) {
+            if (!mBatch[b]->push(data[i], now)) {
+                ALOGW("batch buffer %d overrun", b);
+            }
+        } else {
+            if (kept != i)
+                data[kept] = data[i];
+            kept++;
+        }
+    }
+    pthread_mutex_unlock(&mBatchLock);
+    return kept;
+}
+
+/*
+ * Hand out the buffers which are due, full, or asked to be flushed.
+ */
+int sensors_poll_context_t::drainBatches(sensors_event_t* data, int count, int64_t now)
+{
+    int32_t flushMask = android_atomic_and(0, &mFlushMask);
+    int nb = 0;
+    pthread_mutex_lock(&mBatchLock);
+    for (int b=0 ; b<numBatchBuffers && nb<count ; b++) {
+        BatchBuffer* const buffer(mBatch[b]);
+        if (buffer->empty())
+            continue;
+        if ((flushMask & (1<<b)) || buffer->full() || buffer->deadline() <= now) {
+            nb += buffer->drain(data + nb, count - nb);
+            if (!buffer->empty()) {
+                // out of room, keep it due for the next call
+                android_atomic_or(1<<b, &mFlushMask);
+            }
+        }
+    }
+    pthread_mutex_unlock(&mBatchLock);
+    return nb;
+}
+
+/*
+ * epoll_wait() timeout in ms until the next batch is due, or -1.
+ */
+int sensors_poll_context_t::batchTimeout(int64_t now)
+{
+    int64_t next = -1;
+    pthread_mutex_lock(&mBatchLock);
+    for (int b=0 ; b<numBatchBuffers ; b++) {
+        int64_t deadline = mBatch[b]->deadline();
+        if (deadline >= 0 && (next < 0 || deadline < next))
+            next = deadline;
+    }
+    pthread_mutex_unlock(&mBatchLock);
+    if (next < 0)
+        return -1;
+    if (next <= now)
+        return 0;
+    return int((next - now + 999999) / 1000000);
 }
 
 int sensors_poll_context_t::pollEvents(sensors_event_t* data, int count)
 {
+    struct epoll_event events[numFds];
     int nbEvents = 0;
     int n = 0;
 
     do {
-        // see if we have some leftover from the last poll()
-        for (int i=0 ; count && i<numSensorDrivers ; i++) {
-            SensorBase* const sensor(mSensors[i]);
-            if ((mPollFds[i].revents & POLLIN) || (sensor->hasPendingEvents())) {
-                ALOGV("read sensor %d", i);
-                int nb = sensor->readEvents(data, count);
-                if (nb < count) {
-                    // no more data for this sensor
-                    mPollFds[i].revents = 0;
-                }
-                count -= nb;
-                nbEvents += nb;
-                data += nb;
+        TRACE_BEGIN("pollEvents");
+        int64_t now = monotonicNow();
+        int nbBatched = drainBatches(data, count, now);
+        count -= nbBatched;
+        nbEvents += nbBatched;
+        data += nbBatched;
+
+        pthread_mutex_lock(&mControlLock);
+        if (count && mFusion->hasPendingEvents()) {
+            // left over from the last call for lack of room
+            int nb = mFusion->readEvents(data, count);
+            if (mSuspendMask) {
+                nb = suspendEvents(data, nb);
+            }
+            count -= nb;
+            nbEvents += nb;
+            data += nb;
+        }
+        pthread_mutex_unlock(&mControlLock);
+
+        if (count) {
+            int nb = mThreaded ? dequeueEvents(data, count) : readDrivers(data, count);
+            if (mPolicyEnabled) {
+                trackProximity(data, nb);
+            }
+            pthread_mutex_lock(&mControlLock);
+            nb = fuseEvents(data, nb, count);
+            if (mSuspendMask) {
+                nb = suspendEvents(data, nb);
             }
+            pthread_mutex_unlock(&mControlLock);
+            nb = batchEvents(data, nb, now);
+            count -= nb;
+            nbEvents += nb;
+            data += nb;
         }
+        TRACE_END();
 
         if (count) {
             // we still have some room, so try to see if we can get
             // some events immediately or just wait if we don't have
             // anything to return
-            n = poll(mPollFds, numFds, nbEvents ? 0 : -1);
+            n = epoll_wait(mEpollFd, events, numFds,
+                    nbEvents ? 0 : batchTimeout(now));
             if (n<0) {
-                ALOGE("poll() failed (%s)", strerror(errno));
+                if (errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                ALOGE("epoll_wait() failed (%s)", strerror(errno));
                 return -errno;
             }
-            if (mPollFds[wake].revents & POLLIN) {
-                char msg;
-                int result = read(mPollFds[wake].fd, &msg, 1);
-                ALOGE_IF(result<0, "error reading from wake pipe (%s)", strerror(errno));
-                ALOGE_IF(msg != WAKE_MESSAGE, "unknown message on wake queue (0x%02x)", int(msg));
-                mPollFds[wake].revents = 0;
+            for (int j=0 ; j<n ; j++) {
+                uint32_t i = events[j].data.u32;
+                if (i == wake) {
+                    eventfd_t value;
+                    int result = eventfd_read(mWakeFd, &value);
+                    ALOGE_IF(result<0, "error reading from wake eventfd (%s)", strerror(errno));
+                    if (!mThreaded) {
+                        registerFds();
+                    }
+                } else if (events[j].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                    mReadyMask |= 1<<i;
+                }
             }
         }
         // if we have events and space, go read them
-    } while (n && count);
+    } while ((n || nbEvents == 0) && count);
 
+    ATRACE_INT("pollEvents batch", nbEvents);
     return nbEvents;
 }
 
@@ -358,6 +1278,14 @@ static int poll__poll(struct sensors_poll_device_t *dev,
     return ctx->pollEvents(data, count);
 }
 
+#ifdef SENSORS_DEVICE_API_VERSION_1_0
+static int poll__batch(struct sensors_poll_device_1 *dev,
+        int handle, int flags, int64_t period_ns, int64_t timeout) {
+    sensors_poll_context_t *ctx = (sensors_poll_context_t *)dev;
+    return ctx->batch(handle, flags, period_ns, timeout);
+}
+#endif
+
 /*****************************************************************************/
 
 /** Open a new instance of a sensor device using name */
@@ -367,10 +1295,15 @@ static int open_sensors(const struct hw_module_t* module, const char* id,
         int status = -EINVAL;
         sensors_poll_context_t *dev = new sensors_poll_context_t();
 
-        memset(&dev->device, 0, sizeof(sensors_poll_device_t));
+        memset(&dev->device, 0, sizeof(dev->device));
 
         dev->device.common.tag      = HARDWARE_DEVICE_TAG;
+#ifdef SENSORS_DEVICE_API_VERSION_1_0
+        dev->device.common.version  = SENSORS_DEVICE_API_VERSION_1_0;
+        dev->device.batch           = poll__batch;
+#else
         dev->device.common.version  = 0;
+#endif
         dev->device.common.module   = const_cast<hw_module_t*>(module);
         dev->device.common.close    = poll__close;
         dev->device.activate        = poll__activate;
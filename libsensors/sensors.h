@@ -41,6 +41,11 @@ __BEGIN_DECLS
 #define ID_GY (SENSOR_TYPE_GYROSCOPE)
 #define ID_T  (SENSOR_TYPE_TEMPERATURE)
 
+// virtual sensors computed by SensorFusion
+#define ID_RV (SENSOR_TYPE_ROTATION_VECTOR)
+#define ID_GR (SENSOR_TYPE_GRAVITY)
+#define ID_LA (SENSOR_TYPE_LINEAR_ACCELERATION)
+
 /*****************************************************************************/
 
 /*
@@ -0,0 +1,496 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * sensors_bench: runs the sensors HAL without the framework. The HAL sources
+ * are linked in, the module is opened through HAL_MODULE_INFO_SYM like
+ * hw_get_module() would, and the given handles are enabled at the given
+ * rates. For every handle the delivered rate and the latency from the event
+ * timestamp to the return of poll() are reported, along with the syscalls,
+ * context switches and CPU time the whole HAL spent per event. The replay
+ * threads below are not counted.
+ *
+ * In replay mode (-r) a driver reads a recorded stream of input_event
+ * (as in "cat /dev/input/eventN > file") from a pipe instead of its input
+ * device. The stream is played back at its recorded pace with the event
+ * times rewritten to CLOCK_MONOTONIC at the moment of the write.
+ *
+ * usage: sensors_bench [-l] [-t seconds] [-r input_name=file]... handle[@hz]...
+ */
+
+#define LOG_TAG "sensors_bench"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <linux/input.h>
+
+#include <hardware/sensors.h>
+
+#include "sensors.h"
+#include "SensorBase.h"
+
+/*****************************************************************************/
+
+#define MAX_HANDLES         32
+#define MAX_REPLAYS         8
+#define POLL_BUFFER_SIZE    16
+#define DEFAULT_DURATION_S  10
+#define DEFAULT_DELAY_NS    200000000LL     // SENSOR_DELAY_NORMAL
+#define REPLAY_FRAME_SIZE   64
+
+extern struct sensors_module_t HAL_MODULE_INFO_SYM;
+
+struct HandleStats {
+    const sensor_t* sensor;
+    int64_t delay;
+    int64_t count;
+    int64_t* latency;
+    size_t maxLatency;
+};
+
+struct Replay {
+    const char* inputName;
+    const char* path;
+    int fd;                     // write end of the pipe the driver reads
+    pthread_t thread;
+    // with sLock held
+    pid_t tid;
+    int64_t cpuNs;              // CPU time of the replay thread so far
+    long long syscallsStart;    // its read/write syscalls at sSyscallsStart
+    int64_t events;
+};
+
+static HandleStats sStats[MAX_HANDLES];
+static Replay sReplays[MAX_REPLAYS];
+static int sNumReplays;
+
+// the totals, only touched by the poll loop and by the watchdog with sLock held,
+// and the replay threads
+static pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t sStart;
+static int64_t sEnd;
+static int64_t sPollCalls;
+static struct rusage sUsageStart;
+static long long sSyscallsStart;
+
+static int64_t clockNow(clockid_t clock)
+{
+    struct timespec t;
+    t.tv_sec = t.tv_nsec = 0;
+    clock_gettime(clock, &t);
+    return int64_t(t.tv_sec)*1000000000LL + t.tv_nsec;
+}
+
+static int64_t timevalNs(struct timeval const& t)
+{
+    return int64_t(t.tv_sec)*1000000000LL + t.tv_usec*1000LL;
+}
+
+/* read and write syscalls so far, from the task io accounting of the whole
+ * process or, with a tid, of one thread */
+static long long syscallCount(pid_t tid = 0)
+{
+    char path[64];
+    if (tid) {
+        snprintf(path, sizeof(path), "/proc/self/task/%d/io", tid);
+    } else {
+        strcpy(path, "/proc/self/io");
+    }
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    char line[64];
+    long long value, total = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "syscr: %lld", &value) == 1 ||
+                sscanf(line, "syscw: %lld", &value) == 1) {
+            total += value;
+        }
+    }
+    fclose(fp);
+    return total;
+}
+
+/*****************************************************************************/
+
+/*
+ * A replay thread that is done stays around until the end of the run: report()
+ * subtracts its syscalls, which /proc/self/task/<tid>/io only has while alive.
+ */
+static void* idleReplay()
+{
+    for (;;) {
+        pause();
+    }
+    return NULL;
+}
+
+/*
+ * Plays a recorded input_event stream into the pipe of a driver, one frame
+ * (up to SYN_REPORT) per write, each at its recorded offset from the first.
+ */
+static void* replayLoop(void* arg)
+{
+    Replay* const r(static_cast<Replay*>(arg));
+    // before any syscall of ours that the accounting would see
+    pthread_mutex_lock(&sLock);
+    r->tid = gettid();
+    pthread_mutex_unlock(&sLock);
+
+    FILE* fp = fopen(r->path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "can't open %s (%s)\n", r->path, strerror(errno));
+        return idleReplay();
+    }
+
+    input_event frame[REPLAY_FRAME_SIZE];
+    size_t n = 0;
+    int64_t recordStart = -1, replayStart = 0;
+    while (fread(&frame[n], sizeof(frame[n]), 1, fp) == 1) {
+        bool const syn = frame[n].type == EV_SYN;
+        n++;
+        if (!syn && n < REPLAY_FRAME_SIZE)
+            continue;
+
+        int64_t const recorded = timevalNs(frame[n-1].time);
+        if (recordStart < 0) {
+            recordStart = recorded;
+            replayStart = clockNow(CLOCK_MONOTONIC);
+        }
+        int64_t const due = replayStart + (recorded - recordStart);
+        struct timespec ts;
+        ts.tv_sec = due / 1000000000LL;
+        ts.tv_nsec = due % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+
+        int64_t const now = clockNow(CLOCK_MONOTONIC);
+        for (size_t i=0 ; i<n ; i++) {
+            frame[i].time.tv_sec = now / 1000000000LL;
+            frame[i].time.tv_usec = (now % 1000000000LL) / 1000;
+        }
+        if (write(r->fd, frame, n * sizeof(frame[0])) < 0) {
+            fprintf(stderr, "replay of %s stopped (%s)\n", r->inputName, strerror(errno));
+            break;
+        }
+        int64_t const cpu = clockNow(CLOCK_THREAD_CPUTIME_ID);
+        pthread_mutex_lock(&sLock);
+        r->events += n;
+        r->cpuNs = cpu;
+        pthread_mutex_unlock(&sLock);
+        n = 0;
+    }
+    fclose(fp);
+    return idleReplay();
+}
+
+static int startReplay(const char* spec)
+{
+    if (sNumReplays >= MAX_REPLAYS) {
+        fprintf(stderr, "too many replays\n");
+        return -1;
+    }
+    const char* eq = strchr(spec, '=');
+    if (eq == NULL || eq == spec || !eq[1]) {
+        fprintf(stderr, "bad replay '%s', expected input_name=file\n", spec);
+        return -1;
+    }
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        fprintf(stderr, "pipe failed (%s)\n", strerror(errno));
+        return -1;
+    }
+    // the readers fill() until EAGAIN, like with the input devices
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    Replay& r(sReplays[sNumReplays++]);
+    r.inputName = strndup(spec, eq - spec);
+    r.path = eq + 1;
+    r.fd = fds[1];
+    r.tid = 0;
+    r.cpuNs = 0;
+    r.syscallsStart = 0;
+    r.events = 0;
+    SensorBase::setInputOverride(r.inputName, fds[0]);
+    return 0;
+}
+
+/*****************************************************************************/
+
+static int compareLatency(const void* a, const void* b)
+{
+    int64_t const x = *static_cast<const int64_t*>(a);
+    int64_t const y = *static_cast<const int64_t*>(b);
+    return x < y ? -1 : x > y;
+}
+
+static int64_t percentile(const int64_t* sorted, int64_t count, int pct)
+{
+    if (!count)
+        return 0;
+    int64_t i = (count * pct) / 100;
+    return sorted[i < count ? i : count - 1];
+}
+
+/*
+ * The drivers stamp their events with either CLOCK_MONOTONIC or the evdev
+ * CLOCK_REALTIME: measure against whichever is closest.
+ */
+static int64_t eventLatency(int64_t timestamp, int64_t monotonic, int64_t realtime)
+{
+    int64_t const m = monotonic - timestamp;
+    int64_t const r = realtime - timestamp;
+    return llabs(m) <= llabs(r) ? m : r;
+}
+
+static void recordEvent(sensors_event_t const& event, int64_t monotonic, int64_t realtime)
+{
+    if (event.sensor < 0 || event.sensor >= MAX_HANDLES)
+        return;
+    HandleStats& s(sStats[event.sensor]);
+    if (size_t(s.count) >= s.maxLatency) {
+        size_t size = s.maxLatency ? s.maxLatency * 2 : 1024;
+        int64_t* latency = static_cast<int64_t*>(realloc(s.latency, size * sizeof(int64_t)));
+        if (latency == NULL)
+            return;
+        s.latency = latency;
+        s.maxLatency = size;
+    }
+    s.latency[s.count++] = eventLatency(event.timestamp, monotonic, realtime);
+}
+
+/* called with sLock held */
+static void report()
+{
+    int64_t const elapsed = clockNow(CLOCK_MONOTONIC) - sStart;
+    int64_t total = 0;
+
+    printf("%-40s %9s %9s %8s %8s %8s %8s %8s\n", "sensor", "req Hz", "got Hz",
+            "events", "p50 us", "p90 us", "p99 us", "max us");
+    for (int h=0 ; h<MAX_HANDLES ; h++) {
+        HandleStats& s(sStats[h]);
+        if (!s.sensor)
+            continue;
+        qsort(s.latency, s.count, sizeof(int64_t), compareLatency);
+        printf("%-40.40s %9.1f %9.1f %8lld %8lld %8lld %8lld %8lld\n", s.sensor->name,
+                s.delay ? 1e9 / s.delay : 0.0,
+                elapsed ? s.count * 1e9 / elapsed : 0.0,
+                s.count,
+                percentile(s.latency, s.count, 50) / 1000,
+                percentile(s.latency, s.count, 90) / 1000,
+                percentile(s.latency, s.count, 99) / 1000,
+                s.count ? s.latency[s.count - 1] / 1000 : 0LL);
+        total += s.count;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    int64_t cpu = (usage.ru_utime.tv_sec - sUsageStart.ru_utime.tv_sec) * 1000000000LL +
+            (usage.ru_utime.tv_usec - sUsageStart.ru_utime.tv_usec) * 1000LL +
+            (usage.ru_stime.tv_sec - sUsageStart.ru_stime.tv_sec) * 1000000000LL +
+            (usage.ru_stime.tv_usec - sUsageStart.ru_stime.tv_usec) * 1000LL;
+    for (int i=0 ; i<sNumReplays ; i++) {
+        cpu -= sReplays[i].cpuNs;
+    }
+    long csw = (usage.ru_nvcsw - sUsageStart.ru_nvcsw) +
+            (usage.ru_nivcsw - sUsageStart.ru_nivcsw);
+    long long syscalls = syscallCount();
+    for (int i=0 ; i<sNumReplays && syscalls >= 0 ; i++) {
+        if (sReplays[i].tid) {
+            long long const replay = syscallCount(sReplays[i].tid);
+            syscalls = replay >= 0 ? syscalls - (replay - sReplays[i].syscallsStart) : -1;
+        }
+    }
+
+    printf("\n%lld events in %.2f s, %lld poll calls (%.2f events/call)\n",
+            total, elapsed / 1e9, sPollCalls, sPollCalls ? double(total) / sPollCalls : 0.0);
+    if (total) {
+        if (syscalls >= 0 && sSyscallsStart >= 0) {
+            printf("read/write syscalls per event: %.2f\n",
+                    double(syscalls - sSyscallsStart) / total);
+        }
+        printf("context switches per event: %.2f\n", double(csw) / total);
+        printf("CPU time per 1000 events: %.3f ms\n", cpu / 1e6 / total * 1000);
+    }
+    for (int i=0 ; i<sNumReplays ; i++) {
+        printf("replayed %lld input events into %s\n", sReplays[i].events,
+                sReplays[i].inputName);
+    }
+    fflush(stdout);
+}
+
+/*
+ * poll() does not return without events: if the sensors have gone quiet,
+ * report from here once past the deadline.
+ */
+static void* watchdogLoop(void*)
+{
+    int64_t const due = sEnd + 1000000000LL;
+    struct timespec ts;
+    ts.tv_sec = due / 1000000000LL;
+    ts.tv_nsec = due % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+    pthread_mutex_lock(&sLock);
+    printf("(no events since the end of the run)\n");
+    report();
+    _exit(0);
+    return NULL;
+}
+
+/*****************************************************************************/
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: sensors_bench [-l] [-t seconds] [-r input_name=file]... handle[@hz]...\n"
+            "  -l                    list the sensors and exit\n"
+            "  -t seconds            length of the run (%d)\n"
+            "  -r input_name=file    feed the driver of input device input_name\n"
+            "                        from a recorded input_event stream\n"
+            "  handle[@hz]           enable handle at hz (at its minimum delay if omitted)\n",
+            DEFAULT_DURATION_S);
+}
+
+int main(int argc, char** argv)
+{
+    int duration = DEFAULT_DURATION_S;
+    bool list = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "lt:r:")) != -1) {
+        switch (opt) {
+            case 'l':
+                list = true;
+                break;
+            case 't':
+                duration = atoi(optarg);
+                break;
+            case 'r':
+                if (startReplay(optarg) < 0)
+                    return 1;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    sensors_module_t* module = &HAL_MODULE_INFO_SYM;
+    sensor_t const* sensors;
+    int numSensors = module->get_sensors_list(module, &sensors);
+
+    if (list || optind >= argc) {
+        for (int i=0 ; i<numSensors ; i++) {
+            printf("%3d  %-40s min delay %d us\n", sensors[i].handle,
+                    sensors[i].name, sensors[i].minDelay);
+        }
+        if (!list)
+            usage();
+        return list ? 0 : 1;
+    }
+
+    hw_device_t* device;
+    int err = module->common.methods->open(&module->common, SENSORS_HARDWARE_POLL, &device);
+    if (err) {
+        fprintf(stderr, "can't open the sensors device (%d)\n", err);
+        return 1;
+    }
+    sensors_poll_device_t* dev = reinterpret_cast<sensors_poll_device_t*>(device);
+
+    // the drivers hold the read ends now
+    for (int i=0 ; i<sNumReplays ; i++) {
+        pthread_create(&sReplays[i].thread, NULL, replayLoop, &sReplays[i]);
+    }
+
+    for (int a=optind ; a<argc ; a++) {
+        char* at;
+        int handle = strtol(argv[a], &at, 0);
+        sensor_t const* sensor = NULL;
+        for (int i=0 ; i<numSensors ; i++) {
+            if (sensors[i].handle == handle)
+                sensor = &sensors[i];
+        }
+        if (!sensor || handle < 0 || handle >= MAX_HANDLES || (*at && *at != '@')) {
+            fprintf(stderr, "unknown handle '%s'\n", argv[a]);
+            return 1;
+        }
+        int64_t delay = sensor->minDelay > 0 ? sensor->minDelay * 1000LL : DEFAULT_DELAY_NS;
+        if (*at == '@' && atof(at + 1) > 0) {
+            delay = int64_t(1e9 / atof(at + 1));
+        }
+        sStats[handle].sensor = sensor;
+        sStats[handle].delay = delay;
+        if (dev->activate(dev, handle, 1) || dev->setDelay(dev, handle, delay)) {
+            fprintf(stderr, "can't enable %s\n", sensor->name);
+        }
+    }
+
+    pthread_mutex_lock(&sLock);
+    getrusage(RUSAGE_SELF, &sUsageStart);
+    sSyscallsStart = syscallCount();
+    for (int i=0 ; i<sNumReplays ; i++) {
+        if (sReplays[i].tid) {
+            sReplays[i].syscallsStart = syscallCount(sReplays[i].tid);
+        }
+    }
+    sStart = clockNow(CLOCK_MONOTONIC);
+    sEnd = sStart + duration * 1000000000LL;
+    pthread_mutex_unlock(&sLock);
+
+    pthread_t watchdog;
+    pthread_create(&watchdog, NULL, watchdogLoop, NULL);
+
+    sensors_event_t buffer[POLL_BUFFER_SIZE];
+    for (;;) {
+        int n = dev->poll(dev, buffer, POLL_BUFFER_SIZE);
+        int64_t const monotonic = clockNow(CLOCK_MONOTONIC);
+        int64_t const realtime = clockNow(CLOCK_REALTIME);
+        if (n < 0) {
+            fprintf(stderr, "poll failed (%d)\n", n);
+            break;
+        }
+        pthread_mutex_lock(&sLock);
+        sPollCalls++;
+        for (int i=0 ; i<n ; i++) {
+            recordEvent(buffer[i], monotonic, realtime);
+        }
+        bool const done = monotonic >= sEnd;
+        if (done) {
+            report();
+        }
+        pthread_mutex_unlock(&sLock);
+        if (done)
+            break;
+    }
+
+    for (int h=0 ; h<MAX_HANDLES ; h++) {
+        if (sStats[h].sensor)
+            dev->activate(dev, h, 0);
+    }
+    // the replay threads may still be blocked on their pipes
+    _exit(0);
+    return 0;
+}
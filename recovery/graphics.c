@@ -19,6 +19,7 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <time.h>
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -38,30 +39,73 @@
 
 #include "minui.h"
 
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC _IOW('F', 0x20, __u32)
+#endif
+
+/* a third buffer is used when the framebuffer memory and the driver allow it */
+#define GR_MAX_FRAMEBUFFERS 3
+
+/* a pan older than this has been latched by a vsync already */
+#define GR_FRAME_NS 20000000LL
+
+/* a horizontal run of set pixels in one row of a glyph */
+typedef struct {
+    unsigned char x;
+    unsigned char len;
+} GRSpan;
+
 typedef struct {
     GGLSurface texture;
     unsigned cwidth;
     unsigned cheight;
     unsigned ascent;
+    /* the glyphs rasterised as runs: row r of character c (from ' ') has the
+     * runs span[span_index[c * cheight + r]] up to span_index[... + 1] */
+    GRSpan *span;
+    unsigned short *span_index;
 } GRFont;
 
 static GRFont *gr_font = 0;
 static GGLContext *gr_context = 0;
 static GGLSurface gr_font_texture;
-static GGLSurface gr_framebuffer[2];
+static GGLSurface gr_framebuffer[GR_MAX_FRAMEBUFFERS];
 static GGLSurface gr_mem_surface;
 static unsigned gr_active_fb = 0;
+static unsigned gr_fb_count = 2;
+/* FBIO_WAITFORVSYNC is supported by the driver */
+static int gr_vsync = 1;
+static long long gr_pan_ns = 0;
 
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
 
 static struct fb_var_screeninfo vi;
 
+/* rows drawn since the last flip, and for each framebuffer the rows changed
+ * since it was last made active */
+static int gr_dirty_top, gr_dirty_bottom;
+static int gr_fb_dirty_top[GR_MAX_FRAMEBUFFERS], gr_fb_dirty_bottom[GR_MAX_FRAMEBUFFERS];
+/* set once the memory surface has been handed out by gr_fb_data(): it can then
+ * change behind our back and every flip copies it all. Rows are counted in the
+ * memory surface, before any BOARD_HAS_FLIPPED_SCREEN rotation. */
+static int gr_dirty_all = 0;
+
+/* last gr_color(), as drawn on the RGB565 memory surface */
+static unsigned short gr_color565 = 0;
+static unsigned char gr_alpha = 0;
+
+/* RGB565 -> RGBA8888 by byte: the high byte holds red and the top of green,
+ * the low byte the bottom of green and blue. Expanded fields do not overlap. */
+static uint32_t gr_rgb_hi[256];
+static uint32_t gr_rgb_lo[256];
+
 static int get_framebuffer(GGLSurface *fb)
 {
     int fd;
     struct fb_fix_screeninfo fi;
     void *bits;
+    unsigned frame_size, stride, n;
 
     fd = open("/dev/graphics/fb0", O_RDWR);
     if (fd < 0) {
@@ -88,32 +132,36 @@ static int get_framebuffer(GGLSurface *fb)
         return -1;
     }
 
-    fb->version = sizeof(*fb);
-    fb->width = vi.xres;
-    fb->height = vi.yres;
 #ifdef BOARD_HAS_JANKY_BACKBUFFER
-    fb->stride = fi.line_length/2;
+    stride = fi.line_length/2;
+    frame_size = vi.yres * fi.line_length;
 #else
-    fb->stride = vi.xres_virtual;
+    stride = vi.xres_virtual;
+    frame_size = vi.yres * vi.xres_virtual * vi.bits_per_pixel / 8;
 #endif
-    fb->data = bits;
-    fb->format = GGL_PIXEL_FORMAT_RGB_565;
-    memset(fb->data, 0, vi.yres * vi.xres_virtual * vi.bits_per_pixel / 8);
 
-    fb++;
+    /* triple buffer if there is room for it and the driver lets us pan over it */
+    gr_fb_count = 2;
+    if (fi.smem_len >= GR_MAX_FRAMEBUFFERS * frame_size) {
+        vi.yres_virtual = vi.yres * GR_MAX_FRAMEBUFFERS;
+        vi.yoffset = 0;
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &vi) == 0) {
+            gr_fb_count = GR_MAX_FRAMEBUFFERS;
+        } else {
+            perror("triple buffering not supported");
+            vi.yres_virtual = vi.yres * 2;
+        }
+    }
 
-    fb->version = sizeof(*fb);
-    fb->width = vi.xres;
-    fb->height = vi.yres;
-#ifdef BOARD_HAS_JANKY_BACKBUFFER
-    fb->stride = fi.line_length/2;
-    fb->data = (void*) (((unsigned) bits) + vi.yres * fi.line_length);
-#else
-    fb->stride = vi.xres_virtual;
-    fb->data = (void*) (((unsigned) bits) + (vi.yres * vi.xres_virtual * vi.bits_per_pixel / 8));
-#endif
-    fb->format = GGL_PIXEL_FORMAT_RGB_565;
-    memset(fb->data, 0, vi.yres * vi.xres_virtual * vi.bits_per_pixel / 8);
+    for (n = 0; n < gr_fb_count; n++, fb++) {
+        fb->version = sizeof(*fb);
+        fb->width = vi.xres;
+        fb->height = vi.yres;
+        fb->stride = stride;
+        fb->data = (void*) (((unsigned) bits) + n * frame_size);
+        fb->format = GGL_PIXEL_FORMAT_RGB_565;
+        memset(fb->data, 0, frame_size);
+    }
 
     return fd;
 }
@@ -127,68 +175,206 @@ static void get_memory_surface(GGLSurface* ms) {
   ms->format = GGL_PIXEL_FORMAT_RGB_565;
 }
 
+static long long gr_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 static void set_active_framebuffer(unsigned n)
 {
-    if (n > 1) return;
-    vi.yres_virtual = vi.yres * 2;
+    if (n >= gr_fb_count) return;
+    vi.yres_virtual = vi.yres * gr_fb_count;
     vi.yoffset = n * vi.yres;
     if (ioctl(gr_fb_fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
         perror("active fb swap failed");
     }
+    gr_pan_ns = gr_now_ns();
+}
+
+/* With two buffers the one about to be drawn is the one the display just left:
+ * wait for the pending pan to take effect before overwriting it. With three the
+ * buffer drawn is two flips old and was released by the previous vsync. */
+static void wait_for_scanout(void)
+{
+    __u32 crtc = 0;
+
+    if (gr_fb_count > 2 || !gr_vsync) return;
+    if (gr_now_ns() - gr_pan_ns > GR_FRAME_NS) return;
+    if (ioctl(gr_fb_fd, FBIO_WAITFORVSYNC, &crtc) < 0) {
+        perror("FBIO_WAITFORVSYNC not supported");
+        gr_vsync = 0;
+    }
+}
+
+static void gr_init_rgb_tables(void)
+{
+    unsigned i;
+
+    for (i = 0; i < 256; i++) {
+        unsigned red = i >> 3;
+        unsigned green = i & 0x7;
+        unsigned blue = i & 0x1F;
+
+        red = (red << 3) | (red >> 2);
+        gr_rgb_hi[i] = (0xffu << 24) | (((green << 5) | (green >> 1)) << 8) | red;
+        blue = (blue << 3) | (blue >> 2);
+        gr_rgb_lo[i] = (blue << 16) | (((i >> 5) << 2) << 8);
+    }
+}
+
+static inline uint32_t gr_rgb32(unsigned short pixel)
+{
+    return gr_rgb_hi[pixel >> 8] | gr_rgb_lo[pixel & 0xff];
 }
 
 void gr_flip_32(unsigned *bits, unsigned short *ptr, unsigned count)
 {
-   unsigned i=0;
-   while (i<count) {
-        uint32_t rgb32, red, green, blue, alpha;
-
-        /* convert 16 bits to 32 bits */
-        rgb32 = ((ptr[i] >> 11) & 0x1F);
-        red = (rgb32 << 3) | (rgb32 >> 2);
-        rgb32 = ((ptr[i] >> 5) & 0x3F);
-        green = (rgb32 << 2) | (rgb32 >> 4);
-        rgb32 = ((ptr[i]) & 0x1F);
-        blue = (rgb32 << 3) | (rgb32 >> 2);
-        alpha = 0xff;
-        rgb32 = (alpha << 24) | (blue << 16)
-        | (green << 8) | (red);
-        android_memset32((uint32_t *)bits, rgb32, 4);
-        i++;
-        bits++;
+    unsigned i = 0;
+
+    if (((unsigned long)ptr & 2) && count) {
+        *bits++ = gr_rgb32(*ptr++);
+        count--;
+    }
+    /* two pixels per 32 bit load */
+    for (; i + 4 <= count; i += 4) {
+        uint32_t p0 = *(uint32_t *)(ptr + i);
+        uint32_t p1 = *(uint32_t *)(ptr + i + 2);
+        bits[i] = gr_rgb32(p0 & 0xffff);
+        bits[i + 1] = gr_rgb32(p0 >> 16);
+        bits[i + 2] = gr_rgb32(p1 & 0xffff);
+        bits[i + 3] = gr_rgb32(p1 >> 16);
+    }
+    for (; i < count; i++) {
+        bits[i] = gr_rgb32(ptr[i]);
     }
 }
 
+#ifdef BOARD_HAS_FLIPPED_SCREEN
+/* same as gr_flip_32 but reading ptr backwards: bits[i] is ptr[count - 1 - i] */
+static void gr_flip_32_reversed(unsigned *bits, unsigned short *ptr, unsigned count)
+{
+    unsigned short *end = ptr + count;
+    unsigned i = 0;
+
+    if (((unsigned long)end & 2) && count) {
+        bits[i++] = gr_rgb32(*--end);
+    }
+    for (; i + 4 <= count; i += 4) {
+        uint32_t p0 = *(uint32_t *)(end - 2);
+        uint32_t p1 = *(uint32_t *)(end - 4);
+        bits[i] = gr_rgb32(p0 >> 16);
+        bits[i + 1] = gr_rgb32(p0 & 0xffff);
+        bits[i + 2] = gr_rgb32(p1 >> 16);
+        bits[i + 3] = gr_rgb32(p1 & 0xffff);
+        end -= 4;
+    }
+    for (; i < count; i++) {
+        bits[i] = gr_rgb32(*--end);
+    }
+}
+
+/* 16bpp reversed copy, swapping the halves of each 32 bit word */
+static void gr_copy_16_reversed(unsigned short *bits, unsigned short *ptr, unsigned count)
+{
+    unsigned short *end = ptr + count;
+    unsigned i = 0;
+
+    if ((((unsigned long)end | (unsigned long)bits) & 2) != 0) {
+        /* source and destination cannot both be word aligned */
+        if ((((unsigned long)end ^ (unsigned long)bits) & 2) == 0 && count) {
+            bits[i++] = *--end;
+        } else {
+            for (; i < count; i++) {
+                bits[i] = *--end;
+            }
+            return;
+        }
+    }
+    for (; i + 2 <= count; i += 2) {
+        uint32_t p = *(uint32_t *)(end - 2);
+        *(uint32_t *)(bits + i) = (p >> 16) | (p << 16);
+        end -= 2;
+    }
+    for (; i < count; i++) {
+        bits[i] = *--end;
+    }
+}
+#endif
+
+static void gr_mark_dirty(int top, int bottom)
+{
+    if (top < 0) top = 0;
+    if (bottom > (int)vi.yres) bottom = vi.yres;
+    if (top >= bottom) return;
+    if (top < gr_dirty_top) gr_dirty_top = top;
+    if (bottom > gr_dirty_bottom) gr_dirty_bottom = bottom;
+}
+
 void gr_flip(void)
 {
     GGLContext *gl = gr_context;
+    int top, bottom;
+    unsigned n;
 
-    /* swap front and back buffers */
-    gr_active_fb = (gr_active_fb + 1) & 1;
+    /* no framebuffer has the rows drawn since the last flip yet */
+    for (n = 0; n < gr_fb_count; n++) {
+        if (gr_dirty_top < gr_fb_dirty_top[n]) gr_fb_dirty_top[n] = gr_dirty_top;
+        if (gr_dirty_bottom > gr_fb_dirty_bottom[n]) gr_fb_dirty_bottom[n] = gr_dirty_bottom;
+    }
+    gr_dirty_top = vi.yres;
+    gr_dirty_bottom = 0;
 
-#ifdef BOARD_HAS_FLIPPED_SCREEN
-    /* flip buffer 180 degrees for devices with physicaly inverted screens */
-    unsigned int i;
-    for (i = 1; i < (vi.xres * vi.yres); i++) {
-        unsigned short tmp = gr_mem_surface.data[i];
-        gr_mem_surface.data[i] = gr_mem_surface.data[(vi.xres * vi.yres * 2) - i];
-        gr_mem_surface.data[(vi.xres * vi.yres * 2) - i] = tmp;
+    /* move on to the next back buffer */
+    gr_active_fb = (gr_active_fb + 1) % gr_fb_count;
+
+    top = gr_fb_dirty_top[gr_active_fb];
+    bottom = gr_fb_dirty_bottom[gr_active_fb];
+    if (gr_dirty_all) {
+        top = 0;
+        bottom = vi.yres;
     }
-#endif
+    gr_fb_dirty_top[gr_active_fb] = vi.yres;
+    gr_fb_dirty_bottom[gr_active_fb] = 0;
 
-    /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */ 
-    if(vi.bits_per_pixel == 32)
-    {
-        gr_flip_32((unsigned *)gr_framebuffer[gr_active_fb].data, \
-                   (unsigned short *)gr_mem_surface.data,
-                   (vi.xres_virtual * vi.yres));
+    if (top < bottom) {
+        wait_for_scanout();
     }
-    else
-    {
-        memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-               vi.xres_virtual * vi.yres *2);
+
+    /* copy the rows changed since this buffer was last displayed from the
+     * in-memory surface to the buffer we're about to make active. */
+#ifdef BOARD_HAS_FLIPPED_SCREEN
+    /* devices with physically inverted screens: rotate by 180 degrees while
+     * copying, source row y goes to row yres - 1 - y read backwards */
+    int y;
+    for (y = top; y < bottom; y++) {
+        unsigned short *src = (unsigned short *)gr_mem_surface.data + y * vi.xres_virtual;
+        unsigned offset = (vi.yres - 1 - y) * vi.xres_virtual;
+
+        if (vi.bits_per_pixel == 32) {
+            gr_flip_32_reversed((unsigned *)gr_framebuffer[gr_active_fb].data + offset,
+                                src, vi.xres);
+        } else {
+            gr_copy_16_reversed((unsigned short *)gr_framebuffer[gr_active_fb].data + offset,
+                                src, vi.xres);
+        }
     }
+#else
+    if (top < bottom) {
+        unsigned offset = top * vi.xres_virtual;
+        unsigned count = (bottom - top) * vi.xres_virtual;
+
+        if (vi.bits_per_pixel == 32) {
+            gr_flip_32((unsigned *)gr_framebuffer[gr_active_fb].data + offset,
+                       (unsigned short *)gr_mem_surface.data + offset, count);
+        } else {
+            memcpy((unsigned short *)gr_framebuffer[gr_active_fb].data + offset,
+                   (unsigned short *)gr_mem_surface.data + offset, count * 2);
+        }
+    }
+#endif
 
     /* inform the display driver */
     set_active_framebuffer(gr_active_fb);
@@ -203,6 +389,9 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+
+    gr_color565 = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+    gr_alpha = a;
 }
 
 int gr_measure(const char *s)
@@ -210,6 +399,43 @@ int gr_measure(const char *s)
     return gr_font->cwidth * strlen(s);
 }
 
+/* Opaque text straight into the memory surface from the glyph runs, clipped
+ * to the screen; y is the top of the line. */
+static int gr_text_native(int x, int y, const char *s)
+{
+    GRFont *font = gr_font;
+    unsigned short *surface = (unsigned short *) gr_mem_surface.data;
+    unsigned short color = gr_color565;
+    int width = vi.xres;
+    int first = y < 0 ? -y : 0;
+    int last = (int)vi.yres - y < (int)font->cheight ? (int)vi.yres - y : (int)font->cheight;
+    unsigned off;
+    int r;
+
+    while((off = *s++)) {
+        off -= 32;
+        if (off < 96 && x < width && x + (int)font->cwidth > 0) {
+            for (r = first; r < last; r++) {
+                unsigned short *row = surface + (y + r) * vi.xres_virtual;
+                const GRSpan *span = font->span + font->span_index[off * font->cheight + r];
+                const GRSpan *end = font->span + font->span_index[off * font->cheight + r + 1];
+
+                for (; span < end; span++) {
+                    int sx = x + span->x;
+                    int ex = sx + span->len;
+
+                    if (sx < 0) sx = 0;
+                    if (ex > width) ex = width;
+                    while (sx < ex) row[sx++] = color;
+                }
+            }
+        }
+        x += font->cwidth;
+    }
+
+    return x;
+}
+
 int gr_text(int x, int y, const char *s)
 {
     GGLContext *gl = gr_context;
@@ -217,6 +443,12 @@ int gr_text(int x, int y, const char *s)
     unsigned off;
 
     y -= font->ascent;
+    gr_mark_dirty(y, y + font->cheight);
+
+    /* blending an opaque colour over the 0/255 font alpha is a plain copy */
+    if (gr_alpha == 255) {
+        return gr_text_native(x, y, s);
+    }
 
     gl->bindTexture(gl, &font->texture);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
@@ -239,6 +471,8 @@ int gr_text(int x, int y, const char *s)
 void gr_fill(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
+    /* w and h are the right and bottom edges */
+    gr_mark_dirty(y, h);
     gl->disable(gl, GGL_TEXTURE_2D);
     gl->recti(gl, x, y, w, h);
 }
@@ -256,6 +490,7 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     gl->enable(gl, GGL_TEXTURE_2D);
     gl->texCoord2i(gl, sx - dx, sy - dy);
     gl->recti(gl, dx, dy, dx + w, dy + h);
+    gr_mark_dirty(dy, dy + h);
 }
 
 unsigned int gr_get_width(gr_surface surface) {
@@ -272,6 +507,41 @@ unsigned int gr_get_height(gr_surface surface) {
     return ((GGLSurface*) surface)->height;
 }
 
+/* Turns the A_8 font texture into runs of set pixels per glyph row; the
+ * first pass counts them, the second fills them in. */
+static void gr_init_glyph_spans(GRFont *font, const unsigned char *bits, unsigned stride)
+{
+    unsigned pass, c, r, x, n;
+
+    font->span = NULL;
+    font->span_index = malloc((96 * font->cheight + 1) * sizeof(*font->span_index));
+    for (pass = 0; pass < 2; pass++) {
+        n = 0;
+        for (c = 0; c < 96; c++) {
+            for (r = 0; r < font->cheight; r++) {
+                const unsigned char *row = bits + r * stride + c * font->cwidth;
+
+                font->span_index[c * font->cheight + r] = n;
+                for (x = 0; x < font->cwidth; x++) {
+                    unsigned start = x;
+
+                    if (!row[x]) continue;
+                    while (x < font->cwidth && row[x]) x++;
+                    if (font->span) {
+                        font->span[n].x = start;
+                        font->span[n].len = x - start;
+                    }
+                    n++;
+                }
+            }
+        }
+        font->span_index[96 * font->cheight] = n;
+        if (!font->span) {
+            font->span = malloc((n ? n : 1) * sizeof(*font->span));
+        }
+    }
+}
+
 static void gr_init_font(void)
 {
     GGLSurface *ftex;
@@ -299,10 +569,14 @@ static void gr_init_font(void)
     gr_font->cwidth = font.cwidth;
     gr_font->cheight = font.cheight;
     gr_font->ascent = font.cheight - 2;
+
+    gr_init_glyph_spans(gr_font, (unsigned char *) ftex->data, font.width);
 }
 
 int gr_init(void)
 {
+    unsigned n;
+
     gglInit(&gr_context);
     GGLContext *gl = gr_context;
 
@@ -325,9 +599,18 @@ int gr_init(void)
     }
 
     get_memory_surface(&gr_mem_surface);
+    gr_init_rgb_tables();
+
+    /* the memory surface content is undefined: copy it all to every buffer */
+    gr_dirty_top = 0;
+    gr_dirty_bottom = vi.yres;
+    for (n = 0; n < GR_MAX_FRAMEBUFFERS; n++) {
+        gr_fb_dirty_top[n] = 0;
+        gr_fb_dirty_bottom[n] = vi.yres;
+    }
 
-    fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
-            gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
+    fprintf(stderr, "framebuffer: fd %d (%d x %d), %u buffers\n",
+            gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height, gr_fb_count);
 
         /* start with 0 as front (displayed) and 1 as back (drawing) */
     gr_active_fb = 0;
@@ -365,6 +648,7 @@ int gr_fb_height(void)
 
 gr_pixel *gr_fb_data(void)
 {
+    gr_dirty_all = 1;
     return (unsigned short *) gr_mem_surface.data;
 }
 